@@ -0,0 +1,205 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filter-planar.h"
+#include "filter-simd.h"
+#include "filter.h"
+#include "log.h"
+
+/* Reports MPix/s of the SIMD-capable filters at every level the CPU supports
+ * and on planar images, with and without the conversions around them, and
+ * checks that the output matches the scalar path byte for byte. The chain
+ * shows the conversions paid once for several stencils.
+ *
+ * usage: bench-filter [width] [height] [repetitions] */
+
+static image_planar_t *planar_edge_detect(image_planar_t *image) {
+  return filter_planar_convolution33(image, filter_kernel_edge_detect);
+}
+
+static image_planar_t *planar_sharpen(image_planar_t *image) {
+  return filter_planar_convolution33(image, filter_kernel_sharpen);
+}
+
+static image_planar_t *planar_box_blur(image_planar_t *image) {
+  return filter_planar_convolution33(image, filter_kernel_box_blur);
+}
+
+static image_planar_t *planar_gaussian_blur(image_planar_t *image) {
+  return filter_planar_convolution33(image, filter_kernel_gaussian_blur);
+}
+
+static image_t *chain(image_t *image) {
+  image_t *sharpened = filter_sharpen(image);
+  image_t *blurred = filter_gaussian_blur(sharpened);
+  image_t *edges = filter_edge_detect(blurred);
+  image_destroy(sharpened);
+  image_destroy(blurred);
+  return edges;
+}
+
+static image_planar_t *planar_chain(image_planar_t *image) {
+  image_planar_t *sharpened = planar_sharpen(image);
+  image_planar_t *blurred = planar_gaussian_blur(sharpened);
+  image_planar_t *edges = planar_edge_detect(blurred);
+  image_planar_destroy(sharpened);
+  image_planar_destroy(blurred);
+  return edges;
+}
+
+struct bench_filter {
+  const char *name;
+  image_t *(*fn)(image_t *image);
+  image_planar_t *(*planar)(image_planar_t *image); /* NULL if none */
+};
+
+static const struct bench_filter filters[] = {
+    {"edge_detect", filter_edge_detect, planar_edge_detect},
+    {"sharpen", filter_sharpen, planar_sharpen},
+    {"box_blur", filter_box_blur, planar_box_blur},
+    {"gaussian_blur", filter_gaussian_blur, planar_gaussian_blur},
+    {"sobel", filter_sobel, filter_planar_sobel},
+    {"desaturate", filter_desaturate, NULL},
+    {"to_hsv", filter_to_hsv, NULL},
+    {"to_rgb", filter_to_rgb, NULL},
+    {"sharpen+gaussian_blur+edge_detect", chain, planar_chain},
+};
+
+/* the planar filter, converting from and back to interleaved pixels */
+static image_t *run_planar(const struct bench_filter *filter, image_t *image) {
+  image_planar_t *planar = image_planar_from_image(image);
+  image_planar_t *output = filter->planar(planar);
+  image_t *interleaved = image_planar_to_image(output);
+  image_planar_destroy(planar);
+  image_planar_destroy(output);
+  return interleaved;
+}
+
+static bool same_pixels(const image_t *a, const image_t *b) {
+  return a->width == b->width && a->height == b->height &&
+         memcmp(a->pixels, b->pixels,
+                a->width * a->height * sizeof(*a->pixels)) == 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+  size_t width = 1920;
+  size_t height = 1080;
+  int repetitions = 10;
+
+  if (argc > 1) {
+    width = atol(argv[1]);
+  }
+  if (argc > 2) {
+    height = atol(argv[2]);
+  }
+  if (argc > 3) {
+    repetitions = atoi(argv[3]);
+  }
+
+  if (width < 3 || height < 3 || repetitions < 1) {
+    fprintf(stderr, "usage: %s [width] [height] [repetitions]\n", argv[0]);
+    return 1;
+  }
+
+  image_t *image = image_create(0, width, height);
+  if (image == NULL) {
+    return 1;
+  }
+
+  srand(0);
+  for (size_t i = 0; i < width * height; i++) {
+    for (int k = 0; k < 4; k++) {
+      image->pixels[i].bytes[k] = rand();
+    }
+  }
+
+  filter_simd_level_t supported = filter_simd_level_supported();
+  int ret = 0;
+
+  printf("filter,level,mpix_s,speedup\n");
+  for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+    image_t *reference = NULL;
+    double scalar_rate = 0;
+
+    for (filter_simd_level_t level = FILTER_SIMD_SCALAR; level <= supported;
+         level++) {
+      filter_simd_set_level(level);
+
+      image_t *output = filters[f].fn(image);
+      if (output == NULL) {
+        return 1;
+      }
+
+      if (reference == NULL) {
+        reference = output;
+      } else {
+        if (memcmp(reference->pixels, output->pixels,
+                   reference->width * reference->height *
+                       sizeof(*output->pixels)) != 0) {
+          LOG_ERROR("%s: %s output differs from scalar", filters[f].name,
+                    filter_simd_level_name(level));
+          ret = 1;
+        }
+        image_destroy(output);
+      }
+
+      double start = now();
+      for (int r = 0; r < repetitions; r++) {
+        image_destroy(filters[f].fn(image));
+      }
+      double rate = (width * height * repetitions) / (now() - start) * 1e-6;
+
+      if (level == FILTER_SIMD_SCALAR) {
+        scalar_rate = rate;
+      }
+
+      printf("%s,%s,%.1f,%.2f\n", filters[f].name,
+             filter_simd_level_name(level), rate, rate / scalar_rate);
+    }
+
+    if (filters[f].planar != NULL) {
+      image_t *output = run_planar(&filters[f], image);
+      if (output == NULL) {
+        return 1;
+      }
+      if (!same_pixels(reference, output)) {
+        LOG_ERROR("%s: planar output differs from scalar", filters[f].name);
+        ret = 1;
+      }
+      image_destroy(output);
+
+      /* the kernel alone, as in a run of planar filters */
+      image_planar_t *planar = image_planar_from_image(image);
+      double start = now();
+      for (int r = 0; r < repetitions; r++) {
+        image_planar_destroy(filters[f].planar(planar));
+      }
+      double rate = (width * height * repetitions) / (now() - start) * 1e-6;
+      image_planar_destroy(planar);
+      printf("%s,planar,%.1f,%.2f\n", filters[f].name, rate,
+             rate / scalar_rate);
+
+      start = now();
+      for (int r = 0; r < repetitions; r++) {
+        image_destroy(run_planar(&filters[f], image));
+      }
+      rate = (width * height * repetitions) / (now() - start) * 1e-6;
+      printf("%s,planar+convert,%.1f,%.2f\n", filters[f].name, rate,
+             rate / scalar_rate);
+    }
+
+    image_destroy(reference);
+  }
+
+  image_destroy(image);
+  return ret;
+}
@@ -0,0 +1,446 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "pipeline.h"
+
+/* Runs whole pipelines on a synthetic frame set and reports, per run, the
+ * wall time, frames/s, input MPix/s, CPU utilization in cores and peak RSS
+ * as CSV, followed by the median of the repetitions. The frames are the same
+ * on every machine: gradients, bars and low-amplitude noise from a fixed
+ * seed, written once to tmpfs (/dev/shm when it exists). Every run is a
+ * forked child so that its CPU time and peak RSS are its own.
+ *
+ * With --baseline, the medians are compared with those of a CSV this tool
+ * wrote earlier for the same frames, and the exit status is 2 when one is
+ * more than --tolerance percent slower.
+ *
+ * usage: bench-pipeline [--width W] [--height H] [--frames N] [--warmup N]
+ *                       [--repetitions N] [--pipelines LIST] [--dir DIR]
+ *                       [--baseline CSV] [--tolerance PERCENT] */
+
+#define BENCH_MAX_REPETITIONS 100
+
+struct bench_pipeline {
+  const char *name;
+  int (*run)(image_dir_t *image_dir);
+};
+
+static const struct bench_pipeline pipelines[] = {
+    {"serial", pipeline_serial},
+    {"pthread", pipeline_pthread},
+    {"tbb", pipeline_tbb},
+    {"tbb-flow", pipeline_tbb_flow},
+    {"coro", pipeline_coro},
+};
+
+#define BENCH_PIPELINE_COUNT (sizeof(pipelines) / sizeof(pipelines[0]))
+
+struct bench_config {
+  size_t width;
+  size_t height;
+  size_t frames;
+  size_t warmup;
+  size_t repetitions;
+  const char *pipelines;
+  const char *dir;
+  const char *baseline;
+  double tolerance; /* percent */
+};
+
+struct bench_run {
+  double seconds;
+  double cpu_seconds;
+  double peak_rss_mib;
+};
+
+static uint32_t xorshift32(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+/* smooth areas that deflate well and noise that doesn't, like a photo */
+static void synth_frame(image_t *image, size_t index) {
+  uint32_t state = 0x9e3779b9u * (uint32_t)(index + 1);
+  size_t bar = image->width / 8 + 1;
+
+  for (size_t y = 0; y < image->height; y++) {
+    for (size_t x = 0; x < image->width; x++) {
+      uint32_t noise = xorshift32(&state);
+      pixel_t *pixel = &image->pixels[y * image->width + x];
+      bool lit = ((x + index * 16) / bar) % 2 == 0;
+
+      pixel->bytes[0] = x * 255 / image->width + (noise & 7);
+      pixel->bytes[1] = y * 255 / image->height + ((noise >> 3) & 7);
+      pixel->bytes[2] = (lit ? 192 : 64) + ((noise >> 6) & 15);
+      pixel->bytes[3] = 255;
+    }
+  }
+}
+
+static int synth_frames(const struct bench_config *config) {
+  image_t *image = image_create(0, config->width, config->height);
+  if (image == NULL) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < config->frames; i++) {
+    char path[256];
+    if (image_dir_input_path(config->dir, i, path, sizeof(path)) < 0) {
+      goto fail_destroy_image;
+    }
+
+    synth_frame(image, i);
+    if (image_save_png(image, path) < 0) {
+      goto fail_destroy_image;
+    }
+  }
+
+  image_destroy(image);
+  return 0;
+
+fail_destroy_image:
+  image_destroy(image);
+  return -1;
+}
+
+/* removes the frames and whatever the pipelines wrote next to them */
+static void remove_frames(const struct bench_config *config) {
+  for (size_t i = 0; i < config->frames; i++) {
+    char path[256];
+    if (image_dir_input_path(config->dir, i, path, sizeof(path)) < 0) {
+      continue;
+    }
+    unlink(path);
+
+    for (size_t p = 0; p < BENCH_PIPELINE_COUNT; p++) {
+      snprintf(path, sizeof(path), "%s/%s-%04zu.png", config->dir,
+               pipelines[p].name, i);
+      unlink(path);
+    }
+  }
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int run_once(const struct bench_config *config,
+                    const struct bench_pipeline *pipeline,
+                    struct bench_run *run) {
+  /* or the child would write the rows buffered so far once more */
+  fflush(stdout);
+
+  double start = now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    LOG_ERROR_ERRNO("fork");
+    return -1;
+  }
+
+  if (pid == 0) {
+    /* the pipelines print a dot per frame */
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+      _exit(1);
+    }
+
+    image_dir_t image_dir = {
+        .prefetch_depth = 8,
+        .png = image_png_default_options,
+    };
+    image_dir_reset(&image_dir, config->dir, config->dir, pipeline->name);
+    _exit((pipeline->run(&image_dir) < 0) ? 1 : 0);
+  }
+
+  int status;
+  struct rusage usage;
+  while (wait4(pid, &status, 0, &usage) < 0) {
+    if (errno != EINTR) {
+      LOG_ERROR_ERRNO("wait4");
+      return -1;
+    }
+  }
+  run->seconds = now() - start;
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    LOG_ERROR("%s pipeline failed", pipeline->name);
+    return -1;
+  }
+
+  run->cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+                     usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+  run->peak_rss_mib = usage.ru_maxrss / 1024.0; /* KiB on Linux */
+  return 0;
+}
+
+static void print_row(const struct bench_config *config, const char *name,
+                      const char *label, const struct bench_run *run) {
+  double pixels = (double)config->width * config->height * config->frames;
+  printf("%s,%zu,%zu,%zu,%s,%.4f,%.2f,%.2f,%.2f,%.1f\n", name, config->width,
+         config->height, config->frames, label, run->seconds,
+         config->frames / run->seconds, pixels / run->seconds * 1e-6,
+         run->cpu_seconds / run->seconds, run->peak_rss_mib);
+}
+
+static int compare_runs(const void *a, const void *b) {
+  double x = ((const struct bench_run *)a)->seconds;
+  double y = ((const struct bench_run *)b)->seconds;
+  return (x > y) - (x < y);
+}
+
+/* frames/s of the median row the baseline has for `name`, 0 if none */
+static double baseline_rate(const struct bench_config *config,
+                            const char *name) {
+  FILE *file = fopen(config->baseline, "r");
+  if (file == NULL) {
+    LOG_ERROR_ERRNO("fopen");
+    return 0;
+  }
+
+  char line[256];
+  double rate = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char pipeline[32];
+    char label[32];
+    size_t width, height, frames;
+    double seconds, frames_s;
+    if (sscanf(line, "%31[^,],%zu,%zu,%zu,%31[^,],%lf,%lf", pipeline, &width,
+               &height, &frames, label, &seconds, &frames_s) != 7) {
+      continue;
+    }
+
+    if (strcmp(pipeline, name) == 0 && strcmp(label, "median") == 0 &&
+        width == config->width && height == config->height &&
+        frames == config->frames) {
+      rate = frames_s;
+    }
+  }
+
+  fclose(file);
+  return rate;
+}
+
+/* returns 1 when the pipeline regressed */
+static int bench_pipeline(const struct bench_config *config,
+                          const struct bench_pipeline *pipeline) {
+  struct bench_run runs[BENCH_MAX_REPETITIONS];
+
+  for (size_t i = 0; i < config->warmup; i++) {
+    if (run_once(config, pipeline, &runs[0]) < 0) {
+      return -1;
+    }
+  }
+
+  for (size_t i = 0; i < config->repetitions; i++) {
+    if (run_once(config, pipeline, &runs[i]) < 0) {
+      return -1;
+    }
+
+    char label[16];
+    snprintf(label, sizeof(label), "%zu", i + 1);
+    print_row(config, pipeline->name, label, &runs[i]);
+  }
+
+  qsort(runs, config->repetitions, sizeof(runs[0]), compare_runs);
+  struct bench_run *median = &runs[config->repetitions / 2];
+  print_row(config, pipeline->name, "median", median);
+  fflush(stdout);
+
+  if (config->baseline == NULL) {
+    return 0;
+  }
+
+  double rate = config->frames / median->seconds;
+  double reference = baseline_rate(config, pipeline->name);
+  if (reference <= 0) {
+    fprintf(stderr, "%s: no baseline for %zux%zu x %zu frames\n",
+            pipeline->name, config->width, config->height, config->frames);
+    return 0;
+  }
+
+  double change = (rate / reference - 1) * 100;
+  if (change < -config->tolerance) {
+    fprintf(stderr, "REGRESSION %s: %.2f frames/s, baseline %.2f (%+.1f%%)\n",
+            pipeline->name, rate, reference, change);
+    return 1;
+  }
+
+  fprintf(stderr, "%s: %.2f frames/s, baseline %.2f (%+.1f%%)\n",
+          pipeline->name, rate, reference, change);
+  return 0;
+}
+
+static const struct bench_pipeline *find_pipeline(const char *name,
+                                                  size_t length) {
+  for (size_t p = 0; p < BENCH_PIPELINE_COUNT; p++) {
+    if (strlen(pipelines[p].name) == length &&
+        strncmp(pipelines[p].name, name, length) == 0) {
+      return &pipelines[p];
+    }
+  }
+  return NULL;
+}
+
+static void usage(const char *exec_name) {
+  fprintf(stderr,
+          "usage: %s [--width W] [--height H] [--frames N] [--warmup N]\n"
+          "       [--repetitions N] [--pipelines serial,pthread,tbb,tbb-flow,"
+          "coro]\n       [--dir DIR] [--baseline CSV] [--tolerance PERCENT]\n",
+          exec_name);
+  exit(1);
+}
+
+/* strtoul alone would take "-1" as ULONG_MAX and "12abc" as 12 */
+static int parse_size(const char *arg, size_t *value) {
+  char *end;
+  errno = 0;
+  unsigned long parsed = strtoul(arg, &end, 10);
+  if (!isdigit((unsigned char)arg[0]) || errno != 0 || *end != '\0') {
+    return -1;
+  }
+
+  *value = parsed;
+  return 0;
+}
+
+static int parse_args(int argc, char *argv[], struct bench_config *config) {
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 > argc - 1) {
+      return -1;
+    }
+
+    const char *value = argv[i + 1];
+    int ret = 0;
+    if (strcmp("--width", argv[i]) == 0) {
+      ret = parse_size(value, &config->width);
+    } else if (strcmp("--height", argv[i]) == 0) {
+      ret = parse_size(value, &config->height);
+    } else if (strcmp("--frames", argv[i]) == 0) {
+      ret = parse_size(value, &config->frames);
+    } else if (strcmp("--warmup", argv[i]) == 0) {
+      ret = parse_size(value, &config->warmup);
+    } else if (strcmp("--repetitions", argv[i]) == 0) {
+      ret = parse_size(value, &config->repetitions);
+    } else if (strcmp("--pipelines", argv[i]) == 0) {
+      config->pipelines = value;
+    } else if (strcmp("--dir", argv[i]) == 0) {
+      config->dir = value;
+    } else if (strcmp("--baseline", argv[i]) == 0) {
+      config->baseline = value;
+    } else if (strcmp("--tolerance", argv[i]) == 0) {
+      char *end;
+      errno = 0;
+      config->tolerance = strtod(value, &end);
+      if (errno != 0 || end == value || *end != '\0') {
+        ret = -1;
+      }
+    } else {
+      return -1;
+    }
+
+    if (ret < 0) {
+      return -1;
+    }
+    i++;
+  }
+
+  if (config->width < 3 || config->height < 3 || config->frames < 1 ||
+      config->repetitions < 1 ||
+      config->repetitions > BENCH_MAX_REPETITIONS || config->tolerance < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct bench_config config = {
+      .width = 1280,
+      .height = 720,
+      .frames = 32,
+      .warmup = 1,
+      .repetitions = 5,
+      .pipelines = "serial,pthread,tbb",
+      .dir = NULL,
+      .baseline = NULL,
+      .tolerance = 5,
+  };
+
+  if (parse_args(argc, argv, &config) < 0) {
+    usage(argv[0]);
+  }
+
+  if (filter_graph_parse(&pipeline_options.filters, FILTER_GRAPH_DEFAULT) <
+      0) {
+    return 1;
+  }
+
+  /* a private directory on tmpfs unless one is given */
+  char template[64];
+  bool created = false;
+  if (config.dir == NULL) {
+    const char *root = (access("/dev/shm", W_OK) == 0) ? "/dev/shm" : "/tmp";
+    snprintf(template, sizeof(template), "%s/bench-pipeline-XXXXXX", root);
+    if (mkdtemp(template) == NULL) {
+      LOG_ERROR_ERRNO("mkdtemp");
+      return 1;
+    }
+    config.dir = template;
+    created = true;
+  }
+
+  int ret = 0;
+  if (synth_frames(&config) < 0) {
+    ret = 1;
+    goto cleanup;
+  }
+
+  printf("pipeline,width,height,frames,run,seconds,frames_s,mpix_s,"
+         "cpu_util,peak_rss_mib\n");
+
+  const char *name = config.pipelines;
+  while (*name != '\0') {
+    size_t length = strcspn(name, ",");
+    const struct bench_pipeline *pipeline = find_pipeline(name, length);
+    if (pipeline == NULL) {
+      LOG_ERROR("unknown pipeline '%.*s'", (int)length, name);
+      ret = 1;
+      break;
+    }
+
+    int regressed = bench_pipeline(&config, pipeline);
+    if (regressed < 0) {
+      ret = 1;
+      break;
+    }
+    if (regressed > 0) {
+      ret = 2;
+    }
+
+    name += length;
+    if (*name == ',') {
+      name++;
+    }
+  }
+
+cleanup:
+  remove_frames(&config);
+  if (created && rmdir(config.dir) < 0) {
+    LOG_ERROR_ERRNO("rmdir");
+  }
+  return ret;
+}
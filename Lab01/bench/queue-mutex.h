@@ -0,0 +1,31 @@
+#ifndef BENCH_QUEUE_MUTEX_H_
+#define BENCH_QUEUE_MUTEX_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* the original mutex/condvar linked-list queue, used as a baseline */
+
+typedef struct mutex_queue_node mutex_queue_node_t;
+
+typedef struct mutex_queue_node {
+  void *value;
+  mutex_queue_node_t *prev;
+} mutex_queue_node_t;
+
+typedef struct mutex_queue {
+  size_t size;
+  size_t used;
+  mutex_queue_node_t *tail;
+  mutex_queue_node_t *head;
+  pthread_mutex_t mutex;
+  pthread_cond_t modified_item_pushed;
+  pthread_cond_t modified_item_poped;
+} mutex_queue_t;
+
+mutex_queue_t *mutex_queue_create(size_t size);
+void mutex_queue_destroy(mutex_queue_t *queue);
+int mutex_queue_push(mutex_queue_t *queue, void *ptr);
+void *mutex_queue_pop(mutex_queue_t *queue);
+
+#endif /* BENCH_QUEUE_MUTEX_H_ */
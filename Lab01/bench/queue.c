@@ -0,0 +1,205 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "queue-mutex.h"
+#include "queue.h"
+
+/* Measures items/s through a single queue with 1..N producers and 1..N
+ * consumers for both the lock-free ring buffer and the mutex queue, and
+ * for the ring buffer moving batches of items.
+ *
+ * usage: bench-queue [max threads] [items] [queue size] [batch] */
+
+struct queue_ops {
+  const char *name;
+  void *(*create)(size_t size);
+  void (*destroy)(void *queue);
+  int (*push)(void *queue, void *ptr);
+  void *(*pop)(void *queue);
+};
+
+static const struct queue_ops ring_ops = {
+    .name = "ring",
+    .create = (void *(*)(size_t))queue_create,
+    .destroy = (void (*)(void *))queue_destroy,
+    .push = (int (*)(void *, void *))queue_push,
+    .pop = (void *(*)(void *))queue_pop,
+};
+
+static const struct queue_ops mutex_ops = {
+    .name = "mutex",
+    .create = (void *(*)(size_t))mutex_queue_create,
+    .destroy = (void (*)(void *))mutex_queue_destroy,
+    .push = (int (*)(void *, void *))mutex_queue_push,
+    .pop = (void *(*)(void *))mutex_queue_pop,
+};
+
+struct worker_args {
+  const struct queue_ops *ops;
+  void *queue;
+  size_t count;
+  size_t batch;
+};
+
+static void *producer(void *arg) {
+  struct worker_args *args = arg;
+  for (size_t i = 0; i < args->count; i++) {
+    /* NULL is the end-of-stream marker, never push it as an item */
+    args->ops->push(args->queue, (void *)(uintptr_t)(i + 1));
+  }
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  struct worker_args *args = arg;
+  while (args->ops->pop(args->queue) != NULL) {
+    args->count++;
+  }
+  return NULL;
+}
+
+static void *batch_producer(void *arg) {
+  struct worker_args *args = arg;
+  void *items[args->batch];
+
+  for (size_t i = 0; i < args->count; i += args->batch) {
+    size_t n = (args->count - i < args->batch) ? args->count - i : args->batch;
+    for (size_t k = 0; k < n; k++) {
+      items[k] = (void *)(uintptr_t)(i + k + 1);
+    }
+    queue_push_batch(args->queue, items, n);
+  }
+  return NULL;
+}
+
+/* a batch may hold the end markers of other consumers, they are put back */
+static void *batch_consumer(void *arg) {
+  struct worker_args *args = arg;
+  void *items[args->batch];
+  size_t markers = 0;
+
+  while (markers == 0) {
+    size_t n = queue_pop_batch(args->queue, items, args->batch);
+    for (size_t k = 0; k < n; k++) {
+      if (items[k] == NULL) {
+        markers++;
+      } else {
+        args->count++;
+      }
+    }
+  }
+
+  for (size_t k = 1; k < markers; k++) {
+    queue_push(args->queue, NULL);
+  }
+  return NULL;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* `batch` above 0 moves the items of the ring buffer in batches */
+static double run(const struct queue_ops *ops, int producers, int consumers,
+                  size_t items, size_t size, size_t batch) {
+  void *queue = ops->create(size);
+  if (queue == NULL) {
+    return -1;
+  }
+
+  void *(*produce)(void *) = (batch > 0) ? batch_producer : producer;
+  void *(*consume)(void *) = (batch > 0) ? batch_consumer : consumer;
+
+  pthread_t producer_threads[producers];
+  pthread_t consumer_threads[consumers];
+  struct worker_args producer_args[producers];
+  struct worker_args consumer_args[consumers];
+
+  double start = now();
+
+  for (int i = 0; i < consumers; i++) {
+    consumer_args[i] = (struct worker_args){ops, queue, 0, batch};
+    pthread_create(&consumer_threads[i], NULL, consume, &consumer_args[i]);
+  }
+
+  for (int i = 0; i < producers; i++) {
+    producer_args[i] =
+        (struct worker_args){ops, queue, items / producers, batch};
+    pthread_create(&producer_threads[i], NULL, produce, &producer_args[i]);
+  }
+
+  for (int i = 0; i < producers; i++) {
+    pthread_join(producer_threads[i], NULL);
+  }
+
+  for (int i = 0; i < consumers; i++) {
+    ops->push(queue, NULL);
+  }
+
+  size_t received = 0;
+  for (int i = 0; i < consumers; i++) {
+    pthread_join(consumer_threads[i], NULL);
+    received += consumer_args[i].count;
+  }
+
+  double elapsed = now() - start;
+  ops->destroy(queue);
+
+  if (received != (items / producers) * producers) {
+    LOG_ERROR("%s: lost items (%zu received)", ops->name, received);
+    return -1;
+  }
+
+  return received / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t items = 1000000;
+  size_t size = 100;
+  size_t batch = 16;
+
+  if (argc > 1) {
+    max_threads = atol(argv[1]);
+  }
+  if (argc > 2) {
+    items = atol(argv[2]);
+  }
+  if (argc > 3) {
+    size = atol(argv[3]);
+  }
+  if (argc > 4) {
+    batch = atol(argv[4]);
+  }
+
+  if (max_threads < 1 || items == 0 || size == 0 || batch == 0) {
+    fprintf(stderr,
+            "usage: %s [max threads] [items] [queue size] [batch]\n",
+            argv[0]);
+    return 1;
+  }
+
+  printf("producers,consumers,mutex_mops,ring_mops,speedup,batch_mops,"
+         "batch_speedup\n");
+  for (int p = 1; p <= max_threads; p++) {
+    for (int c = 1; c <= max_threads; c++) {
+      double mutex = run(&mutex_ops, p, c, items, size, 0);
+      double ring = run(&ring_ops, p, c, items, size, 0);
+      double batched = run(&ring_ops, p, c, items, size, batch);
+      if (mutex < 0 || ring < 0 || batched < 0) {
+        return 1;
+      }
+      printf("%d,%d,%.3f,%.3f,%.2f,%.3f,%.2f\n", p, c, mutex * 1e-6,
+             ring * 1e-6, ring / mutex, batched * 1e-6, batched / ring);
+    }
+  }
+
+  return 0;
+}
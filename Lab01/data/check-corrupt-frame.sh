@@ -0,0 +1,54 @@
+#!/usr/bin/env bash
+
+# A frame that can't be decoded is skipped by every pipeline, which go on
+# with the next ones: it used to end the input in some of them, and to
+# deadlock --ordered waiting for its id.
+#
+# usage: check-corrupt-frame.sh BUILD_DIR
+
+build_dir="$(cd "$1" > /dev/null 2>&1 && pwd)"
+frames_dir="$(mktemp -d)"
+trap 'rm -rf "$frames_dir"' EXIT
+
+cd "$frames_dir"
+
+head --bytes="$(( 3 * 8 * 8 ))" /dev/urandom |
+    convert -depth 8 -size "8x8" RGB:- small.png
+
+for i in $(seq 0 399); do
+    cp small.png "$(printf "%04d.png" "$i")"
+done
+rm small.png
+head --bytes=32 0004.png > 0005.png
+
+"$build_dir/pipeline" --directory . --pipeline serial --quiet > /dev/null \
+    2>&1 || exit 1
+
+for args in "pthread --ordered" "pthread" "tbb --ordered" "tbb-flow" \
+        "coro --ordered" "coro"; do
+    pipeline="${args%% *}"
+    rm -f "$pipeline"-*.png
+    if ! timeout 120 "$build_dir/pipeline" --directory . --pipeline $args \
+            --loaders 2 --quiet > /dev/null 2>&1; then
+        echo -e "\nThe $args pipeline failed or hung"
+        exit 1
+    fi
+
+    if [[ -f "$pipeline-0005.png" || -f "serial-0005.png" ]]; then
+        echo -e "\nThe corrupt frame was saved by $pipeline or serial"
+        exit 1
+    fi
+
+    for file in [0-9]*.png; do
+        if [[ "$file" == 0005.png ]]; then
+            continue
+        fi
+
+        if ! cmp "serial-$file" "$pipeline-$file" > /dev/null; then
+            echo -e "\nFiles 'serial-$file' and '$pipeline-$file' don't match"
+            exit 1
+        fi
+    done
+    printf .
+done
+echo
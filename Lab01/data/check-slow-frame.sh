@@ -0,0 +1,47 @@
+#!/usr/bin/env bash
+
+# --ordered with one frame far slower to decode than the others: the frames
+# behind it fill the reorder window while it is still loading, which used to
+# deadlock the pthread pipeline with several loaders.
+#
+# usage: check-slow-frame.sh BUILD_DIR
+
+build_dir="$(cd "$1" > /dev/null 2>&1 && pwd)"
+frames_dir="$(mktemp -d)"
+trap 'rm -rf "$frames_dir"' EXIT
+
+cd "$frames_dir"
+
+head --bytes="$(( 3 * 8 * 8 ))" /dev/urandom |
+    convert -depth 8 -size "8x8" RGB:- small.png
+head --bytes="$(( 3 * 3000 * 3000 ))" /dev/urandom |
+    convert -depth 8 -size "3000x3000" RGB:- large.png
+
+for i in $(seq 0 400); do
+    if [[ "$i" == 3 ]]; then
+        cp large.png "$(printf "%04d.png" "$i")"
+    else
+        cp small.png "$(printf "%04d.png" "$i")"
+    fi
+done
+rm small.png large.png
+
+"$build_dir/pipeline" --directory . --pipeline serial --quiet > /dev/null ||
+    exit 1
+
+for pipeline in pthread tbb coro; do
+    if ! timeout 120 "$build_dir/pipeline" --directory . \
+            --pipeline "$pipeline" --ordered --loaders 4 --quiet > /dev/null; then
+        echo -e "\nThe $pipeline pipeline failed or hung"
+        exit 1
+    fi
+
+    for file in [0-9]*.png; do
+        if ! cmp "serial-$file" "$pipeline-$file" > /dev/null; then
+            echo -e "\nFiles 'serial-$file' and '$pipeline-$file' don't match"
+            exit 1
+        fi
+    done
+    printf .
+done
+echo
@@ -0,0 +1,43 @@
+#ifndef INCLUDE_AFFINITY_H_
+#define INCLUDE_AFFINITY_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* NUMA nodes the process may run on, read from /sys/devices/system/node,
+ * and threads pinned to the CPUs of one of them. Pages are placed on the
+ * node of the thread that touches them first, so a pinned thread decoding
+ * or filtering into a fresh buffer gets node-local memory without libnuma.
+ * Nodes are numbered from 0 in the order of sysfs, skipping the ones whose
+ * CPUs are all outside the process's affinity mask; a machine without the
+ * sysfs tree is a single node. */
+
+#define AFFINITY_MAX_NODES 64
+
+typedef struct affinity affinity_t;
+
+affinity_t *affinity_create(void);
+void affinity_destroy(affinity_t *affinity);
+
+size_t affinity_node_count(const affinity_t *affinity);
+
+/* the sysfs number of `node` and how many CPUs of it the process may use */
+int affinity_node_id(const affinity_t *affinity, size_t node);
+size_t affinity_node_cpus(const affinity_t *affinity, size_t node);
+
+/* pins the calling thread to the CPUs of `node`, unpin gives it back every
+ * CPU it was allowed on when the affinity was created */
+int affinity_pin(const affinity_t *affinity, size_t node);
+int affinity_unpin(const affinity_t *affinity);
+
+/* node the calling thread is pinned to, -1 if it isn't */
+int affinity_current_node(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_AFFINITY_H_ */
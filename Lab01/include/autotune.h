@@ -0,0 +1,71 @@
+#ifndef INCLUDE_AUTOTUNE_H_
+#define INCLUDE_AUTOTUNE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Calibration of the stage thread counts. The pipelines run their first
+ * frames with the default configuration while every stage records its wall
+ * and CPU time, and how many frames are in flight whenever one is loaded.
+ * The wall/CPU ratio of a stage tells how long it blocks, so the cores are
+ * shared out in proportion to the CPU time of each stage, scaled by how much
+ * longer than the least blocking stage it waits. */
+
+typedef enum autotune_stage {
+  AUTOTUNE_LOAD,
+  AUTOTUNE_FILTER,
+  AUTOTUNE_SAVE,
+  AUTOTUNE_STAGE_COUNT,
+} autotune_stage_t;
+
+typedef struct autotune autotune_t;
+
+typedef struct autotune_mark {
+  struct timespec wall;
+  struct timespec cpu;
+} autotune_mark_t;
+
+typedef struct autotune_stage_stats {
+  size_t frames;
+  double wall_ms; /* per frame */
+  double cpu_ms;
+} autotune_stage_stats_t;
+
+typedef struct autotune_stats {
+  autotune_stage_stats_t stages[AUTOTUNE_STAGE_COUNT];
+  double in_flight; /* mean frames between load and save */
+} autotune_stats_t;
+
+typedef struct autotune_config {
+  size_t loaders; /* threads running the load stage */
+  size_t workers; /* threads running the filter and save stages */
+} autotune_config_t;
+
+autotune_t *autotune_create(size_t frames);
+void autotune_destroy(autotune_t *tune);
+
+/* claims one of the calibration frames, false once they are all taken */
+bool autotune_claim(autotune_t *tune);
+
+/* times a stage on the calling thread, both do nothing when `tune` is NULL */
+void autotune_begin(autotune_t *tune, autotune_mark_t *mark);
+void autotune_end(autotune_t *tune, autotune_stage_t stage,
+                  const autotune_mark_t *mark);
+
+void autotune_get_stats(autotune_t *tune, autotune_stats_t *stats);
+
+/* overwrites `config` with the counts balancing the stages on `num_cores`
+ * cores, returns -1 and leaves it alone when nothing was measured */
+int autotune_solve(autotune_t *tune, long num_cores,
+                   autotune_config_t *config);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_AUTOTUNE_H_ */
@@ -0,0 +1,53 @@
+#ifndef INCLUDE_BUDGET_H_
+#define INCLUDE_BUDGET_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Bytes of frames in flight, shared by the threads that bring frames in and
+ * the ones that are done with them, so that a producer blocks on bytes
+ * rather than on a count of queued frames. The size of a frame is only
+ * known once it is decoded: it is charged an estimate beforehand, the size
+ * of the last frame or the whole budget for the first one, and the charge
+ * is settled afterwards. A single frame is always let in, however large.
+ * The peak and the in-flight metric only count settled bytes, never the
+ * estimates. */
+
+typedef struct budget budget_t;
+
+typedef struct budget_stats {
+  size_t limit; /* 0 when unlimited */
+  size_t peak;  /* settled bytes in flight */
+  uint64_t wait_ns;
+  size_t waits;
+} budget_stats_t;
+
+/* a limit of 0 never blocks, the bytes in flight are still accounted */
+budget_t *budget_create(size_t limit);
+void budget_destroy(budget_t *budget);
+
+/* blocks until the estimate of the next frame fits, returns it */
+size_t budget_charge(budget_t *budget);
+
+/* budget_charge without blocking, false if the estimate doesn't fit yet */
+bool budget_try_charge(budget_t *budget, size_t *charged);
+
+/* replaces a charge by the bytes the frame really needs */
+void budget_settle(budget_t *budget, size_t charged, size_t bytes);
+
+/* gives back settled bytes, cancel a charge that never was settled */
+void budget_release(budget_t *budget, size_t bytes);
+void budget_cancel(budget_t *budget, size_t charged);
+
+void budget_get_stats(budget_t *budget, budget_stats_t *stats);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_BUDGET_H_ */
@@ -0,0 +1,124 @@
+#ifndef INCLUDE_FILTER_GRAPH_H_
+#define INCLUDE_FILTER_GRAPH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "filter.h"
+#include "image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Filters to run on every frame, parsed from a comma separated list such as
+ * "to_hsv,sobel,scale_up:2,gaussian_blur". Consecutive point-wise and
+ * geometric filters are fused into a single filter_chain_t pass, stencils
+ * run on their own. `add_pixel` adds 4 * (id + 1) to the red channel of
+ * frame `id`, like the original pipelines did. */
+
+#define FILTER_GRAPH_DEFAULT "scale_up:3,add_pixel"
+#define FILTER_GRAPH_MAX_STEPS FILTER_CHAIN_MAX_OPS
+
+/* bytes of input and output a stencil band aims for, so that the three
+ * input rows each output row reads are still in the L2 cache */
+#define FILTER_GRAPH_TILE_BYTES (256 * 1024)
+
+/* how an output pixel depends on the input, which tells whether a frame can
+ * be cut into bands of rows filtered independently */
+typedef enum filter_hint {
+  FILTER_HINT_POINTWISE, /* reads the input pixel at the same place */
+  FILTER_HINT_GEOMETRIC, /* copies one input pixel from another place */
+  FILTER_HINT_STENCIL,   /* reads the 3x3 neighbourhood, shrinks by 2 */
+} filter_hint_t;
+
+typedef enum filter_graph_op {
+  FILTER_GRAPH_SCALE_UP,
+  FILTER_GRAPH_HORIZONTAL_FLIP,
+  FILTER_GRAPH_VERTICAL_FLIP,
+  FILTER_GRAPH_ADD_PIXEL,
+  FILTER_GRAPH_DESATURATE,
+  FILTER_GRAPH_TO_HSV,
+  FILTER_GRAPH_TO_RGB,
+  FILTER_GRAPH_SOBEL,
+  FILTER_GRAPH_CONVOLUTION33,
+  FILTER_GRAPH_EDGE_IDENTITY,
+  FILTER_GRAPH_EDGE_DETECT,
+  FILTER_GRAPH_SHARPEN,
+  FILTER_GRAPH_BOX_BLUR,
+  FILTER_GRAPH_GAUSSIAN_BLUR,
+} filter_graph_op_t;
+
+typedef struct filter_graph_step {
+  filter_graph_op_t op;
+  filter_hint_t hint;
+  size_t factor;      /* scale_up */
+  double m[3][3];     /* convolution33 */
+} filter_graph_step_t;
+
+/* a run of steps executed in one pass: either fused point-wise and
+ * geometric steps, or stencils: a single one, or every consecutive one on a
+ * planar copy of the frame */
+typedef struct filter_graph_stage {
+  filter_hint_t hint; /* geometric as soon as one fused step is */
+  size_t first;
+  size_t count;
+} filter_graph_stage_t;
+
+typedef struct filter_graph {
+  size_t step_count;
+  filter_graph_step_t steps[FILTER_GRAPH_MAX_STEPS];
+  size_t stage_count;
+  filter_graph_stage_t stages[FILTER_GRAPH_MAX_STEPS];
+  bool planar;
+} filter_graph_t;
+
+/* Lets a pipeline engine filter a frame in bands of rows on up to `threads`
+ * threads: `run` must call fn(arg, 0) .. fn(arg, bands - 1), in any order
+ * and on any thread, and return once they are all done. Point-wise and
+ * geometric stages are cut into `threads` bands, stencils into bands of
+ * `tile_rows` output rows (0 for cache-sized ones) read with a halo row
+ * above and below. */
+typedef void (*filter_band_fn_t)(void *arg, size_t index);
+
+typedef struct filter_splitter {
+  void (*run)(void *ctx, size_t bands, filter_band_fn_t fn, void *arg);
+  void *ctx;
+  size_t threads;
+  size_t tile_rows;
+} filter_splitter_t;
+
+int filter_graph_parse(filter_graph_t *graph, const char *spec);
+
+/* Runs consecutive stencils on image_planar_t frames, converted once before
+ * the first one and back after the last. Regroups the stages. */
+void filter_graph_set_planar(filter_graph_t *graph, bool planar);
+
+/* the names of the filters, for the help */
+const char *filter_graph_names(void);
+
+/* Runs every stage, in bands when `splitter` isn't NULL and allows more
+ * than one thread. Returns a new image, the input isn't freed. */
+image_t *filter_graph_apply(const filter_graph_t *graph, image_t *image,
+                            const filter_splitter_t *splitter);
+
+/* runs a single stage, for engines that give every stage its own node */
+image_t *filter_graph_apply_stage(const filter_graph_t *graph, size_t index,
+                                  image_t *image,
+                                  const filter_splitter_t *splitter);
+
+/* calls the standalone filters one after the other, the reference the fused
+ * stages must match byte for byte */
+image_t *filter_graph_apply_unfused(const filter_graph_t *graph,
+                                    image_t *image);
+
+/* bytes alive at once while a frame of the given size goes through the
+ * graph: the input, plus the largest input and output of a later stage */
+size_t filter_graph_footprint(const filter_graph_t *graph, size_t width,
+                              size_t height);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_FILTER_GRAPH_H_ */
@@ -0,0 +1,32 @@
+#ifndef INCLUDE_FILTER_PLANAR_H_
+#define INCLUDE_FILTER_PLANAR_H_
+
+#include "image-planar.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* The 3x3 stencils on planar images, byte-identical to filter_sobel and
+ * filter_convolution33. Every channel is a plain loop over three input rows
+ * that the compiler vectorizes; integer and dyadic kernels run on 16-bit
+ * lanes when the sums can't overflow them. */
+
+image_planar_t *filter_planar_sobel(image_planar_t *image);
+image_planar_t *filter_planar_convolution33(image_planar_t *image,
+                                            const double m[3][3]);
+
+/* write output rows [first, last) of `new_image`, 2 pixels narrower and
+ * shorter than `image`, so that bands can be filtered concurrently */
+void filter_planar_sobel_rows(image_planar_t *image, image_planar_t *new_image,
+                              size_t first, size_t last);
+void filter_planar_convolution33_rows(image_planar_t *image,
+                                      image_planar_t *new_image,
+                                      const double m[3][3], size_t first,
+                                      size_t last);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_FILTER_PLANAR_H_ */
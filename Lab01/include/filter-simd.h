@@ -0,0 +1,46 @@
+#ifndef INCLUDE_FILTER_SIMD_H_
+#define INCLUDE_FILTER_SIMD_H_
+
+#include <stdint.h>
+
+#include "image.h"
+
+/* Vectorized kernels behind filter_convolution33 (and the filters built on
+ * it), filter_sobel, filter_desaturate and the HSV conversions. The output
+ * is byte-identical to the scalar code: integer and dyadic kernels run in
+ * fixed point, the other ones accumulate in double in the same order as the
+ * scalar loop, and divisions by a byte use a table of reciprocals. */
+
+typedef enum filter_simd_level {
+  FILTER_SIMD_SCALAR,
+  FILTER_SIMD_SSE4,
+  FILTER_SIMD_AVX2,
+} filter_simd_level_t;
+
+/* best level supported by the CPU unless overridden */
+filter_simd_level_t filter_simd_level(void);
+filter_simd_level_t filter_simd_level_supported(void);
+
+/* returns the level actually selected, never above what the CPU supports */
+filter_simd_level_t filter_simd_set_level(filter_simd_level_t level);
+const char *filter_simd_level_name(filter_simd_level_t level);
+
+/* When every coefficient times 2^shift is a small integer, each product and
+ * partial sum of the scalar loop is exact in double, so the integer sum
+ * shifted right (floor) then saturated gives the same bytes. Returns the
+ * shift and fills `coefs`, or -1 for kernels such as box_blur (1/9) that
+ * must stay in double. */
+int filter_simd_fixed_shift(const double m[3][3], int32_t coefs[9]);
+
+/* `new_image` is already allocated by the caller with the output size */
+void filter_simd_convolution33(image_t *image, image_t *new_image,
+                               const double m[3][3]);
+void filter_simd_sobel(image_t *image, image_t *new_image);
+void filter_simd_desaturate(image_t *image, image_t *new_image);
+
+/* convert as many whole vectors of pixels as `count` holds and return how
+ * many were converted, the caller finishes the tail; `out` may be `in` */
+size_t filter_simd_rgb_to_hsv(const pixel_t *in, pixel_t *out, size_t count);
+size_t filter_simd_hsv_to_rgb(const pixel_t *in, pixel_t *out, size_t count);
+
+#endif /* INCLUDE_FILTER_SIMD_H_ */
@@ -22,4 +22,74 @@ image_t *filter_gaussian_blur(image_t *image);
 image_t *filter_horizontal_flip(image_t *image);
 image_t *filter_vertical_flip(image_t *image);
 
+/* The 3x3 stencils write into an output allocated by the caller, 2 pixels
+ * narrower and shorter than the input. Rows are independent: a band of
+ * input rows with one halo row above and below gives the matching band of
+ * output rows, so a frame can be filtered in bands over views of both
+ * images. */
+void filter_sobel_into(image_t *image, image_t *new_image);
+void filter_convolution33_into(image_t *image, image_t *new_image,
+                               const double m[3][3]);
+
+/* Batch HSV conversions behind filter_to_hsv and filter_to_rgb, with the
+ * same 8-bit math: `count` consecutive pixels, alpha is kept and `out` may
+ * be `in`. */
+void filter_rgb_to_hsv_row(const pixel_t *in, pixel_t *out, size_t count);
+void filter_hsv_to_rgb_row(const pixel_t *in, pixel_t *out, size_t count);
+
+/* kernels of the named convolutions */
+extern const double filter_kernel_edge_identity[3][3];
+extern const double filter_kernel_edge_detect[3][3];
+extern const double filter_kernel_sharpen[3][3];
+extern const double filter_kernel_box_blur[3][3];
+extern const double filter_kernel_gaussian_blur[3][3];
+
+/* A filter chain records geometric (scale_up, flips) and point-wise
+ * (add_pixel, desaturate, to_hsv, to_rgb) filters and applies all of them in
+ * a single pass without intermediate images. Point-wise filters commute with
+ * pixel replication and permutation, so the output is byte-identical to
+ * calling the filters one after the other. */
+
+#define FILTER_CHAIN_MAX_OPS 16
+
+typedef enum filter_op_kind {
+  FILTER_OP_SCALE_UP,
+  FILTER_OP_HORIZONTAL_FLIP,
+  FILTER_OP_VERTICAL_FLIP,
+  FILTER_OP_ADD_PIXEL,
+  FILTER_OP_DESATURATE,
+  FILTER_OP_TO_HSV,
+  FILTER_OP_TO_RGB,
+} filter_op_kind_t;
+
+typedef struct filter_op {
+  filter_op_kind_t kind;
+  size_t factor;
+  pixel_t pixel;
+} filter_op_t;
+
+typedef struct filter_chain {
+  size_t count;
+  filter_op_t ops[FILTER_CHAIN_MAX_OPS];
+} filter_chain_t;
+
+/* chains are plain values, they can live on the stack of a pipeline stage */
+void filter_chain_init(filter_chain_t *chain);
+int filter_chain_scale_up(filter_chain_t *chain, size_t factor);
+int filter_chain_horizontal_flip(filter_chain_t *chain);
+int filter_chain_vertical_flip(filter_chain_t *chain);
+int filter_chain_add_pixel(filter_chain_t *chain, pixel_t *add_pixel);
+int filter_chain_desaturate(filter_chain_t *chain);
+int filter_chain_to_hsv(filter_chain_t *chain);
+int filter_chain_to_rgb(filter_chain_t *chain);
+
+image_t *filter_chain_apply(filter_chain_t *chain, image_t *image);
+
+/* Same as filter_chain_apply, split so that disjoint bands of input rows can
+ * be filtered concurrently into one output image. apply_rows writes the
+ * output rows produced by the input rows [first, last). */
+image_t *filter_chain_create_output(filter_chain_t *chain, image_t *image);
+int filter_chain_apply_rows(filter_chain_t *chain, image_t *image,
+                            image_t *new_image, size_t first, size_t last);
+
 #endif /* INCLUDE_FILTER_H_ */
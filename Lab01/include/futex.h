@@ -0,0 +1,49 @@
+#ifndef INCLUDE_FUTEX_H_
+#define INCLUDE_FUTEX_H_
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* thin wrappers around the futex(2) syscall used to block once spinning on
+ * a lock-free structure didn't pay off */
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/* spinning is pointless when the other side can't run concurrently */
+static inline bool spin_worthwhile(void) {
+  static atomic_int smp = -1;
+  int value = atomic_load_explicit(&smp, memory_order_relaxed);
+  if (value < 0) {
+    value = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    atomic_store_explicit(&smp, value, memory_order_relaxed);
+  }
+  return value;
+}
+
+/* sleeps until `word` is woken, returns immediately if it isn't `expected` */
+static inline int futex_wait(atomic_uint *word, unsigned int expected) {
+  return syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, expected,
+                 NULL, NULL, 0);
+}
+
+static inline int futex_wake(atomic_uint *word, int count) {
+  return syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, count, NULL,
+                 NULL, 0);
+}
+
+static inline int futex_wake_all(atomic_uint *word) {
+  return futex_wake(word, INT_MAX);
+}
+
+#endif /* INCLUDE_FUTEX_H_ */
@@ -0,0 +1,47 @@
+#ifndef INCLUDE_IMAGE_CACHE_H_
+#define INCLUDE_IMAGE_CACHE_H_
+
+#include <stddef.h>
+
+#include "image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Decoded frames kept in one file across runs, so that rerunning the
+ * pipeline over the same PNG files skips their decode. Every frame is a
+ * page of header, with the source path, mtime and size it was decoded
+ * from, followed by its RGBA pixels padded to a page. Opening the cache
+ * maps the frames already in it copy-on-write; a frame found there is an
+ * image_t whose pixels point into that mapping, nothing is decoded or
+ * copied. Frames decoded during the run are appended to the file and
+ * mapped by the next run. A source file that changed is decoded again and
+ * its new frame appended, the stale one is left in the file. */
+
+typedef struct image_cache image_cache_t;
+
+/* the file is created if it doesn't exist */
+image_cache_t *image_cache_open(const char *path);
+
+/* unmaps the frames, every image loaded from the cache must be destroyed */
+void image_cache_close(image_cache_t *cache);
+
+/* number of frames mapped when the cache was opened */
+size_t image_cache_count(const image_cache_t *cache);
+
+/* the frame decoded from `source` as it is now with `id` as its id, NULL if
+ * the cache doesn't have it; thread-safe */
+image_t *image_cache_load(image_cache_t *cache, const char *source,
+                          size_t id);
+
+/* appends the frame decoded from `source`; thread-safe, a failure to write
+ * stops the cache from growing */
+int image_cache_store(image_cache_t *cache, const char *source,
+                      const image_t *image);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_IMAGE_CACHE_H_ */
@@ -0,0 +1,43 @@
+#ifndef INCLUDE_IMAGE_PLANAR_H_
+#define INCLUDE_IMAGE_PLANAR_H_
+
+#include <stddef.h>
+
+#include "image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Planar (structure of arrays) copy of an image: one byte plane per channel
+ * instead of interleaved RGBA pixels, so that a filter reads each channel
+ * with unit stride and the compiler can vectorize its loops. Frames are
+ * converted once before a run of planar filters and back after it. */
+
+#define IMAGE_PLANAR_ALIGN 64
+
+typedef struct image_planar {
+  size_t id;
+  size_t width;
+  size_t height;
+  size_t stride;            /* bytes between rows, IMAGE_PLANAR_ALIGN aligned */
+  unsigned char *planes[4]; /* R, G, B and A, in a single allocation */
+} image_planar_t;
+
+static inline unsigned char *image_planar_row(image_planar_t *image, int k,
+                                              size_t y) {
+  return &image->planes[k][y * image->stride];
+}
+
+image_planar_t *image_planar_create(size_t id, size_t width, size_t height);
+void image_planar_destroy(image_planar_t *image);
+
+/* the input isn't freed, both copies are byte for byte the same frame */
+image_planar_t *image_planar_from_image(image_t *image);
+image_t *image_planar_to_image(image_planar_t *image);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_IMAGE_PLANAR_H_ */
@@ -0,0 +1,17 @@
+#ifndef INCLUDE_IMAGE_PNG_H_
+#define INCLUDE_IMAGE_PNG_H_
+
+#include <stdio.h>
+
+#include "image.h"
+
+/* Writes `image` as an RGBA PNG, deflating `options->threads` horizontal
+ * strips concurrently. Every strip but the last ends with a sync flush so
+ * the raw deflate streams can be concatenated into a single zlib stream, and
+ * is primed with the last 32 KiB of the previous strip so compression stays
+ * close to the sequential encoder. The checksum is stitched back together
+ * with adler32_combine. */
+int image_png_write_strips(image_t *image, FILE *file,
+                           const image_png_options_t *options);
+
+#endif /* INCLUDE_IMAGE_PNG_H_ */
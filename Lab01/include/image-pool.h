@@ -0,0 +1,53 @@
+#ifndef INCLUDE_IMAGE_POOL_H_
+#define INCLUDE_IMAGE_POOL_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Size-classed cache of pixel buffers. Large frames are served by mmap in
+ * glibc, so every image_create/image_destroy pair used to cost a mmap, a
+ * munmap and a page fault per page. Buffers returned to the pool are kept,
+ * first in a small per-thread cache then in shared free lists, until the
+ * cached bytes reach the high-water mark. Size classes are 4 per power of
+ * two, so a buffer wastes at most 25%. */
+
+typedef struct image_pool image_pool_t;
+
+typedef struct image_pool_stats {
+  size_t allocs;        /* buffers handed out */
+  size_t thread_hits;   /* served from the calling thread's cache */
+  size_t shared_hits;   /* served from the shared free lists */
+  size_t system_allocs; /* had to ask malloc */
+  size_t system_frees;  /* given back to free, above the high-water mark */
+  size_t cached_bytes;
+  size_t peak_cached_bytes;
+} image_pool_stats_t;
+
+/* a high-water mark of 0 disables caching, every buffer goes to malloc */
+image_pool_t *image_pool_create(size_t high_water);
+
+/* must only be called once no thread uses the pool anymore */
+void image_pool_destroy(image_pool_t *pool);
+
+void *image_pool_alloc(image_pool_t *pool, size_t size);
+void image_pool_free(image_pool_t *pool, void *ptr, size_t size);
+
+/* pool used by image_create, NULL means plain malloc */
+void image_pool_set_default(image_pool_t *pool);
+image_pool_t *image_pool_default(void);
+
+/* pool used by image_create instead of the default one on the threads
+ * pinned to `node` (see affinity.h), so that a buffer is only reused on the
+ * node its pages live on; NULL removes it */
+void image_pool_set_node_default(int node, image_pool_t *pool);
+
+void image_pool_get_stats(image_pool_t *pool, image_pool_stats_t *stats);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_IMAGE_POOL_H_ */
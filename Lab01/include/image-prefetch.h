@@ -0,0 +1,31 @@
+#ifndef INCLUDE_IMAGE_PREFETCH_H_
+#define INCLUDE_IMAGE_PREFETCH_H_
+
+#include <stddef.h>
+
+/* Background reader used by image_dir_load_next. A thread reads up to
+ * `depth` frame files ahead of the consumer into memory, with
+ * posix_fadvise hints for the kernel readahead, so the loader only decodes
+ * and never blocks on disk while the filter stages are busy. */
+
+typedef struct image_prefetch image_prefetch_t;
+
+typedef struct image_file {
+  size_t index;
+  char path[256];
+  unsigned char *data;
+  size_t size;
+} image_file_t;
+
+image_prefetch_t *image_prefetch_create(const char *dir_name, size_t first,
+                                        size_t depth);
+
+/* stops the reader and drops the files not consumed yet */
+void image_prefetch_destroy(image_prefetch_t *prefetch);
+
+/* returns the next file in order, NULL once the next one doesn't exist or
+ * can't be read; safe to call from several threads */
+image_file_t *image_prefetch_next(image_prefetch_t *prefetch);
+void image_file_destroy(image_file_t *file);
+
+#endif /* INCLUDE_IMAGE_PREFETCH_H_ */
@@ -0,0 +1,65 @@
+#ifndef INCLUDE_IMAGE_STREAM_H_
+#define INCLUDE_IMAGE_STREAM_H_
+
+#include <stddef.h>
+
+#include "image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Frames read from or written to a pipe, a FIFO or a file instead of one PNG
+ * file each, so that the pipeline can sit in an ffmpeg chain:
+ *
+ *   ffmpeg -i in.mp4 -f yuv4mpegpipe - | pipeline --input-format y4m ... \
+ *     --output-format y4m | ffmpeg -f yuv4mpegpipe -i - out.mp4
+ *
+ * rgba-raw frames are the pixels of an image_t as they are, read straight
+ * into the frame buffer and written straight out of it. y4m frames are
+ * 4:2:0, 4:4:4 or mono YUV with BT.601 limited range, converted outside of
+ * the stream lock. Frames get the ids 0, 1, 2... in stream order, like the
+ * files of an image_dir_t, and any thread can read or write them. */
+
+typedef enum image_format {
+  IMAGE_FORMAT_PNG, /* a file per frame, no stream */
+  IMAGE_FORMAT_Y4M,
+  IMAGE_FORMAT_RGBA_RAW,
+} image_format_t;
+
+typedef struct image_stream image_stream_t;
+
+/* the stream owns `fd`; rgba-raw frames have no header, so their size must
+ * be given, y4m streams take it from theirs */
+image_stream_t *image_stream_create_reader(int fd, image_format_t format,
+                                           size_t width, size_t height);
+
+/* y4m output keeps the frame rate, aspect and chroma of `reader` when it is
+ * a y4m stream; every frame must have the size of the first one */
+image_stream_t *image_stream_create_writer(int fd, image_format_t format,
+                                           const image_stream_t *reader);
+
+/* a writer first writes the frames still held back, in id order; returns -1
+ * if anything failed to be read or written */
+int image_stream_destroy(image_stream_t *stream);
+
+/* NULL at the end of the stream or on error */
+image_t *image_stream_read(image_stream_t *stream);
+
+/* Frames that arrive ahead of their turn are copied and held back until the
+ * ones before them are written or skipped; the pipelines bound how many with
+ * their reorder window, or with image_stream_held. */
+int image_stream_write(image_stream_t *stream, image_t *image);
+
+/* frame `id` will never be written, e.g. it failed to filter, the frames
+ * held back behind it are written; an error shows in image_stream_destroy */
+void image_stream_skip(image_stream_t *stream, size_t id);
+
+/* frames written ahead of their turn and held back */
+size_t image_stream_held(image_stream_t *stream);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_IMAGE_STREAM_H_ */
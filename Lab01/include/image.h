@@ -17,6 +17,8 @@ typedef struct image {
   size_t width;
   size_t height;
   pixel_t *pixels;
+  struct image_pool *pool; /* owner of `pixels`, NULL if malloc'd */
+  bool mapped; /* `pixels` point into an image_cache_t and aren't freed */
 } image_t;
 
 static inline pixel_t *image_get_pixel(image_t *image, unsigned int x,
@@ -28,11 +30,36 @@ static inline pixel_t *image_get_pixel(image_t *image, unsigned int x,
   return &image->pixels[x + y * image->width];
 }
 
+typedef enum image_png_filter {
+  IMAGE_PNG_FILTER_ADAPTIVE, /* best of the five per row, libpng's default */
+  IMAGE_PNG_FILTER_NONE,
+  IMAGE_PNG_FILTER_SUB,
+  IMAGE_PNG_FILTER_UP,
+  IMAGE_PNG_FILTER_AVG,
+  IMAGE_PNG_FILTER_PAETH,
+} image_png_filter_t;
+
+#define IMAGE_PNG_LEVEL_DEFAULT -1
+
+typedef struct image_png_options {
+  int level;                 /* zlib level 0-9 or IMAGE_PNG_LEVEL_DEFAULT */
+  image_png_filter_t filter; /* row filter written before deflate */
+  int threads;               /* above 1, strips are deflated in parallel */
+} image_png_options_t;
+
+extern const image_png_options_t image_png_default_options;
+
 image_t *image_create(size_t id, size_t width, size_t height);
 image_t *image_create_from_png(char *filename);
+/* decodes straight into `dest` when not NULL, its size must match the file */
+image_t *image_create_from_png_into(char *filename, image_t *dest);
+image_t *image_create_from_png_memory(const char *name, const void *data,
+                                      size_t size, image_t *dest);
 image_t *image_copy(image_t *image);
 void image_destroy(image_t *image);
 int image_save_png(image_t *image, char *filename);
+int image_save_png_with_options(image_t *image, char *filename,
+                                const image_png_options_t *options);
 
 typedef struct image_dir {
   const char *input_dir_name;
@@ -40,11 +67,42 @@ typedef struct image_dir {
   const char *save_prefix;
   size_t load_current;
   bool stop;
+  image_png_options_t png; /* used by image_dir_save */
+  size_t prefetch_depth;   /* files read ahead by a thread, 0 to disable */
+  struct image_prefetch *prefetch;
+
+  /* frames come from and go to these instead of files when not NULL, see
+   * image-stream.h; the stream is written in id order */
+  struct image_stream *input_stream;
+  struct image_stream *output_stream;
+
+  /* decoded frames are taken from and added to it when not NULL, see
+   * image-cache.h; a cache that has frames replaces the prefetch thread */
+  struct image_cache *cache;
 } image_dir_t;
 
-image_t *image_dir_load_next(image_dir_t *image_dir);
+int image_dir_input_path(const char *input_dir_name, size_t index,
+                         char *buffer, size_t buffer_size);
+
+/* starts the prefetch thread if enabled, image_dir_load_next does it on its
+ * first call; image_dir_close stops it */
+int image_dir_open(image_dir_t *image_dir);
+void image_dir_close(image_dir_t *image_dir);
+
+/* `*image` is NULL at the end of the input. -1 when the frame `*id` can't
+ * be decoded: that id never comes and the next call goes on after it. */
+int image_dir_load_next(image_dir_t *image_dir, image_t **image, size_t *id);
+
+/* thread-safe variant, frames come out of order with their index as `id`
+ * and the directory must already be open */
+int image_dir_load_any(image_dir_t *image_dir, image_t **image, size_t *id);
 int image_dir_save(image_dir_t *image_dir, image_t *image);
 
+/* image_dir_save in two steps, the frame is written under a hidden name then
+ * renamed into place, so frames encoded in parallel can appear in order */
+int image_dir_save_tmp(image_dir_t *image_dir, image_t *image);
+int image_dir_commit(image_dir_t *image_dir, size_t id);
+
 void image_dir_reset(image_dir_t *image_dir, const char *input_dir_name,
                      const char *output_dir_name, const char *save_prefix);
 
@@ -0,0 +1,69 @@
+#ifndef INCLUDE_METRICS_H_
+#define INCLUDE_METRICS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Run-time instrumentation behind --stats and --stats-json. Every thread
+ * records into a buffer of its own, registered on first use, so recording
+ * never takes a lock; the buffers are merged once the run is over. Values
+ * go into HDR-style histograms: each power of two is split into
+ * METRICS_SUB_BUCKETS linear buckets, which keeps every percentile within
+ * 1/16 of the true value whatever its magnitude. */
+
+#define METRICS_SUB_BUCKETS 16
+#define METRICS_BUCKETS ((64 - 3) * METRICS_SUB_BUCKETS)
+#define METRICS_MAX_STALLS 8
+
+typedef enum metrics_series {
+  METRICS_LOAD,        /* ns to decode a frame */
+  METRICS_FILTER,      /* ns to run the filter graph on it */
+  METRICS_SAVE,        /* ns to encode and write it */
+  METRICS_QUEUE_DEPTH, /* frames waiting in the injection queue */
+  METRICS_IN_FLIGHT,   /* bytes of frames loaded and not yet saved */
+  METRICS_SERIES_COUNT,
+} metrics_series_t;
+
+typedef struct metrics_histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+typedef struct metrics_summary {
+  uint64_t count;
+  double mean;
+  uint64_t p50; /* upper bounds of the buckets, capped by max */
+  uint64_t p99;
+  uint64_t max;
+} metrics_summary_t;
+
+/* begin resets every series and starts recording, end stops it */
+void metrics_begin(void);
+void metrics_end(void);
+
+/* monotonic ns, 0 while not recording so that callers pay nothing */
+uint64_t metrics_now(void);
+void metrics_record(metrics_series_t series, uint64_t value);
+void metrics_record_since(metrics_series_t series, uint64_t start);
+
+/* time threads spent blocked, added up per `name` (a string literal) */
+void metrics_add_stall(const char *name, uint64_t ns, size_t count);
+
+/* only once the threads that recorded are done */
+void metrics_get_summary(metrics_series_t series, metrics_summary_t *summary);
+void metrics_print(FILE *file);
+int metrics_write_json(const char *path);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_METRICS_H_ */
@@ -3,15 +3,120 @@
 #ifndef INCLUDE_PIPELINE_H_
 #define INCLUDE_PIPELINE_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "autotune.h"
+#include "filter-graph.h"
+#include "image-pool.h"
 #include "image.h"
+#include "metrics.h"
+#include "reorder.h"
+#include "trace.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
 
+/* --split: whether a frame is filtered by several threads at once */
+typedef enum pipeline_split {
+  PIPELINE_SPLIT_AUTO,   /* when too few frames are queued to keep them busy */
+  PIPELINE_SPLIT_NEVER,
+  PIPELINE_SPLIT_ALWAYS, /* even small frames, for testing */
+} pipeline_split_t;
+
+/* --batch: at most a deque of the pthread scheduler */
+#define PIPELINE_BATCH_MAX 256
+
+typedef struct pipeline_options {
+  bool stats;             /* --stats */
+  const char *stats_json; /* --stats-json, NULL unless given */
+  size_t pool_high_water; /* --pool-high-water, in bytes */
+  size_t loaders;         /* --loaders, 0 for one per core */
+  size_t workers;         /* --workers, 0 for the default */
+  size_t autotune;        /* --autotune, frames to calibrate on */
+  bool ordered;           /* --ordered */
+  filter_graph_t filters; /* --filters and --planar, set before any run */
+  pipeline_split_t split; /* --split */
+  size_t tile_rows;       /* --tile-rows, 0 for cache-sized stencil bands */
+  size_t max_memory;      /* --max-memory, pthread/coro bytes, 0 for any */
+  bool numa;              /* --numa, pthread threads and pools per node */
+
+  /* pthread: frames a loader hands to the workers at once and the longest
+   * it holds one back to fill a batch, --batch and --batch-latency */
+  size_t batch;
+  uint64_t batch_latency_ns;
+
+  /* tbb-flow: concurrency of each node, 0 for unlimited (one per core for
+   * load), bytes of frames in flight and the thumbnail branch */
+  size_t flow_load;
+  size_t flow_filter; /* every filter stage gets a node of its own */
+  size_t flow_encode;
+  size_t flow_budget;
+  bool thumbnails;
+} pipeline_options_t;
+
+extern pipeline_options_t pipeline_options;
+
+/* installs a default image pool for the duration of a pipeline run, the end
+ * call prints its statistics when --stats is given */
+image_pool_t *pipeline_pool_begin(void);
+void pipeline_pool_end(image_pool_t *pool);
+
+/* with --ordered, frames are saved under a temporary name in parallel and
+ * renamed in id order; with stream output, the window bounds the frames the
+ * stream holds back. begin returns NULL otherwise. pipeline_save blocks
+ * beyond the window, so a pipeline must hold such frames back where the
+ * earlier ones don't need the thread, see reorder_wait. */
+reorder_t *pipeline_reorder_begin(image_dir_t *image_dir, size_t window);
+void pipeline_reorder_end(reorder_t *reorder);
+
+/* save stage shared by the parallel pipelines, `reorder` may be NULL; a
+ * frame that won't be saved must be skipped so the later ones go on */
+int pipeline_save(image_dir_t *image_dir, reorder_t *reorder, image_t *image);
+void pipeline_save_skip(image_dir_t *image_dir, reorder_t *reorder, size_t id);
+
+/* number of threads decoding frames concurrently */
+size_t pipeline_loader_count(void);
+
+/* threads to filter a frame on when `threads` could, while `backlog` other
+ * frames wait to be filtered or are being filtered: 1 when the frame is too
+ * small to be worth splitting, or when the backlog already keeps every
+ * thread busy with a frame of its own */
+size_t pipeline_split_threads(const image_t *image, size_t threads,
+                              size_t backlog);
+
+/* filter_splitter_t callback running the bands with tbb::parallel_for */
+void pipeline_tbb_split(void *ctx, size_t bands, filter_band_fn_t fn,
+                        void *arg);
+
+/* number of pthread workers, or of tbb tokens */
+size_t pipeline_worker_count(void);
+
+/* times a stage for --autotune, where `tune` isn't NULL, for the --stats
+ * histograms and for the --trace timeline */
+typedef struct pipeline_mark {
+  autotune_mark_t tune;
+  uint64_t start;
+  uint64_t traced;
+} pipeline_mark_t;
+
+void pipeline_stage_begin(autotune_t *tune, pipeline_mark_t *mark);
+void pipeline_stage_end(autotune_t *tune, autotune_stage_t stage,
+                        const pipeline_mark_t *mark);
+
+/* with --autotune, the first frames are a calibration run whose stages are
+ * timed; begin returns NULL otherwise. The end call prints the measurements
+ * and updates `config` for the rest of the run. */
+autotune_t *pipeline_autotune_begin(void);
+void pipeline_autotune_end(autotune_t *tune, autotune_config_t *config);
+
 int pipeline_serial(image_dir_t *image_dir);
 int pipeline_pthread(image_dir_t *image_dir);
 int pipeline_tbb(image_dir_t *image_dir);
+int pipeline_tbb_flow(image_dir_t *image_dir);
+int pipeline_coro(image_dir_t *image_dir);
 
 #ifdef __cplusplus
 } /* extern "C" */
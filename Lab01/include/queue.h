@@ -3,31 +3,75 @@
 #ifndef INCLUDE_QUEUE_H_
 #define INCLUDE_QUEUE_H_
 
-#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
-#include "queue.h"
+#define QUEUE_CACHE_LINE 64
 
-typedef struct queue_node queue_node_t;
+/* bounded multi-producer/multi-consumer ring buffer, every cell carries a
+ * sequence number telling whether it is ready to be written or read (see
+ * https://www.1024cores.net/home/lock-free-algorithms/queues) */
 
-typedef struct queue_node {
+typedef struct queue_cell {
+  _Alignas(QUEUE_CACHE_LINE) atomic_size_t sequence;
   void *value;
-  queue_node_t *prev;
-} queue_node_t;
+} queue_cell_t;
 
 typedef struct queue {
-  size_t size;
-  size_t used;
-  queue_node_t *tail;
-  queue_node_t *head;
-  pthread_mutex_t mutex;
-  pthread_cond_t modified_item_pushed;
-  pthread_cond_t modified_item_poped;
+  /* producers and consumers each get their own cache line */
+  _Alignas(QUEUE_CACHE_LINE) atomic_size_t head;
+  _Alignas(QUEUE_CACHE_LINE) atomic_size_t tail;
+
+  /* futex words bumped after every push/pop, and the number of threads
+   * about to sleep on each, only woken when there are some */
+  _Alignas(QUEUE_CACHE_LINE) atomic_uint pushed;
+  atomic_uint pop_sleeping;
+  _Alignas(QUEUE_CACHE_LINE) atomic_uint poped;
+  atomic_uint push_sleeping;
+
+  _Alignas(QUEUE_CACHE_LINE) size_t size;
+  size_t mask;
+  int spin_count;
+  queue_cell_t *cells;
+
+  /* time spent asleep on a full/empty queue, only touched by sleepers */
+  _Alignas(QUEUE_CACHE_LINE) _Atomic uint64_t push_wait_ns;
+  atomic_size_t push_waits;
+  _Atomic uint64_t pop_wait_ns;
+  atomic_size_t pop_waits;
 } queue_t;
 
+typedef struct queue_stats {
+  uint64_t push_wait_ns;
+  size_t push_waits;
+  uint64_t pop_wait_ns;
+  size_t pop_waits;
+} queue_stats_t;
+
+/* `size` is rounded up to the next power of two */
 queue_t *queue_create(size_t size);
 void queue_destroy(queue_t *queue);
 int queue_push(queue_t *queue, void *ptr);
 void *queue_pop(queue_t *queue);
 
+/* non-blocking variants, return false if the queue is full/empty */
+bool queue_try_push(queue_t *queue, void *ptr);
+bool queue_try_pop(queue_t *queue, void **ptr);
+
+/* Batches claim as many consecutive cells as are ready with a single CAS
+ * and wake the other side once, instead of once per value. All of them
+ * return how many values they moved: push_batch blocks until every value is
+ * in and pop_batch until at least one is out, so they only come short on
+ * error; the try variants never block. */
+size_t queue_push_batch(queue_t *queue, void *const *ptrs, size_t count);
+size_t queue_pop_batch(queue_t *queue, void **ptrs, size_t max);
+size_t queue_try_push_batch(queue_t *queue, void *const *ptrs, size_t count);
+size_t queue_try_pop_batch(queue_t *queue, void **ptrs, size_t max);
+
+/* values in the queue, a snapshot that may be stale by the time it returns */
+size_t queue_depth(queue_t *queue);
+void queue_get_stats(queue_t *queue, queue_stats_t *stats);
+
 #endif /* INCLUDE_QUEUE_H_ */
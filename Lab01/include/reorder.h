@@ -0,0 +1,54 @@
+#ifndef INCLUDE_REORDER_H_
+#define INCLUDE_REORDER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Reorder buffer keyed on consecutive ids. Items are pushed in any order
+ * from any thread and committed one at a time in id order, by whichever
+ * pusher completes the next id. The window is bounded: a push more than
+ * `window` ids ahead of the next one to commit blocks until it catches up,
+ * so producers must be able to finish the missing ids without waiting on
+ * the reorder buffer themselves. */
+
+typedef struct reorder reorder_t;
+
+typedef void (*reorder_commit_fn_t)(size_t id, void *item, void *arg);
+
+typedef struct reorder_stats {
+  size_t committed;
+  size_t skipped;
+  size_t peak_items; /* items waiting for an earlier id */
+  size_t peak_bytes; /* as declared by reorder_push */
+  size_t window;
+  size_t window_bytes; /* bookkeeping of the window itself */
+} reorder_stats_t;
+
+reorder_t *reorder_create(size_t window, size_t first_id,
+                          reorder_commit_fn_t commit, void *arg);
+
+/* commits what is left in id order, skipping ids that never arrived */
+void reorder_destroy(reorder_t *reorder);
+
+/* `bytes` is only accounted for in the statistics */
+int reorder_push(reorder_t *reorder, size_t id, void *item, size_t bytes);
+
+/* lets the window move past an id that will never be pushed */
+int reorder_skip(reorder_t *reorder, size_t id);
+
+/* whether a push of `id` would go through right away; reorder_wait blocks
+ * until it would, for a producer that must not wait in reorder_push */
+bool reorder_fits(reorder_t *reorder, size_t id);
+void reorder_wait(reorder_t *reorder, size_t id);
+
+void reorder_get_stats(reorder_t *reorder, reorder_stats_t *stats);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_REORDER_H_ */
@@ -0,0 +1,111 @@
+#ifndef INCLUDE_SCHEDULER_H_
+#define INCLUDE_SCHEDULER_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "affinity.h"
+#include "queue.h"
+
+/* Work-stealing task scheduler. Every worker owns a bounded deque: it pushes
+ * and pops its own tasks at the bottom (LIFO, so a frame stays on the core
+ * that touched it last) while idle workers steal from the top (FIFO, oldest
+ * task first). Tasks submitted from outside the pool go through a bounded
+ * injection queue, which blocks the submitter when the pool falls behind.
+ *
+ * Given an affinity, the workers are pinned to its NUMA nodes in turn and
+ * every node gets an injection queue of its own, fed by the threads pinned
+ * to it. A worker looks for tasks on its node first and only then steals
+ * from the other nodes. */
+
+#define SCHEDULER_DEQUE_SIZE 256
+
+typedef struct task task_t;
+typedef void (*task_fn_t)(task_t *task);
+
+/* embed at the start of a larger structure and set `fn` before spawning, a
+ * task may re-spawn itself with another `fn` to run the next stage */
+typedef struct task {
+  task_fn_t fn;
+} task_t;
+
+typedef struct scheduler scheduler_t;
+
+typedef struct scheduler_deque {
+  _Alignas(QUEUE_CACHE_LINE) atomic_long top;
+  _Alignas(QUEUE_CACHE_LINE) atomic_long bottom;
+  _Alignas(QUEUE_CACHE_LINE) _Atomic(task_t *) tasks[SCHEDULER_DEQUE_SIZE];
+} scheduler_deque_t;
+
+typedef struct scheduler_worker {
+  scheduler_deque_t deque;
+  scheduler_t *scheduler;
+  pthread_t thread;
+  int id;
+  int node;
+  unsigned int seed;
+
+  /* statistics, only written by the worker itself */
+  size_t executed;
+  size_t steals;
+  size_t remote_steals; /* tasks taken from another node */
+  size_t idle;
+  uint64_t idle_ns; /* asleep for lack of tasks */
+} scheduler_worker_t;
+
+typedef struct scheduler {
+  int num_workers;
+  scheduler_worker_t *workers;
+  const affinity_t *affinity; /* NULL when the workers aren't pinned */
+  int num_nodes;
+  queue_t **injection; /* one per node */
+  size_t batch;        /* tasks a worker takes from an injection queue */
+
+  _Alignas(QUEUE_CACHE_LINE) atomic_size_t pending;
+  atomic_bool shutdown;
+  _Alignas(QUEUE_CACHE_LINE) atomic_uint epoch;
+  atomic_uint sleepers;
+} scheduler_t;
+
+/* `affinity` may be NULL, it must outlive the scheduler. A worker takes up
+ * to `batch` tasks at once from an injection queue, runs the first one and
+ * leaves the others on its deque, where idle workers steal them. */
+scheduler_t *scheduler_create(int num_workers, size_t queue_size,
+                              const affinity_t *affinity, size_t batch);
+
+/* waits for every spawned task to complete, then stops the workers */
+void scheduler_join(scheduler_t *scheduler);
+void scheduler_destroy(scheduler_t *scheduler);
+
+/* pushes on the calling worker's deque, or on the injection queue of the
+ * node the calling thread is pinned to when it doesn't belong to the
+ * scheduler */
+int scheduler_spawn(scheduler_t *scheduler, task_t *task);
+
+/* scheduler_spawn for a thread outside the scheduler, with a single push
+ * and wakeup for all the tasks; returns how many were spawned, the others
+ * are left to the caller */
+size_t scheduler_spawn_batch(scheduler_t *scheduler, task_t **tasks,
+                             size_t count);
+
+/* tasks waiting in the injection queues and their push/pop waits, added up
+ * over every node */
+size_t scheduler_injection_depth(scheduler_t *scheduler);
+size_t scheduler_injection_capacity(scheduler_t *scheduler);
+void scheduler_get_injection_stats(scheduler_t *scheduler,
+                                   queue_stats_t *stats);
+
+/* Runs fn(arg, 0) .. fn(arg, count - 1) as tasks of the calling worker and
+ * returns once they are all done. The caller runs the ones nobody stole and
+ * sleeps until the stolen ones are done, it never picks up unrelated work
+ * while it waits. Called from a thread outside the pool, it runs them all
+ * inline. */
+void scheduler_parallel_for(scheduler_t *scheduler, size_t count,
+                            void (*fn)(void *arg, size_t index), void *arg);
+
+void scheduler_print_stats(scheduler_t *scheduler, FILE *file);
+
+#endif /* INCLUDE_SCHEDULER_H_ */
@@ -0,0 +1,40 @@
+#ifndef INCLUDE_TRACE_H_
+#define INCLUDE_TRACE_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Timeline of a run behind --trace, written in the Chrome trace-event format
+ * that chrome://tracing and ui.perfetto.dev load. Every thread appends the
+ * spans it ran to a ring buffer of its own, registered on first use, so
+ * tracing never takes a lock once a thread has recorded; a thread that
+ * records more than TRACE_RING_EVENTS spans keeps the most recent ones. The
+ * buffers are only read by trace_write, once the threads are done. */
+
+#define TRACE_RING_EVENTS (1 << 14)
+
+/* begin drops the spans of a previous run and starts recording, end stops */
+void trace_begin(void);
+void trace_end(void);
+
+/* monotonic ns, 0 while not recording so that callers pay nothing */
+uint64_t trace_now(void);
+
+/* a span from `start` to now named `name` (a string literal), `frame` is
+ * the id of the image it worked on or -1; does nothing when start is 0 */
+void trace_span(const char *name, uint64_t start, int64_t frame);
+
+/* names the calling thread in the timeline, "loader 3" for ("loader", 3),
+ * just `name` when `index` is negative */
+void trace_set_thread_name(const char *name, int index);
+
+int trace_write(const char *path);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* __cplusplus */
+
+#endif /* INCLUDE_TRACE_H_ */
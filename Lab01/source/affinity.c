@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "affinity.h"
+#include "log.h"
+
+#define AFFINITY_SYSFS "/sys/devices/system/node"
+
+struct affinity {
+  size_t node_count;
+  int ids[AFFINITY_MAX_NODES];
+  cpu_set_t cpus[AFFINITY_MAX_NODES];
+  cpu_set_t allowed; /* the process's mask when created */
+};
+
+static __thread int affinity_node = -1;
+
+/* parses a sysfs list such as "0-3,8-11", -1 if it can't be read */
+static int affinity_read_list(const char *path, cpu_set_t *set) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return -1;
+  }
+
+  char line[4096];
+  bool read = fgets(line, sizeof(line), file) != NULL;
+  fclose(file);
+  if (!read) {
+    return -1;
+  }
+
+  CPU_ZERO(set);
+  char *it = line;
+  while (*it != '\0' && *it != '\n') {
+    char *end;
+    long first = strtol(it, &end, 10);
+    if (end == it) {
+      return -1;
+    }
+
+    long last = first;
+    if (*end == '-') {
+      it = end + 1;
+      last = strtol(it, &end, 10);
+      if (end == it) {
+        return -1;
+      }
+    }
+
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    it = (*end == ',') ? end + 1 : end;
+  }
+
+  return 0;
+}
+
+affinity_t *affinity_create(void) {
+  affinity_t *affinity = calloc(1, sizeof(*affinity));
+  if (affinity == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_exit;
+  }
+
+  if (sched_getaffinity(0, sizeof(affinity->allowed), &affinity->allowed) <
+      0) {
+    LOG_ERROR_ERRNO("sched_getaffinity");
+    goto fail_free_affinity;
+  }
+
+  cpu_set_t online;
+  if (affinity_read_list(AFFINITY_SYSFS "/online", &online) == 0) {
+    for (int id = 0;
+         id < CPU_SETSIZE && affinity->node_count < AFFINITY_MAX_NODES; id++) {
+      if (!CPU_ISSET(id, &online)) {
+        continue;
+      }
+
+      char path[64];
+      snprintf(path, sizeof(path), AFFINITY_SYSFS "/node%d/cpulist", id);
+      cpu_set_t *cpus = &affinity->cpus[affinity->node_count];
+      if (affinity_read_list(path, cpus) < 0) {
+        continue;
+      }
+
+      /* memory-only nodes and nodes outside of the mask have no CPU left */
+      CPU_AND(cpus, cpus, &affinity->allowed);
+      if (CPU_COUNT(cpus) == 0) {
+        continue;
+      }
+      affinity->ids[affinity->node_count++] = id;
+    }
+  }
+
+  if (affinity->node_count == 0) {
+    affinity->ids[0] = 0;
+    affinity->cpus[0] = affinity->allowed;
+    affinity->node_count = 1;
+  }
+
+  return affinity;
+
+fail_free_affinity:
+  free(affinity);
+fail_exit:
+  return NULL;
+}
+
+void affinity_destroy(affinity_t *affinity) { free(affinity); }
+
+size_t affinity_node_count(const affinity_t *affinity) {
+  return affinity->node_count;
+}
+
+int affinity_node_id(const affinity_t *affinity, size_t node) {
+  return affinity->ids[node];
+}
+
+size_t affinity_node_cpus(const affinity_t *affinity, size_t node) {
+  return CPU_COUNT(&affinity->cpus[node]);
+}
+
+int affinity_pin(const affinity_t *affinity, size_t node) {
+  errno = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                 &affinity->cpus[node]);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_setaffinity_np");
+    return -1;
+  }
+
+  affinity_node = node;
+  return 0;
+}
+
+int affinity_unpin(const affinity_t *affinity) {
+  errno = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                 &affinity->allowed);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_setaffinity_np");
+    return -1;
+  }
+
+  affinity_node = -1;
+  return 0;
+}
+
+int affinity_current_node(void) { return affinity_node; }
@@ -0,0 +1,173 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "autotune.h"
+#include "log.h"
+
+typedef struct autotune_totals {
+  size_t frames;
+  uint64_t wall_ns;
+  uint64_t cpu_ns;
+} autotune_totals_t;
+
+struct autotune {
+  size_t remaining; /* calibration frames left to claim */
+
+  pthread_mutex_t mutex;
+  autotune_totals_t totals[AUTOTUNE_STAGE_COUNT];
+  size_t in_flight;
+  size_t in_flight_sum;
+  size_t in_flight_samples;
+};
+
+autotune_t *autotune_create(size_t frames) {
+  autotune_t *tune = calloc(1, sizeof(*tune));
+  if (tune == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_exit;
+  }
+
+  tune->remaining = frames;
+
+  errno = pthread_mutex_init(&tune->mutex, NULL);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_mutex_init");
+    goto fail_free_tune;
+  }
+
+  return tune;
+
+fail_free_tune:
+  free(tune);
+fail_exit:
+  return NULL;
+}
+
+void autotune_destroy(autotune_t *tune) {
+  pthread_mutex_destroy(&tune->mutex);
+  free(tune);
+}
+
+bool autotune_claim(autotune_t *tune) {
+  size_t remaining = __atomic_load_n(&tune->remaining, __ATOMIC_RELAXED);
+  while (remaining > 0) {
+    if (__atomic_compare_exchange_n(&tune->remaining, &remaining,
+                                    remaining - 1, true, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void autotune_begin(autotune_t *tune, autotune_mark_t *mark) {
+  if (tune == NULL) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &mark->wall);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &mark->cpu);
+}
+
+static uint64_t autotune_elapsed_ns(const struct timespec *start,
+                                    const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1000000000ull + end->tv_nsec -
+         start->tv_nsec;
+}
+
+void autotune_end(autotune_t *tune, autotune_stage_t stage,
+                  const autotune_mark_t *mark) {
+  if (tune == NULL) {
+    return;
+  }
+
+  struct timespec wall;
+  struct timespec cpu;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+
+  pthread_mutex_lock(&tune->mutex);
+  autotune_totals_t *totals = &tune->totals[stage];
+  totals->frames++;
+  totals->wall_ns += autotune_elapsed_ns(&mark->wall, &wall);
+  totals->cpu_ns += autotune_elapsed_ns(&mark->cpu, &cpu);
+
+  /* frames are in flight from the end of their load to the end of their
+   * save, a frame that failed to filter stays counted */
+  if (stage == AUTOTUNE_LOAD) {
+    tune->in_flight++;
+    tune->in_flight_sum += tune->in_flight;
+    tune->in_flight_samples++;
+  } else if (stage == AUTOTUNE_SAVE && tune->in_flight > 0) {
+    tune->in_flight--;
+  }
+  pthread_mutex_unlock(&tune->mutex);
+}
+
+void autotune_get_stats(autotune_t *tune, autotune_stats_t *stats) {
+  pthread_mutex_lock(&tune->mutex);
+  for (int i = 0; i < AUTOTUNE_STAGE_COUNT; i++) {
+    autotune_totals_t *totals = &tune->totals[i];
+    autotune_stage_stats_t *stage = &stats->stages[i];
+
+    stage->frames = totals->frames;
+    stage->wall_ms = 0;
+    stage->cpu_ms = 0;
+    if (totals->frames > 0) {
+      stage->wall_ms = totals->wall_ns / 1e6 / totals->frames;
+      stage->cpu_ms = totals->cpu_ns / 1e6 / totals->frames;
+    }
+  }
+
+  stats->in_flight = 0;
+  if (tune->in_flight_samples > 0) {
+    stats->in_flight =
+        (double)tune->in_flight_sum / (double)tune->in_flight_samples;
+  }
+  pthread_mutex_unlock(&tune->mutex);
+}
+
+static size_t autotune_clamp(double threads, size_t max) {
+  size_t count = (size_t)ceil(threads);
+  return (count < 1) ? 1 : (count > max) ? max : count;
+}
+
+int autotune_solve(autotune_t *tune, long num_cores,
+                   autotune_config_t *config) {
+  autotune_stats_t stats;
+  autotune_get_stats(tune, &stats);
+
+  double cpu_total = 0;
+  double min_stretch = INFINITY;
+  double stretch[AUTOTUNE_STAGE_COUNT];
+
+  for (int i = 0; i < AUTOTUNE_STAGE_COUNT; i++) {
+    autotune_stage_stats_t *stage = &stats.stages[i];
+    if (stage->frames == 0 || stage->cpu_ms <= 0) {
+      return -1;
+    }
+
+    /* preemption stretches every stage alike when threads outnumber the
+     * cores, only the stretch beyond the least blocking stage is waiting */
+    stretch[i] = stage->wall_ms / stage->cpu_ms;
+    if (stretch[i] < min_stretch) {
+      min_stretch = stretch[i];
+    }
+    cpu_total += stage->cpu_ms;
+  }
+
+  double threads[AUTOTUNE_STAGE_COUNT];
+  for (int i = 0; i < AUTOTUNE_STAGE_COUNT; i++) {
+    threads[i] = num_cores * stats.stages[i].cpu_ms / cpu_total *
+                 stretch[i] / min_stretch;
+  }
+
+  /* the waiting is what extra threads can hide, cap it at 4 per core */
+  size_t max_threads = (num_cores > 1) ? num_cores * 4 : 4;
+  config->loaders = autotune_clamp(threads[AUTOTUNE_LOAD], max_threads);
+  config->workers = autotune_clamp(
+      threads[AUTOTUNE_FILTER] + threads[AUTOTUNE_SAVE], max_threads);
+  return 0;
+}
@@ -0,0 +1,140 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "budget.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+
+struct budget {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond; /* signaled whenever bytes are given back */
+
+  size_t limit;
+  size_t used;    /* settled bytes and pending charges */
+  size_t settled; /* bytes of the frames whose size is known */
+  size_t estimate;
+  budget_stats_t stats;
+};
+
+budget_t *budget_create(size_t limit) {
+  budget_t *budget = calloc(1, sizeof(*budget));
+  if (budget == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_exit;
+  }
+
+  budget->limit = limit;
+  budget->estimate = limit;
+  budget->stats.limit = limit;
+
+  errno = pthread_mutex_init(&budget->mutex, NULL);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_mutex_init");
+    goto fail_free_budget;
+  }
+
+  errno = pthread_cond_init(&budget->cond, NULL);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_cond_init");
+    goto fail_destroy_mutex;
+  }
+
+  return budget;
+
+fail_destroy_mutex:
+  pthread_mutex_destroy(&budget->mutex);
+fail_free_budget:
+  free(budget);
+fail_exit:
+  return NULL;
+}
+
+void budget_destroy(budget_t *budget) {
+  pthread_cond_destroy(&budget->cond);
+  pthread_mutex_destroy(&budget->mutex);
+  free(budget);
+}
+
+static uint64_t budget_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* called with the mutex held */
+static bool budget_fits(budget_t *budget) {
+  return budget->limit == 0 || budget->used == 0 ||
+         budget->used + budget->estimate <= budget->limit;
+}
+
+
+size_t budget_charge(budget_t *budget) {
+  pthread_mutex_lock(&budget->mutex);
+  if (!budget_fits(budget)) {
+    uint64_t traced = trace_now();
+    uint64_t start = budget_now_ns();
+    while (!budget_fits(budget)) {
+      pthread_cond_wait(&budget->cond, &budget->mutex);
+    }
+    budget->stats.wait_ns += budget_now_ns() - start;
+    budget->stats.waits++;
+    trace_span("budget wait", traced, -1);
+  }
+
+  size_t charged = budget->estimate;
+  budget->used += charged;
+  pthread_mutex_unlock(&budget->mutex);
+  return charged;
+}
+
+bool budget_try_charge(budget_t *budget, size_t *charged) {
+  pthread_mutex_lock(&budget->mutex);
+  bool fits = budget_fits(budget);
+  if (fits) {
+    *charged = budget->estimate;
+    budget->used += *charged;
+  }
+  pthread_mutex_unlock(&budget->mutex);
+  return fits;
+}
+
+void budget_settle(budget_t *budget, size_t charged, size_t bytes) {
+  pthread_mutex_lock(&budget->mutex);
+  budget->used = budget->used - charged + bytes;
+  budget->settled += bytes;
+  budget->estimate = bytes;
+  if (budget->settled > budget->stats.peak) {
+    budget->stats.peak = budget->settled;
+  }
+  size_t settled = budget->settled;
+  if (bytes < charged) {
+    pthread_cond_broadcast(&budget->cond);
+  }
+  pthread_mutex_unlock(&budget->mutex);
+
+  metrics_record(METRICS_IN_FLIGHT, settled);
+}
+
+void budget_release(budget_t *budget, size_t bytes) {
+  pthread_mutex_lock(&budget->mutex);
+  budget->used -= bytes;
+  budget->settled -= bytes;
+  pthread_cond_broadcast(&budget->cond);
+  pthread_mutex_unlock(&budget->mutex);
+}
+
+void budget_cancel(budget_t *budget, size_t charged) {
+  pthread_mutex_lock(&budget->mutex);
+  budget->used -= charged;
+  pthread_cond_broadcast(&budget->cond);
+  pthread_mutex_unlock(&budget->mutex);
+}
+
+void budget_get_stats(budget_t *budget, budget_stats_t *stats) {
+  pthread_mutex_lock(&budget->mutex);
+  *stats = budget->stats;
+  pthread_mutex_unlock(&budget->mutex);
+}
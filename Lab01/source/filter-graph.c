@@ -0,0 +1,598 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter-graph.h"
+#include "filter-planar.h"
+#include "log.h"
+#include "trace.h"
+
+typedef struct filter_graph_desc {
+  const char *name;
+  filter_graph_op_t op;
+  filter_hint_t hint;
+  const double (*kernel)[3]; /* named convolutions, run banded from it */
+} filter_graph_desc_t;
+
+static const filter_graph_desc_t filter_graph_descs[] = {
+    {"scale_up", FILTER_GRAPH_SCALE_UP, FILTER_HINT_GEOMETRIC, NULL},
+    {"horizontal_flip", FILTER_GRAPH_HORIZONTAL_FLIP, FILTER_HINT_GEOMETRIC,
+     NULL},
+    {"vertical_flip", FILTER_GRAPH_VERTICAL_FLIP, FILTER_HINT_GEOMETRIC, NULL},
+    {"add_pixel", FILTER_GRAPH_ADD_PIXEL, FILTER_HINT_POINTWISE, NULL},
+    {"desaturate", FILTER_GRAPH_DESATURATE, FILTER_HINT_POINTWISE, NULL},
+    {"to_hsv", FILTER_GRAPH_TO_HSV, FILTER_HINT_POINTWISE, NULL},
+    {"to_rgb", FILTER_GRAPH_TO_RGB, FILTER_HINT_POINTWISE, NULL},
+    {"sobel", FILTER_GRAPH_SOBEL, FILTER_HINT_STENCIL, NULL},
+    {"convolution33", FILTER_GRAPH_CONVOLUTION33, FILTER_HINT_STENCIL, NULL},
+    {"edge_identity", FILTER_GRAPH_EDGE_IDENTITY, FILTER_HINT_STENCIL,
+     filter_kernel_edge_identity},
+    {"edge_detect", FILTER_GRAPH_EDGE_DETECT, FILTER_HINT_STENCIL,
+     filter_kernel_edge_detect},
+    {"sharpen", FILTER_GRAPH_SHARPEN, FILTER_HINT_STENCIL,
+     filter_kernel_sharpen},
+    {"box_blur", FILTER_GRAPH_BOX_BLUR, FILTER_HINT_STENCIL,
+     filter_kernel_box_blur},
+    {"gaussian_blur", FILTER_GRAPH_GAUSSIAN_BLUR, FILTER_HINT_STENCIL,
+     filter_kernel_gaussian_blur},
+};
+
+#define FILTER_GRAPH_DESC_COUNT                                                \
+  (sizeof(filter_graph_descs) / sizeof(filter_graph_descs[0]))
+
+const char *filter_graph_names(void) {
+  return "scale_up:N, horizontal_flip, vertical_flip, add_pixel, "
+         "desaturate, to_hsv, to_rgb, sobel, convolution33:M1:..:M9, "
+         "edge_identity, edge_detect, sharpen, box_blur, gaussian_blur";
+}
+
+/* names of the steps and stages in the --trace timeline */
+static const char *filter_graph_step_name(const filter_graph_step_t *step) {
+  for (size_t i = 0; i < FILTER_GRAPH_DESC_COUNT; i++) {
+    if (filter_graph_descs[i].op == step->op) {
+      return filter_graph_descs[i].name;
+    }
+  }
+  return "filter";
+}
+
+static const char *filter_graph_stage_name(const filter_graph_t *graph,
+                                           const filter_graph_stage_t *stage) {
+  if (stage->hint == FILTER_HINT_STENCIL && graph->planar) {
+    return "planar stencils";
+  }
+  if (stage->count > 1) {
+    return "chain";
+  }
+  return filter_graph_step_name(&graph->steps[stage->first]);
+}
+
+/* `args` points right after the ':' of the filter name, or is NULL */
+static int filter_graph_parse_args(filter_graph_step_t *step, char *args) {
+  char *end;
+
+  switch (step->op) {
+  case FILTER_GRAPH_SCALE_UP:
+    if (args == NULL) {
+      LOG_ERROR("scale_up needs a factor, as in scale_up:3");
+      return -1;
+    }
+
+    step->factor = strtoul(args, &end, 10);
+    if (end == args || *end != '\0' || step->factor == 0) {
+      LOG_ERROR("invalid scale_up factor '%s'", args);
+      return -1;
+    }
+    return 0;
+  case FILTER_GRAPH_CONVOLUTION33:
+    for (int k = 0; k < 9; k++) {
+      if (args == NULL) {
+        LOG_ERROR("convolution33 needs 9 coefficients separated by ':'");
+        return -1;
+      }
+
+      step->m[k / 3][k % 3] = strtod(args, &end);
+      if (end == args || *end != (k < 8 ? ':' : '\0')) {
+        LOG_ERROR("invalid convolution33 coefficient '%s'", args);
+        return -1;
+      }
+      args = (k < 8) ? end + 1 : NULL;
+    }
+    return 0;
+  default:
+    break;
+  }
+
+  if (args != NULL) {
+    LOG_ERROR("filter doesn't take arguments: '%s'", args);
+    return -1;
+  }
+  return 0;
+}
+
+static int filter_graph_parse_step(filter_graph_t *graph, char *token) {
+  if (graph->step_count == FILTER_GRAPH_MAX_STEPS) {
+    LOG_ERROR("more than %d filters", FILTER_GRAPH_MAX_STEPS);
+    return -1;
+  }
+
+  char *args = strchr(token, ':');
+  if (args != NULL) {
+    *args++ = '\0';
+  }
+
+  for (size_t i = 0; i < FILTER_GRAPH_DESC_COUNT; i++) {
+    const filter_graph_desc_t *desc = &filter_graph_descs[i];
+    if (strcmp(desc->name, token) != 0) {
+      continue;
+    }
+
+    filter_graph_step_t *step = &graph->steps[graph->step_count++];
+    memset(step, 0, sizeof(*step));
+    step->op = desc->op;
+    step->hint = desc->hint;
+    step->factor = 1;
+    if (desc->kernel != NULL) {
+      memcpy(step->m, desc->kernel, sizeof(step->m));
+    }
+    return filter_graph_parse_args(step, args);
+  }
+
+  LOG_ERROR("unknown filter '%s'", token);
+  return -1;
+}
+
+/* a stencil is a stage of its own, the other steps join the stage before
+ * them unless it is a stencil */
+static void filter_graph_build_stages(filter_graph_t *graph) {
+  graph->stage_count = 0;
+
+  filter_graph_stage_t *stage = NULL;
+
+  for (size_t n = 0; n < graph->step_count; n++) {
+    filter_graph_step_t *step = &graph->steps[n];
+
+    bool stencil = step->hint == FILTER_HINT_STENCIL;
+    if (stage == NULL || stencil != (stage->hint == FILTER_HINT_STENCIL) ||
+        (stencil && !graph->planar)) {
+      stage = &graph->stages[graph->stage_count++];
+      stage->hint = step->hint;
+      stage->first = n;
+      stage->count = 0;
+    }
+
+    if (step->hint == FILTER_HINT_GEOMETRIC) {
+      stage->hint = FILTER_HINT_GEOMETRIC;
+    }
+    stage->count++;
+  }
+}
+
+void filter_graph_set_planar(filter_graph_t *graph, bool planar) {
+  graph->planar = planar;
+  filter_graph_build_stages(graph);
+}
+
+int filter_graph_parse(filter_graph_t *graph, const char *spec) {
+  graph->step_count = 0;
+  graph->stage_count = 0;
+
+  char *copy = strdup(spec);
+  if (copy == NULL) {
+    LOG_ERROR_ERRNO("strdup");
+    goto fail_exit;
+  }
+
+  char *saveptr;
+  for (char *token = strtok_r(copy, ",", &saveptr); token != NULL;
+       token = strtok_r(NULL, ",", &saveptr)) {
+    if (filter_graph_parse_step(graph, token) < 0) {
+      goto fail_free_copy;
+    }
+  }
+
+  if (graph->step_count == 0) {
+    LOG_ERROR("no filter given");
+    goto fail_free_copy;
+  }
+
+  free(copy);
+  filter_graph_build_stages(graph);
+  return 0;
+
+fail_free_copy:
+  free(copy);
+fail_exit:
+  return -1;
+}
+
+static pixel_t filter_graph_frame_pixel(image_t *image) {
+  pixel_t pixel = {.bytes = {0, 0, 0, 0}};
+  pixel.bytes[0] = (unsigned char)((4 * (image->id + 1)) % 256);
+  return pixel;
+}
+
+static void filter_graph_build_chain(const filter_graph_t *graph,
+                                     const filter_graph_stage_t *stage,
+                                     image_t *image, filter_chain_t *chain) {
+  pixel_t pixel = filter_graph_frame_pixel(image);
+
+  filter_chain_init(chain);
+  for (size_t n = stage->first; n < stage->first + stage->count; n++) {
+    const filter_graph_step_t *step = &graph->steps[n];
+    switch (step->op) {
+    case FILTER_GRAPH_SCALE_UP:
+      filter_chain_scale_up(chain, step->factor);
+      break;
+    case FILTER_GRAPH_HORIZONTAL_FLIP:
+      filter_chain_horizontal_flip(chain);
+      break;
+    case FILTER_GRAPH_VERTICAL_FLIP:
+      filter_chain_vertical_flip(chain);
+      break;
+    case FILTER_GRAPH_ADD_PIXEL:
+      filter_chain_add_pixel(chain, &pixel);
+      break;
+    case FILTER_GRAPH_DESATURATE:
+      filter_chain_desaturate(chain);
+      break;
+    case FILTER_GRAPH_TO_HSV:
+      filter_chain_to_hsv(chain);
+      break;
+    case FILTER_GRAPH_TO_RGB:
+      filter_chain_to_rgb(chain);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+static image_t *filter_graph_apply_step(const filter_graph_step_t *step,
+                                        image_t *image) {
+  if (step->hint == FILTER_HINT_STENCIL &&
+      (image->width < 3 || image->height < 3)) {
+    LOG_ERROR("image %zu is too small for a 3x3 filter (%zux%zu)", image->id,
+              image->width, image->height);
+    return NULL;
+  }
+
+  pixel_t pixel = filter_graph_frame_pixel(image);
+
+  switch (step->op) {
+  case FILTER_GRAPH_SCALE_UP:
+    return filter_scale_up(image, step->factor);
+  case FILTER_GRAPH_HORIZONTAL_FLIP:
+    return filter_horizontal_flip(image);
+  case FILTER_GRAPH_VERTICAL_FLIP:
+    return filter_vertical_flip(image);
+  case FILTER_GRAPH_ADD_PIXEL:
+    return filter_add_pixel(image, &pixel);
+  case FILTER_GRAPH_DESATURATE:
+    return filter_desaturate(image);
+  case FILTER_GRAPH_TO_HSV:
+    return filter_to_hsv(image);
+  case FILTER_GRAPH_TO_RGB:
+    return filter_to_rgb(image);
+  case FILTER_GRAPH_SOBEL:
+    return filter_sobel(image);
+  case FILTER_GRAPH_CONVOLUTION33:
+    return filter_convolution33(image, step->m);
+  case FILTER_GRAPH_EDGE_IDENTITY:
+    return filter_edge_identity(image);
+  case FILTER_GRAPH_EDGE_DETECT:
+    return filter_edge_detect(image);
+  case FILTER_GRAPH_SHARPEN:
+    return filter_sharpen(image);
+  case FILTER_GRAPH_BOX_BLUR:
+    return filter_box_blur(image);
+  case FILTER_GRAPH_GAUSSIAN_BLUR:
+    return filter_gaussian_blur(image);
+  }
+
+  return NULL;
+}
+
+/* a view of rows [first, first + count) sharing the pixels of `image`,
+ * never to be destroyed */
+static image_t filter_graph_rows(image_t *image, size_t first, size_t count) {
+  return (image_t){
+      .id = image->id,
+      .width = image->width,
+      .height = count,
+      .pixels = &image->pixels[first * image->width],
+      .pool = NULL,
+  };
+}
+
+struct filter_graph_tiles {
+  const filter_graph_step_t *step;
+  image_t *image;
+  image_t *new_image;
+  size_t rows;
+};
+
+static void filter_graph_tile(void *arg, size_t index) {
+  struct filter_graph_tiles *job = arg;
+  uint64_t start = trace_now();
+  size_t first = index * job->rows;
+  size_t count = job->new_image->height - first;
+  if (count > job->rows) {
+    count = job->rows;
+  }
+
+  /* output rows [first, first + count) read input rows
+   * [first, first + count + 2) */
+  image_t in = filter_graph_rows(job->image, first, count + 2);
+  image_t out = filter_graph_rows(job->new_image, first, count);
+
+  if (job->step->op == FILTER_GRAPH_SOBEL) {
+    filter_sobel_into(&in, &out);
+  } else {
+    filter_convolution33_into(&in, &out, job->step->m);
+  }
+  trace_span("tile", start, job->image->id);
+}
+
+static image_t *filter_graph_apply_stencil(const filter_graph_step_t *step,
+                                           image_t *image,
+                                           const filter_splitter_t *splitter) {
+  if (splitter == NULL || splitter->threads < 2 || image->width < 3 ||
+      image->height < 3) {
+    return filter_graph_apply_step(step, image);
+  }
+
+  struct filter_graph_tiles job = {
+      .step = step,
+      .image = image,
+      .new_image =
+          image_create(image->id, image->width - 2, image->height - 2),
+      .rows = splitter->tile_rows,
+  };
+  if (job.new_image == NULL) {
+    return NULL;
+  }
+
+  if (job.rows == 0) {
+    job.rows = FILTER_GRAPH_TILE_BYTES / (2 * image->width * sizeof(pixel_t));
+  }
+  if (job.rows == 0) {
+    job.rows = 1;
+  }
+
+  size_t tiles = (job.new_image->height + job.rows - 1) / job.rows;
+  splitter->run(splitter->ctx, tiles, filter_graph_tile, &job);
+  return job.new_image;
+}
+
+struct filter_graph_planar_tiles {
+  const filter_graph_step_t *step;
+  image_planar_t *image;
+  image_planar_t *new_image;
+  size_t rows;
+};
+
+static void filter_graph_planar_tile(void *arg, size_t index) {
+  struct filter_graph_planar_tiles *job = arg;
+  uint64_t start = trace_now();
+  size_t first = index * job->rows;
+  size_t last = first + job->rows;
+  if (last > job->new_image->height) {
+    last = job->new_image->height;
+  }
+
+  if (job->step->op == FILTER_GRAPH_SOBEL) {
+    filter_planar_sobel_rows(job->image, job->new_image, first, last);
+  } else {
+    filter_planar_convolution33_rows(job->image, job->new_image, job->step->m,
+                                     first, last);
+  }
+  trace_span("tile", start, job->image->id);
+}
+
+static image_planar_t *
+filter_graph_apply_planar_step(const filter_graph_step_t *step,
+                               image_planar_t *image,
+                               const filter_splitter_t *splitter) {
+  if (image->width < 3 || image->height < 3) {
+    LOG_ERROR("image %zu is too small for a 3x3 filter (%zux%zu)", image->id,
+              image->width, image->height);
+    return NULL;
+  }
+
+  struct filter_graph_planar_tiles job = {
+      .step = step,
+      .image = image,
+      .new_image =
+          image_planar_create(image->id, image->width - 2, image->height - 2),
+  };
+  if (job.new_image == NULL) {
+    return NULL;
+  }
+
+  if (splitter == NULL || splitter->threads < 2) {
+    job.rows = job.new_image->height;
+    filter_graph_planar_tile(&job, 0);
+    return job.new_image;
+  }
+
+  /* a plane row is a quarter of an interleaved one */
+  job.rows = splitter->tile_rows;
+  if (job.rows == 0) {
+    job.rows = FILTER_GRAPH_TILE_BYTES / (2 * image->stride * 4);
+  }
+  if (job.rows == 0) {
+    job.rows = 1;
+  }
+
+  size_t tiles = (job.new_image->height + job.rows - 1) / job.rows;
+  splitter->run(splitter->ctx, tiles, filter_graph_planar_tile, &job);
+  return job.new_image;
+}
+
+static image_t *filter_graph_apply_planar(const filter_graph_t *graph,
+                                          const filter_graph_stage_t *stage,
+                                          image_t *image,
+                                          const filter_splitter_t *splitter) {
+  image_planar_t *current = image_planar_from_image(image);
+  if (current == NULL) {
+    return NULL;
+  }
+
+  for (size_t n = stage->first; n < stage->first + stage->count; n++) {
+    image_planar_t *next =
+        filter_graph_apply_planar_step(&graph->steps[n], current, splitter);
+    image_planar_destroy(current);
+    if (next == NULL) {
+      return NULL;
+    }
+    current = next;
+  }
+
+  image_t *output = image_planar_to_image(current);
+  image_planar_destroy(current);
+  return output;
+}
+
+struct filter_graph_bands {
+  filter_chain_t *chain;
+  image_t *image;
+  image_t *new_image;
+  size_t bands;
+  bool failed;
+};
+
+static void filter_graph_band(void *arg, size_t index) {
+  struct filter_graph_bands *job = arg;
+  uint64_t start = trace_now();
+  size_t first = job->image->height * index / job->bands;
+  size_t last = job->image->height * (index + 1) / job->bands;
+
+  if (filter_chain_apply_rows(job->chain, job->image, job->new_image, first,
+                              last) < 0) {
+    __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+  }
+  trace_span("band", start, job->image->id);
+}
+
+static image_t *filter_graph_apply_chain(filter_chain_t *chain, image_t *image,
+                                         const filter_splitter_t *splitter) {
+  if (splitter == NULL || splitter->threads < 2 ||
+      image->height < splitter->threads) {
+    return filter_chain_apply(chain, image);
+  }
+
+  struct filter_graph_bands job = {
+      .chain = chain,
+      .image = image,
+      .new_image = filter_chain_create_output(chain, image),
+      .bands = splitter->threads,
+      .failed = false,
+  };
+  if (job.new_image == NULL) {
+    return NULL;
+  }
+
+  splitter->run(splitter->ctx, job.bands, filter_graph_band, &job);
+  if (job.failed) {
+    image_destroy(job.new_image);
+    return NULL;
+  }
+
+  return job.new_image;
+}
+
+static image_t *filter_graph_run_stage(const filter_graph_t *graph,
+                                       const filter_graph_stage_t *stage,
+                                       image_t *image,
+                                       const filter_splitter_t *splitter) {
+  if (stage->hint == FILTER_HINT_STENCIL && graph->planar) {
+    return filter_graph_apply_planar(graph, stage, image, splitter);
+  }
+  if (stage->hint == FILTER_HINT_STENCIL) {
+    return filter_graph_apply_stencil(&graph->steps[stage->first], image,
+                                      splitter);
+  }
+
+  filter_chain_t chain;
+  filter_graph_build_chain(graph, stage, image, &chain);
+  return filter_graph_apply_chain(&chain, image, splitter);
+}
+
+image_t *filter_graph_apply_stage(const filter_graph_t *graph, size_t index,
+                                  image_t *image,
+                                  const filter_splitter_t *splitter) {
+  const filter_graph_stage_t *stage = &graph->stages[index];
+  uint64_t start = trace_now();
+  image_t *output = filter_graph_run_stage(graph, stage, image, splitter);
+  trace_span(filter_graph_stage_name(graph, stage), start, image->id);
+  return output;
+}
+
+image_t *filter_graph_apply(const filter_graph_t *graph, image_t *image,
+                            const filter_splitter_t *splitter) {
+  image_t *current = image;
+
+  for (size_t s = 0; s < graph->stage_count; s++) {
+    image_t *next = filter_graph_apply_stage(graph, s, current, splitter);
+    if (current != image) {
+      image_destroy(current);
+    }
+    if (next == NULL) {
+      return NULL;
+    }
+    current = next;
+  }
+
+  return current;
+}
+
+image_t *filter_graph_apply_unfused(const filter_graph_t *graph,
+                                    image_t *image) {
+  image_t *current = image;
+
+  for (size_t n = 0; n < graph->step_count; n++) {
+    uint64_t start = trace_now();
+    image_t *next = filter_graph_apply_step(&graph->steps[n], current);
+    trace_span(filter_graph_step_name(&graph->steps[n]), start, image->id);
+    if (current != image) {
+      image_destroy(current);
+    }
+    if (next == NULL) {
+      return NULL;
+    }
+    current = next;
+  }
+
+  return current;
+}
+
+size_t filter_graph_footprint(const filter_graph_t *graph, size_t width,
+                              size_t height) {
+  size_t input = width * height * sizeof(pixel_t);
+  size_t current = input;
+  size_t peak = 0;
+
+  for (size_t s = 0; s < graph->stage_count; s++) {
+    const filter_graph_stage_t *stage = &graph->stages[s];
+
+    for (size_t n = stage->first; n < stage->first + stage->count; n++) {
+      if (stage->hint == FILTER_HINT_STENCIL) {
+        width = (width > 2) ? width - 2 : 0;
+        height = (height > 2) ? height - 2 : 0;
+      } else {
+        width *= graph->steps[n].factor;
+        height *= graph->steps[n].factor;
+      }
+    }
+
+    /* the input of the first stage is already counted */
+    size_t output = width * height * sizeof(pixel_t);
+    size_t alive = output + ((s > 0) ? current : 0);
+    if (alive > peak) {
+      peak = alive;
+    }
+    current = output;
+  }
+
+  return input + peak;
+}
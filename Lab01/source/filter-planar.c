@@ -0,0 +1,165 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter-planar.h"
+#include "filter-simd.h"
+
+#define clamp(x, min, max) ((x) < (min)) ? (min) : (((x) > (max)) ? (max) : (x))
+
+/* the three input rows an output row reads, and the output row */
+typedef struct planar_rows {
+  const unsigned char *restrict top;
+  const unsigned char *restrict middle;
+  const unsigned char *restrict bottom;
+  unsigned char *restrict out;
+} planar_rows_t;
+
+static planar_rows_t planar_rows(image_planar_t *image,
+                                 image_planar_t *new_image, int k, size_t y) {
+  return (planar_rows_t){
+      .top = image_planar_row(image, k, y),
+      .middle = image_planar_row(image, k, y + 1),
+      .bottom = image_planar_row(image, k, y + 2),
+      .out = image_planar_row(new_image, k, y),
+  };
+}
+
+/* like the interleaved filters, alpha is copied from the center pixel */
+static void planar_copy_alpha(image_planar_t *image, image_planar_t *new_image,
+                              size_t y) {
+  memcpy(image_planar_row(new_image, 3, y),
+         image_planar_row(image, 3, y + 1) + 1, new_image->width);
+}
+
+static void planar_sobel_row(planar_rows_t rows, size_t width) {
+  const unsigned char *restrict t = rows.top;
+  const unsigned char *restrict m = rows.middle;
+  const unsigned char *restrict b = rows.bottom;
+
+  for (size_t i = 0; i < width; i++) {
+    int16_t x = (t[i] - t[i + 2]) + 2 * (m[i] - m[i + 2]) + (b[i] - b[i + 2]);
+    int16_t y = (t[i] + 2 * t[i + 1] + t[i + 2]) -
+                (b[i] + 2 * b[i + 1] + b[i + 2]);
+    int16_t value = abs(x) + abs(y);
+    rows.out[i] = clamp(value, 0, 255);
+  }
+}
+
+void filter_planar_sobel_rows(image_planar_t *image, image_planar_t *new_image,
+                              size_t first, size_t last) {
+  for (size_t y = first; y < last; y++) {
+    for (int k = 0; k < 3; k++) {
+      planar_sobel_row(planar_rows(image, new_image, k, y), new_image->width);
+    }
+    planar_copy_alpha(image, new_image, y);
+  }
+}
+
+/* the largest sum of |coefficient| * 255 fits in 16 bits */
+static bool planar_fits_int16(const int32_t coefs[9]) {
+  int32_t sum = 0;
+  for (int k = 0; k < 9; k++) {
+    sum += abs(coefs[k]);
+  }
+  return sum * 255 <= INT16_MAX;
+}
+
+static void planar_convolution_int16_row(planar_rows_t rows, size_t width,
+                                         const int32_t coefs[9], int shift) {
+  const int16_t c0 = coefs[0], c1 = coefs[1], c2 = coefs[2];
+  const int16_t c3 = coefs[3], c4 = coefs[4], c5 = coefs[5];
+  const int16_t c6 = coefs[6], c7 = coefs[7], c8 = coefs[8];
+  const unsigned char *restrict t = rows.top;
+  const unsigned char *restrict m = rows.middle;
+  const unsigned char *restrict b = rows.bottom;
+
+  for (size_t i = 0; i < width; i++) {
+    int16_t value = c0 * t[i] + c1 * t[i + 1] + c2 * t[i + 2] + c3 * m[i] +
+                    c4 * m[i + 1] + c5 * m[i + 2] + c6 * b[i] +
+                    c7 * b[i + 1] + c8 * b[i + 2];
+    value >>= shift;
+    rows.out[i] = clamp(value, 0, 255);
+  }
+}
+
+static void planar_convolution_int32_row(planar_rows_t rows, size_t width,
+                                         const int32_t coefs[9], int shift) {
+  const unsigned char *restrict t = rows.top;
+  const unsigned char *restrict m = rows.middle;
+  const unsigned char *restrict b = rows.bottom;
+
+  for (size_t i = 0; i < width; i++) {
+    int32_t value = coefs[0] * t[i] + coefs[1] * t[i + 1] +
+                    coefs[2] * t[i + 2] + coefs[3] * m[i] +
+                    coefs[4] * m[i + 1] + coefs[5] * m[i + 2] +
+                    coefs[6] * b[i] + coefs[7] * b[i + 1] +
+                    coefs[8] * b[i + 2];
+    value >>= shift;
+    rows.out[i] = clamp(value, 0, 255);
+  }
+}
+
+/* separate multiplies and adds in the order of the interleaved loop, so
+ * every lane rounds the same way */
+static void planar_convolution_double_row(planar_rows_t rows, size_t width,
+                                          const double m[3][3]) {
+  const unsigned char *restrict rs[3] = {rows.top, rows.middle, rows.bottom};
+
+  for (size_t i = 0; i < width; i++) {
+    double value = 0;
+    for (int y = 0; y < 3; y++) {
+      for (int x = 0; x < 3; x++) {
+        value += rs[y][i + x] * m[y][x];
+      }
+    }
+    rows.out[i] = (unsigned char)clamp(value, 0, 255);
+  }
+}
+
+void filter_planar_convolution33_rows(image_planar_t *image,
+                                      image_planar_t *new_image,
+                                      const double m[3][3], size_t first,
+                                      size_t last) {
+  int32_t coefs[9];
+  int shift = filter_simd_fixed_shift(m, coefs);
+  bool narrow = shift >= 0 && planar_fits_int16(coefs);
+
+  for (size_t y = first; y < last; y++) {
+    for (int k = 0; k < 3; k++) {
+      planar_rows_t rows = planar_rows(image, new_image, k, y);
+      if (narrow) {
+        planar_convolution_int16_row(rows, new_image->width, coefs, shift);
+      } else if (shift >= 0) {
+        planar_convolution_int32_row(rows, new_image->width, coefs, shift);
+      } else {
+        planar_convolution_double_row(rows, new_image->width, m);
+      }
+    }
+    planar_copy_alpha(image, new_image, y);
+  }
+}
+
+image_planar_t *filter_planar_sobel(image_planar_t *image) {
+  image_planar_t *new_image =
+      image_planar_create(image->id, image->width - 2, image->height - 2);
+  if (new_image == NULL) {
+    return NULL;
+  }
+
+  filter_planar_sobel_rows(image, new_image, 0, new_image->height);
+  return new_image;
+}
+
+image_planar_t *filter_planar_convolution33(image_planar_t *image,
+                                            const double m[3][3]) {
+  image_planar_t *new_image =
+      image_planar_create(image->id, image->width - 2, image->height - 2);
+  if (new_image == NULL) {
+    return NULL;
+  }
+
+  filter_planar_convolution33_rows(image, new_image, m, 0, new_image->height);
+  return new_image;
+}
@@ -0,0 +1,765 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "filter-simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FILTER_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define ALPHA_MASK 0xFF000000u
+
+static atomic_int selected_level = -1;
+
+filter_simd_level_t filter_simd_level_supported(void) {
+#ifdef FILTER_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return FILTER_SIMD_AVX2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return FILTER_SIMD_SSE4;
+  }
+#endif
+  return FILTER_SIMD_SCALAR;
+}
+
+filter_simd_level_t filter_simd_level(void) {
+  int level = atomic_load_explicit(&selected_level, memory_order_relaxed);
+  if (level < 0) {
+    level = filter_simd_level_supported();
+    atomic_store_explicit(&selected_level, level, memory_order_relaxed);
+  }
+  return level;
+}
+
+filter_simd_level_t filter_simd_set_level(filter_simd_level_t level) {
+  filter_simd_level_t supported = filter_simd_level_supported();
+  if (level > supported) {
+    level = supported;
+  }
+  atomic_store_explicit(&selected_level, level, memory_order_relaxed);
+  return level;
+}
+
+const char *filter_simd_level_name(filter_simd_level_t level) {
+  switch (level) {
+  case FILTER_SIMD_SCALAR:
+    return "scalar";
+  case FILTER_SIMD_SSE4:
+    return "sse4";
+  case FILTER_SIMD_AVX2:
+    return "avx2";
+  }
+  return "unknown";
+}
+
+int filter_simd_fixed_shift(const double m[3][3], int32_t coefs[9]) {
+  for (int shift = 0; shift <= 8; shift++) {
+    bool exact = true;
+
+    for (int k = 0; k < 9 && exact; k++) {
+      double value = m[k / 3][k % 3] * (1 << shift);
+      if (value > 32767 || value < -32767 || value != (int32_t)value) {
+        exact = false;
+      } else {
+        coefs[k] = (int32_t)value;
+      }
+    }
+
+    if (exact) {
+      return shift;
+    }
+  }
+
+  return -1;
+}
+
+#ifdef FILTER_SIMD_X86
+
+/* ceil(2^24 / d), and 0 for d = 0: (n * hsv_reciprocals[d]) >> 24 is
+ * n / d for every n <= 255 * d, and the product fits in 32 bits. That
+ * covers the saturation, 255 * (max - min) / max, and the hue offset,
+ * 43 * |diff| / (max - min). */
+static uint32_t hsv_reciprocals[256];
+
+__attribute__((constructor)) static void hsv_reciprocals_init(void) {
+  for (uint32_t d = 1; d < 256; d++) {
+    hsv_reciprocals[d] = ((1u << 24) + d - 1) / d;
+  }
+}
+
+/* h / 43 for every h <= 255 */
+#define HSV_REGION_MUL 191
+#define HSV_REGION_SHIFT 13
+
+__attribute__((always_inline)) static inline uint32_t
+load_pixel(const pixel_t *pixel) {
+  uint32_t value;
+  memcpy(&value, pixel, sizeof(value));
+  return value;
+}
+
+__attribute__((always_inline)) static inline void
+store_pixel(pixel_t *pixel, uint32_t value, uint32_t alpha) {
+  value = (value & ~ALPHA_MASK) | (alpha & ALPHA_MASK);
+  memcpy(pixel, &value, sizeof(value));
+}
+
+/* ---- SSE4.1: one RGBA pixel per 4x32-bit vector ---- */
+
+__attribute__((target("sse4.1"), always_inline)) static inline __m128i
+load_epi32_sse4(const pixel_t *pixel) {
+  return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(load_pixel(pixel)));
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline uint32_t
+pack_epi32_sse4(__m128i value) {
+  /* signed then unsigned saturation is exactly clamp(x, 0, 255) */
+  __m128i packed = _mm_packs_epi32(value, value);
+  return _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline uint32_t
+convolution_fixed_sse4(const pixel_t *top, size_t stride,
+                       const int32_t coefs[9], __m128i shift) {
+  __m128i acc = _mm_setzero_si128();
+
+  for (int y = 0; y < 3; y++) {
+    for (int x = 0; x < 3; x++) {
+      __m128i value = load_epi32_sse4(&top[y * stride + x]);
+      acc = _mm_add_epi32(
+          acc, _mm_mullo_epi32(value, _mm_set1_epi32(coefs[3 * y + x])));
+    }
+  }
+
+  return pack_epi32_sse4(_mm_sra_epi32(acc, shift));
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline uint32_t
+convolution_double_sse4(const pixel_t *top, size_t stride,
+                        const double m[3][3]) {
+  __m128d acc_lo = _mm_setzero_pd();
+  __m128d acc_hi = _mm_setzero_pd();
+
+  /* separate mul and add, same rounding as the scalar loop */
+  for (int y = 0; y < 3; y++) {
+    for (int x = 0; x < 3; x++) {
+      __m128i value = load_epi32_sse4(&top[y * stride + x]);
+      __m128d coef = _mm_set1_pd(m[y][x]);
+      acc_lo = _mm_add_pd(acc_lo, _mm_mul_pd(_mm_cvtepi32_pd(value), coef));
+      acc_hi = _mm_add_pd(
+          acc_hi,
+          _mm_mul_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(value, value)), coef));
+    }
+  }
+
+  __m128d zero = _mm_setzero_pd();
+  __m128d max = _mm_set1_pd(255);
+  acc_lo = _mm_min_pd(_mm_max_pd(acc_lo, zero), max);
+  acc_hi = _mm_min_pd(_mm_max_pd(acc_hi, zero), max);
+
+  return pack_epi32_sse4(
+      _mm_unpacklo_epi64(_mm_cvttpd_epi32(acc_lo), _mm_cvttpd_epi32(acc_hi)));
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline uint32_t
+sobel_sse4(const pixel_t *top, size_t stride) {
+  const pixel_t *mid = top + stride;
+  const pixel_t *bot = mid + stride;
+
+  __m128i tl = load_epi32_sse4(&top[0]);
+  __m128i tm = load_epi32_sse4(&top[1]);
+  __m128i tr = load_epi32_sse4(&top[2]);
+  __m128i ml = load_epi32_sse4(&mid[0]);
+  __m128i mr = load_epi32_sse4(&mid[2]);
+  __m128i bl = load_epi32_sse4(&bot[0]);
+  __m128i bm = load_epi32_sse4(&bot[1]);
+  __m128i br = load_epi32_sse4(&bot[2]);
+
+  __m128i gx = _mm_sub_epi32(
+      _mm_add_epi32(_mm_add_epi32(tl, bl), _mm_slli_epi32(ml, 1)),
+      _mm_add_epi32(_mm_add_epi32(tr, br), _mm_slli_epi32(mr, 1)));
+  __m128i gy = _mm_sub_epi32(
+      _mm_add_epi32(_mm_add_epi32(tl, tr), _mm_slli_epi32(tm, 1)),
+      _mm_add_epi32(_mm_add_epi32(bl, br), _mm_slli_epi32(bm, 1)));
+
+  return pack_epi32_sse4(_mm_add_epi32(_mm_abs_epi32(gx), _mm_abs_epi32(gy)));
+}
+
+__attribute__((target("sse4.1"))) static void
+convolution33_sse4(image_t *image, image_t *new_image, const double m[3][3]) {
+  int32_t coefs[9];
+  int shift = filter_simd_fixed_shift(m, coefs);
+  __m128i shift_count = _mm_cvtsi32_si128(shift);
+
+  for (size_t j = 0; j < new_image->height; j++) {
+    const pixel_t *top = &image->pixels[j * image->width];
+    pixel_t *out = &new_image->pixels[j * new_image->width];
+
+    for (size_t i = 0; i < new_image->width; i++) {
+      uint32_t value =
+          (shift >= 0)
+              ? convolution_fixed_sse4(&top[i], image->width, coefs,
+                                       shift_count)
+              : convolution_double_sse4(&top[i], image->width, m);
+      store_pixel(&out[i], value, load_pixel(&top[i + image->width + 1]));
+    }
+  }
+}
+
+__attribute__((target("sse4.1"))) static void
+sobel_sse4_image(image_t *image, image_t *new_image) {
+  for (size_t j = 0; j < new_image->height; j++) {
+    const pixel_t *top = &image->pixels[j * image->width];
+    pixel_t *out = &new_image->pixels[j * new_image->width];
+
+    for (size_t i = 0; i < new_image->width; i++) {
+      store_pixel(&out[i], sobel_sse4(&top[i], image->width),
+                  load_pixel(&top[i + image->width + 1]));
+    }
+  }
+}
+
+/* gathers the R, G and B bytes of 4 pixels into 3 consecutive 32-bit words */
+#define DESATURATE_GATHER                                                      \
+  _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, -1, -1, -1, -1)
+/* spreads 4 gray bytes over the R, G and B bytes of 4 pixels */
+#define DESATURATE_SPREAD                                                      \
+  _mm_setr_epi8(0, 0, 0, -1, 4, 4, 4, -1, 8, 8, 8, -1, 12, 12, 12, -1)
+
+__attribute__((target("sse4.1"), always_inline)) static inline __m128i
+desaturate_finish_sse4(__m128i pixels, __m128i gray) {
+  __m128i alpha = _mm_and_si128(pixels, _mm_set1_epi32(ALPHA_MASK));
+  return _mm_or_si128(_mm_shuffle_epi8(gray, DESATURATE_SPREAD), alpha);
+}
+
+__attribute__((target("sse4.1"))) static void
+desaturate_sse4(image_t *image, image_t *new_image) {
+  size_t count = image->width * image->height;
+  size_t i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *)&image->pixels[i]);
+    __m128i planar = _mm_shuffle_epi8(pixels, DESATURATE_GATHER);
+    __m128i r = _mm_cvtepu8_epi32(planar);
+    __m128i g = _mm_cvtepu8_epi32(_mm_srli_si128(planar, 4));
+    __m128i b = _mm_cvtepu8_epi32(_mm_srli_si128(planar, 8));
+
+    __m128d value_lo = _mm_mul_pd(_mm_set1_pd(0.30), _mm_cvtepi32_pd(r));
+    __m128d value_hi = _mm_mul_pd(_mm_set1_pd(0.30),
+                                  _mm_cvtepi32_pd(_mm_srli_si128(r, 8)));
+    value_lo = _mm_add_pd(value_lo,
+                          _mm_mul_pd(_mm_set1_pd(0.59), _mm_cvtepi32_pd(g)));
+    value_hi = _mm_add_pd(value_hi,
+                          _mm_mul_pd(_mm_set1_pd(0.59),
+                                     _mm_cvtepi32_pd(_mm_srli_si128(g, 8))));
+    value_lo = _mm_add_pd(value_lo,
+                          _mm_mul_pd(_mm_set1_pd(0.11), _mm_cvtepi32_pd(b)));
+    value_hi = _mm_add_pd(value_hi,
+                          _mm_mul_pd(_mm_set1_pd(0.11),
+                                     _mm_cvtepi32_pd(_mm_srli_si128(b, 8))));
+
+    __m128i gray = _mm_unpacklo_epi64(_mm_cvttpd_epi32(value_lo),
+                                      _mm_cvttpd_epi32(value_hi));
+    _mm_storeu_si128((__m128i *)&new_image->pixels[i],
+                     desaturate_finish_sse4(pixels, gray));
+  }
+
+  for (; i < count; i++) {
+    pixel_t *pixel = &image->pixels[i];
+    pixel_t *new_pixel = &new_image->pixels[i];
+
+    double value = 0;
+    value += 0.30 * ((double)pixel->bytes[0]);
+    value += 0.59 * ((double)pixel->bytes[1]);
+    value += 0.11 * ((double)pixel->bytes[2]);
+
+    new_pixel->bytes[0] = (unsigned char)value;
+    new_pixel->bytes[1] = (unsigned char)value;
+    new_pixel->bytes[2] = (unsigned char)value;
+    new_pixel->bytes[3] = pixel->bytes[3];
+  }
+}
+
+/* The HSV conversions of filter.c without branches: one pixel per 32-bit
+ * lane, every case computed and the right one selected with masks. */
+
+__attribute__((target("sse4.1"), always_inline)) static inline __m128i
+hsv_reciprocal_sse4(__m128i d) {
+  return _mm_setr_epi32(hsv_reciprocals[_mm_extract_epi32(d, 0)],
+                        hsv_reciprocals[_mm_extract_epi32(d, 1)],
+                        hsv_reciprocals[_mm_extract_epi32(d, 2)],
+                        hsv_reciprocals[_mm_extract_epi32(d, 3)]);
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline __m128i
+rgb_to_hsv_sse4(__m128i pixels) {
+  __m128i mask = _mm_set1_epi32(0xFF);
+  __m128i r = _mm_and_si128(pixels, mask);
+  __m128i g = _mm_and_si128(_mm_srli_epi32(pixels, 8), mask);
+  __m128i b = _mm_and_si128(_mm_srli_epi32(pixels, 16), mask);
+  __m128i alpha = _mm_and_si128(pixels, _mm_set1_epi32(ALPHA_MASK));
+
+  __m128i cmax = _mm_max_epi32(r, _mm_max_epi32(g, b));
+  __m128i cmin = _mm_min_epi32(r, _mm_min_epi32(g, b));
+  __m128i delta = _mm_sub_epi32(cmax, cmin);
+  __m128i delta_reciprocal = hsv_reciprocal_sse4(delta);
+
+  /* v = 0 has a 0 reciprocal, so s = 0 as in the scalar early exit */
+  __m128i s = _mm_srli_epi32(
+      _mm_mullo_epi32(_mm_mullo_epi32(delta, _mm_set1_epi32(255)),
+                      hsv_reciprocal_sse4(cmax)),
+      24);
+
+  /* the scalar code tests r first, then g; with max = min the r case is
+   * taken and gives h = 0 */
+  __m128i is_r = _mm_cmpeq_epi32(cmax, r);
+  __m128i is_g = _mm_cmpeq_epi32(cmax, g);
+  __m128i diff = _mm_blendv_epi8(_mm_sub_epi32(r, g), _mm_sub_epi32(b, r),
+                                 is_g);
+  diff = _mm_blendv_epi8(diff, _mm_sub_epi32(g, b), is_r);
+  __m128i base = _mm_blendv_epi8(_mm_set1_epi32(171), _mm_set1_epi32(85),
+                                 is_g);
+  base = _mm_andnot_si128(is_r, base);
+
+  /* C division truncates toward zero: divide |diff|, then restore the sign */
+  __m128i offset = _mm_srli_epi32(
+      _mm_mullo_epi32(_mm_mullo_epi32(_mm_abs_epi32(diff), _mm_set1_epi32(43)),
+                      delta_reciprocal),
+      24);
+  __m128i h = _mm_and_si128(_mm_add_epi32(base, _mm_sign_epi32(offset, diff)),
+                            mask);
+
+  return _mm_or_si128(
+      _mm_or_si128(h, _mm_slli_epi32(s, 8)),
+      _mm_or_si128(_mm_slli_epi32(cmax, 16), alpha));
+}
+
+/* 255 - ((s * x) >> 8), the factor of v in q and t */
+__attribute__((target("sse4.1"), always_inline)) static inline __m128i
+hsv_factor_sse4(__m128i s, __m128i x) {
+  return _mm_sub_epi32(_mm_set1_epi32(255),
+                       _mm_srli_epi32(_mm_mullo_epi32(s, x), 8));
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline __m128i
+hsv_scale_sse4(__m128i v, __m128i factor) {
+  return _mm_srli_epi32(_mm_mullo_epi32(v, factor), 8);
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline __m128i
+hsv_to_rgb_sse4(__m128i pixels) {
+  __m128i mask = _mm_set1_epi32(0xFF);
+  __m128i h = _mm_and_si128(pixels, mask);
+  __m128i s = _mm_and_si128(_mm_srli_epi32(pixels, 8), mask);
+  __m128i v = _mm_and_si128(_mm_srli_epi32(pixels, 16), mask);
+  __m128i alpha = _mm_and_si128(pixels, _mm_set1_epi32(ALPHA_MASK));
+
+  __m128i region = _mm_srli_epi32(
+      _mm_mullo_epi32(h, _mm_set1_epi32(HSV_REGION_MUL)), HSV_REGION_SHIFT);
+  __m128i remainder = _mm_mullo_epi32(
+      _mm_sub_epi32(h, _mm_mullo_epi32(region, _mm_set1_epi32(43))),
+      _mm_set1_epi32(6));
+
+  __m128i p = hsv_scale_sse4(v, _mm_sub_epi32(_mm_set1_epi32(255), s));
+  __m128i q = hsv_scale_sse4(v, hsv_factor_sse4(s, remainder));
+  __m128i t = hsv_scale_sse4(
+      v, hsv_factor_sse4(s, _mm_sub_epi32(_mm_set1_epi32(255), remainder)));
+
+  __m128i in0 = _mm_cmpeq_epi32(region, _mm_set1_epi32(0));
+  __m128i in1 = _mm_cmpeq_epi32(region, _mm_set1_epi32(1));
+  __m128i in2 = _mm_cmpeq_epi32(region, _mm_set1_epi32(2));
+  __m128i in3 = _mm_cmpeq_epi32(region, _mm_set1_epi32(3));
+  __m128i in4 = _mm_cmpeq_epi32(region, _mm_set1_epi32(4));
+  __m128i in5 = _mm_cmpeq_epi32(region, _mm_set1_epi32(5));
+
+  /* regions 0 to 5: r = v q p p t v, g = t v v q p p, b = p p t v v q */
+  __m128i r = _mm_blendv_epi8(v, q, in1);
+  r = _mm_blendv_epi8(r, p, _mm_or_si128(in2, in3));
+  r = _mm_blendv_epi8(r, t, in4);
+  __m128i g = _mm_blendv_epi8(p, t, in0);
+  g = _mm_blendv_epi8(g, v, _mm_or_si128(in1, in2));
+  g = _mm_blendv_epi8(g, q, in3);
+  __m128i b = _mm_blendv_epi8(p, t, in2);
+  b = _mm_blendv_epi8(b, v, _mm_or_si128(in3, in4));
+  b = _mm_blendv_epi8(b, q, in5);
+
+  /* no saturation: gray */
+  __m128i gray = _mm_cmpeq_epi32(s, _mm_setzero_si128());
+  r = _mm_blendv_epi8(r, v, gray);
+  g = _mm_blendv_epi8(g, v, gray);
+  b = _mm_blendv_epi8(b, v, gray);
+
+  return _mm_or_si128(
+      _mm_or_si128(r, _mm_slli_epi32(g, 8)),
+      _mm_or_si128(_mm_slli_epi32(b, 16), alpha));
+}
+
+__attribute__((target("sse4.1"))) static size_t
+rgb_to_hsv_sse4_row(const pixel_t *in, pixel_t *out, size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *)&in[i]);
+    _mm_storeu_si128((__m128i *)&out[i], rgb_to_hsv_sse4(pixels));
+  }
+  return i;
+}
+
+__attribute__((target("sse4.1"))) static size_t
+hsv_to_rgb_sse4_row(const pixel_t *in, pixel_t *out, size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *)&in[i]);
+    _mm_storeu_si128((__m128i *)&out[i], hsv_to_rgb_sse4(pixels));
+  }
+  return i;
+}
+
+/* ---- AVX2: two RGBA pixels per 8x32-bit vector, 4 doubles per pixel ---- */
+
+__attribute__((target("avx2"), always_inline)) static inline __m256i
+load2_epi32_avx2(const pixel_t *pixel) {
+  return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)pixel));
+}
+
+__attribute__((target("avx2"), always_inline)) static inline void
+store2_avx2(pixel_t *out, const pixel_t *center, __m256i value) {
+  __m256i packed = _mm256_packs_epi32(value, value);
+  packed = _mm256_packus_epi16(packed, packed);
+  store_pixel(&out[0], _mm256_extract_epi32(packed, 0), load_pixel(&center[0]));
+  store_pixel(&out[1], _mm256_extract_epi32(packed, 4), load_pixel(&center[1]));
+}
+
+__attribute__((target("avx2"))) static void
+convolution33_fixed_avx2(image_t *image, image_t *new_image,
+                         const int32_t coefs[9], int shift) {
+  size_t stride = image->width;
+  __m128i shift_count = _mm_cvtsi32_si128(shift);
+
+  __m256i coef[9];
+  for (int k = 0; k < 9; k++) {
+    coef[k] = _mm256_set1_epi32(coefs[k]);
+  }
+
+  for (size_t j = 0; j < new_image->height; j++) {
+    const pixel_t *top = &image->pixels[j * stride];
+    pixel_t *out = &new_image->pixels[j * new_image->width];
+    size_t i = 0;
+
+    for (; i + 2 <= new_image->width; i += 2) {
+      __m256i acc = _mm256_setzero_si256();
+      for (int y = 0; y < 3; y++) {
+        for (int x = 0; x < 3; x++) {
+          __m256i value = load2_epi32_avx2(&top[y * stride + i + x]);
+          acc = _mm256_add_epi32(acc,
+                                 _mm256_mullo_epi32(value, coef[3 * y + x]));
+        }
+      }
+      store2_avx2(&out[i], &top[stride + i + 1],
+                  _mm256_sra_epi32(acc, shift_count));
+    }
+
+    for (; i < new_image->width; i++) {
+      store_pixel(&out[i],
+                  convolution_fixed_sse4(&top[i], stride, coefs, shift_count),
+                  load_pixel(&top[stride + i + 1]));
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static void
+convolution33_double_avx2(image_t *image, image_t *new_image,
+                          const double m[3][3]) {
+  size_t stride = image->width;
+  __m256d zero = _mm256_setzero_pd();
+  __m256d max = _mm256_set1_pd(255);
+
+  __m256d coef[9];
+  for (int k = 0; k < 9; k++) {
+    coef[k] = _mm256_set1_pd(m[k / 3][k % 3]);
+  }
+
+  for (size_t j = 0; j < new_image->height; j++) {
+    const pixel_t *top = &image->pixels[j * stride];
+    pixel_t *out = &new_image->pixels[j * new_image->width];
+
+    for (size_t i = 0; i < new_image->width; i++) {
+      __m256d acc = _mm256_setzero_pd();
+
+      /* separate mul and add, same rounding as the scalar loop */
+      for (int y = 0; y < 3; y++) {
+        for (int x = 0; x < 3; x++) {
+          __m256d value =
+              _mm256_cvtepi32_pd(load_epi32_sse4(&top[y * stride + i + x]));
+          acc = _mm256_add_pd(acc, _mm256_mul_pd(value, coef[3 * y + x]));
+        }
+      }
+
+      acc = _mm256_min_pd(_mm256_max_pd(acc, zero), max);
+      store_pixel(&out[i], pack_epi32_sse4(_mm256_cvttpd_epi32(acc)),
+                  load_pixel(&top[stride + i + 1]));
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static void sobel_avx2(image_t *image,
+                                                      image_t *new_image) {
+  size_t stride = image->width;
+
+  for (size_t j = 0; j < new_image->height; j++) {
+    const pixel_t *top = &image->pixels[j * stride];
+    const pixel_t *mid = top + stride;
+    const pixel_t *bot = mid + stride;
+    pixel_t *out = &new_image->pixels[j * new_image->width];
+    size_t i = 0;
+
+    for (; i + 2 <= new_image->width; i += 2) {
+      __m256i tl = load2_epi32_avx2(&top[i]);
+      __m256i tm = load2_epi32_avx2(&top[i + 1]);
+      __m256i tr = load2_epi32_avx2(&top[i + 2]);
+      __m256i ml = load2_epi32_avx2(&mid[i]);
+      __m256i mr = load2_epi32_avx2(&mid[i + 2]);
+      __m256i bl = load2_epi32_avx2(&bot[i]);
+      __m256i bm = load2_epi32_avx2(&bot[i + 1]);
+      __m256i br = load2_epi32_avx2(&bot[i + 2]);
+
+      __m256i gx = _mm256_sub_epi32(
+          _mm256_add_epi32(_mm256_add_epi32(tl, bl), _mm256_slli_epi32(ml, 1)),
+          _mm256_add_epi32(_mm256_add_epi32(tr, br), _mm256_slli_epi32(mr, 1)));
+      __m256i gy = _mm256_sub_epi32(
+          _mm256_add_epi32(_mm256_add_epi32(tl, tr), _mm256_slli_epi32(tm, 1)),
+          _mm256_add_epi32(_mm256_add_epi32(bl, br), _mm256_slli_epi32(bm, 1)));
+
+      store2_avx2(&out[i], &mid[i + 1],
+                  _mm256_add_epi32(_mm256_abs_epi32(gx), _mm256_abs_epi32(gy)));
+    }
+
+    for (; i < new_image->width; i++) {
+      store_pixel(&out[i], sobel_sse4(&top[i], stride),
+                  load_pixel(&mid[i + 1]));
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static void desaturate_avx2(image_t *image,
+                                                           image_t *new_image) {
+  size_t count = image->width * image->height;
+  size_t i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    __m128i pixels = _mm_loadu_si128((const __m128i *)&image->pixels[i]);
+    __m128i planar = _mm_shuffle_epi8(pixels, DESATURATE_GATHER);
+    __m256d r = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(planar));
+    __m256d g =
+        _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_srli_si128(planar, 4)));
+    __m256d b =
+        _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_srli_si128(planar, 8)));
+
+    __m256d value = _mm256_mul_pd(_mm256_set1_pd(0.30), r);
+    value = _mm256_add_pd(value, _mm256_mul_pd(_mm256_set1_pd(0.59), g));
+    value = _mm256_add_pd(value, _mm256_mul_pd(_mm256_set1_pd(0.11), b));
+
+    _mm_storeu_si128(
+        (__m128i *)&new_image->pixels[i],
+        desaturate_finish_sse4(pixels, _mm256_cvttpd_epi32(value)));
+  }
+
+  if (i < count) {
+    image_t tail = {.id = image->id,
+                    .width = count - i,
+                    .height = 1,
+                    .pixels = &image->pixels[i]};
+    image_t new_tail = tail;
+    new_tail.pixels = &new_image->pixels[i];
+    desaturate_sse4(&tail, &new_tail);
+  }
+}
+
+/* the HSV conversions on 8 pixels, the reciprocals are gathered */
+
+__attribute__((target("avx2"), always_inline)) static inline __m256i
+rgb_to_hsv_avx2(__m256i pixels) {
+  __m256i mask = _mm256_set1_epi32(0xFF);
+  __m256i r = _mm256_and_si256(pixels, mask);
+  __m256i g = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), mask);
+  __m256i b = _mm256_and_si256(_mm256_srli_epi32(pixels, 16), mask);
+  __m256i alpha = _mm256_and_si256(pixels, _mm256_set1_epi32(ALPHA_MASK));
+
+  __m256i cmax = _mm256_max_epi32(r, _mm256_max_epi32(g, b));
+  __m256i cmin = _mm256_min_epi32(r, _mm256_min_epi32(g, b));
+  __m256i delta = _mm256_sub_epi32(cmax, cmin);
+  __m256i delta_reciprocal =
+      _mm256_i32gather_epi32((const int *)hsv_reciprocals, delta, 4);
+
+  __m256i s = _mm256_srli_epi32(
+      _mm256_mullo_epi32(
+          _mm256_mullo_epi32(delta, _mm256_set1_epi32(255)),
+          _mm256_i32gather_epi32((const int *)hsv_reciprocals, cmax, 4)),
+      24);
+
+  __m256i is_r = _mm256_cmpeq_epi32(cmax, r);
+  __m256i is_g = _mm256_cmpeq_epi32(cmax, g);
+  __m256i diff = _mm256_blendv_epi8(_mm256_sub_epi32(r, g),
+                                    _mm256_sub_epi32(b, r), is_g);
+  diff = _mm256_blendv_epi8(diff, _mm256_sub_epi32(g, b), is_r);
+  __m256i base = _mm256_blendv_epi8(_mm256_set1_epi32(171),
+                                    _mm256_set1_epi32(85), is_g);
+  base = _mm256_andnot_si256(is_r, base);
+
+  __m256i offset = _mm256_srli_epi32(
+      _mm256_mullo_epi32(_mm256_mullo_epi32(_mm256_abs_epi32(diff),
+                                            _mm256_set1_epi32(43)),
+                         delta_reciprocal),
+      24);
+  __m256i h = _mm256_and_si256(
+      _mm256_add_epi32(base, _mm256_sign_epi32(offset, diff)), mask);
+
+  return _mm256_or_si256(
+      _mm256_or_si256(h, _mm256_slli_epi32(s, 8)),
+      _mm256_or_si256(_mm256_slli_epi32(cmax, 16), alpha));
+}
+
+__attribute__((target("avx2"), always_inline)) static inline __m256i
+hsv_factor_avx2(__m256i s, __m256i x) {
+  return _mm256_sub_epi32(_mm256_set1_epi32(255),
+                          _mm256_srli_epi32(_mm256_mullo_epi32(s, x), 8));
+}
+
+__attribute__((target("avx2"), always_inline)) static inline __m256i
+hsv_scale_avx2(__m256i v, __m256i factor) {
+  return _mm256_srli_epi32(_mm256_mullo_epi32(v, factor), 8);
+}
+
+__attribute__((target("avx2"), always_inline)) static inline __m256i
+hsv_to_rgb_avx2(__m256i pixels) {
+  __m256i mask = _mm256_set1_epi32(0xFF);
+  __m256i h = _mm256_and_si256(pixels, mask);
+  __m256i s = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), mask);
+  __m256i v = _mm256_and_si256(_mm256_srli_epi32(pixels, 16), mask);
+  __m256i alpha = _mm256_and_si256(pixels, _mm256_set1_epi32(ALPHA_MASK));
+
+  __m256i region = _mm256_srli_epi32(
+      _mm256_mullo_epi32(h, _mm256_set1_epi32(HSV_REGION_MUL)),
+      HSV_REGION_SHIFT);
+  __m256i remainder = _mm256_mullo_epi32(
+      _mm256_sub_epi32(h, _mm256_mullo_epi32(region, _mm256_set1_epi32(43))),
+      _mm256_set1_epi32(6));
+
+  __m256i p = hsv_scale_avx2(v, _mm256_sub_epi32(_mm256_set1_epi32(255), s));
+  __m256i q = hsv_scale_avx2(v, hsv_factor_avx2(s, remainder));
+  __m256i t = hsv_scale_avx2(
+      v,
+      hsv_factor_avx2(s, _mm256_sub_epi32(_mm256_set1_epi32(255), remainder)));
+
+  __m256i in0 = _mm256_cmpeq_epi32(region, _mm256_set1_epi32(0));
+  __m256i in1 = _mm256_cmpeq_epi32(region, _mm256_set1_epi32(1));
+  __m256i in2 = _mm256_cmpeq_epi32(region, _mm256_set1_epi32(2));
+  __m256i in3 = _mm256_cmpeq_epi32(region, _mm256_set1_epi32(3));
+  __m256i in4 = _mm256_cmpeq_epi32(region, _mm256_set1_epi32(4));
+  __m256i in5 = _mm256_cmpeq_epi32(region, _mm256_set1_epi32(5));
+
+  __m256i r = _mm256_blendv_epi8(v, q, in1);
+  r = _mm256_blendv_epi8(r, p, _mm256_or_si256(in2, in3));
+  r = _mm256_blendv_epi8(r, t, in4);
+  __m256i g = _mm256_blendv_epi8(p, t, in0);
+  g = _mm256_blendv_epi8(g, v, _mm256_or_si256(in1, in2));
+  g = _mm256_blendv_epi8(g, q, in3);
+  __m256i b = _mm256_blendv_epi8(p, t, in2);
+  b = _mm256_blendv_epi8(b, v, _mm256_or_si256(in3, in4));
+  b = _mm256_blendv_epi8(b, q, in5);
+
+  __m256i gray = _mm256_cmpeq_epi32(s, _mm256_setzero_si256());
+  r = _mm256_blendv_epi8(r, v, gray);
+  g = _mm256_blendv_epi8(g, v, gray);
+  b = _mm256_blendv_epi8(b, v, gray);
+
+  return _mm256_or_si256(
+      _mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+      _mm256_or_si256(_mm256_slli_epi32(b, 16), alpha));
+}
+
+__attribute__((target("avx2"))) static size_t
+rgb_to_hsv_avx2_row(const pixel_t *in, pixel_t *out, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i pixels = _mm256_loadu_si256((const __m256i *)&in[i]);
+    _mm256_storeu_si256((__m256i *)&out[i], rgb_to_hsv_avx2(pixels));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+hsv_to_rgb_avx2_row(const pixel_t *in, pixel_t *out, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i pixels = _mm256_loadu_si256((const __m256i *)&in[i]);
+    _mm256_storeu_si256((__m256i *)&out[i], hsv_to_rgb_avx2(pixels));
+  }
+  return i;
+}
+
+void filter_simd_convolution33(image_t *image, image_t *new_image,
+                               const double m[3][3]) {
+  if (filter_simd_level() == FILTER_SIMD_AVX2) {
+    int32_t coefs[9];
+    int shift = filter_simd_fixed_shift(m, coefs);
+    if (shift >= 0) {
+      convolution33_fixed_avx2(image, new_image, coefs, shift);
+    } else {
+      convolution33_double_avx2(image, new_image, m);
+    }
+  } else {
+    convolution33_sse4(image, new_image, m);
+  }
+}
+
+void filter_simd_sobel(image_t *image, image_t *new_image) {
+  if (filter_simd_level() == FILTER_SIMD_AVX2) {
+    sobel_avx2(image, new_image);
+  } else {
+    sobel_sse4_image(image, new_image);
+  }
+}
+
+void filter_simd_desaturate(image_t *image, image_t *new_image) {
+  if (filter_simd_level() == FILTER_SIMD_AVX2) {
+    desaturate_avx2(image, new_image);
+  } else {
+    desaturate_sse4(image, new_image);
+  }
+}
+
+size_t filter_simd_rgb_to_hsv(const pixel_t *in, pixel_t *out, size_t count) {
+  if (filter_simd_level() == FILTER_SIMD_AVX2) {
+    return rgb_to_hsv_avx2_row(in, out, count);
+  }
+  return rgb_to_hsv_sse4_row(in, out, count);
+}
+
+size_t filter_simd_hsv_to_rgb(const pixel_t *in, pixel_t *out, size_t count) {
+  if (filter_simd_level() == FILTER_SIMD_AVX2) {
+    return hsv_to_rgb_avx2_row(in, out, count);
+  }
+  return hsv_to_rgb_sse4_row(in, out, count);
+}
+
+#else /* FILTER_SIMD_X86 */
+
+/* filter_simd_level() is always FILTER_SIMD_SCALAR, these are never called */
+
+void filter_simd_convolution33(image_t *image, image_t *new_image,
+                               const double m[3][3]) {}
+void filter_simd_sobel(image_t *image, image_t *new_image) {}
+void filter_simd_desaturate(image_t *image, image_t *new_image) {}
+size_t filter_simd_rgb_to_hsv(const pixel_t *in, pixel_t *out, size_t count) {
+  return 0;
+}
+size_t filter_simd_hsv_to_rgb(const pixel_t *in, pixel_t *out, size_t count) {
+  return 0;
+}
+
+#endif /* FILTER_SIMD_X86 */
@@ -1,15 +1,20 @@
 /* DO NOT EDIT THIS FILE */
 
 #include <math.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "filter-simd.h"
+#include "filter.h"
 #include "image.h"
+#include "log.h"
 
 #define max(a, b) (((a) < (b)) ? (b) : (a))
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #define clamp(x, min, max) ((x) < (min)) ? (min) : (((x) > (max)) ? (max) : (x))
 
-static void hsv_to_rgb(unsigned char hsv[3], unsigned char rgb[3]) {
+static void hsv_to_rgb(const unsigned char hsv[3], unsigned char rgb[3]) {
   unsigned char h = hsv[0];
   unsigned char s = hsv[1];
   unsigned char v = hsv[2];
@@ -73,7 +78,7 @@ done:
   rgb[2] = b;
 }
 
-static void rgb_to_hsv(unsigned char rgb[3], unsigned char hsv[3]) {
+static void rgb_to_hsv(const unsigned char rgb[3], unsigned char hsv[3]) {
   unsigned char r = rgb[0];
   unsigned char g = rgb[1];
   unsigned char b = rgb[2];
@@ -113,6 +118,32 @@ done:
   hsv[2] = v;
 }
 
+void filter_rgb_to_hsv_row(const pixel_t *in, pixel_t *out, size_t count) {
+  size_t i = 0;
+  if (filter_simd_level() != FILTER_SIMD_SCALAR) {
+    i = filter_simd_rgb_to_hsv(in, out, count);
+  }
+
+  for (; i < count; i++) {
+    unsigned char alpha = in[i].bytes[3];
+    rgb_to_hsv(in[i].bytes, out[i].bytes);
+    out[i].bytes[3] = alpha;
+  }
+}
+
+void filter_hsv_to_rgb_row(const pixel_t *in, pixel_t *out, size_t count) {
+  size_t i = 0;
+  if (filter_simd_level() != FILTER_SIMD_SCALAR) {
+    i = filter_simd_hsv_to_rgb(in, out, count);
+  }
+
+  for (; i < count; i++) {
+    unsigned char alpha = in[i].bytes[3];
+    hsv_to_rgb(in[i].bytes, out[i].bytes);
+    out[i].bytes[3] = alpha;
+  }
+}
+
 image_t *filter_scale_up(image_t *image, size_t factor) {
   image_t *new_image =
       image_create(image->id, factor * image->width, factor * image->height);
@@ -147,6 +178,14 @@ image_t *filter_sobel(image_t *image) {
     goto fail_exit;
   }
 
+  filter_sobel_into(image, new_image);
+  return new_image;
+
+fail_exit:
+  return NULL;
+}
+
+void filter_sobel_into(image_t *image, image_t *new_image) {
   const int gx[3][3] = {
       {1, 0, -1},
       {2, 0, -2},
@@ -159,6 +198,11 @@ image_t *filter_sobel(image_t *image) {
       {-1, -2, -1},
   };
 
+  if (filter_simd_level() != FILTER_SIMD_SCALAR) {
+    filter_simd_sobel(image, new_image);
+    return;
+  }
+
   for (int j = 1; j < image->height - 1; j++) {
     for (int i = 1; i < image->width - 1; i++) {
       int values_x[4] = {0, 0, 0, 0};
@@ -185,11 +229,6 @@ image_t *filter_sobel(image_t *image) {
       new_pixel->bytes[3] = pixel->bytes[3];
     }
   }
-
-  return new_image;
-
-fail_exit:
-  return NULL;
 }
 
 image_t *filter_to_hsv(image_t *image) {
@@ -198,15 +237,8 @@ image_t *filter_to_hsv(image_t *image) {
     goto fail_exit;
   }
 
-  for (int j = 0; j < image->height; j++) {
-    for (int i = 0; i < image->width; i++) {
-      pixel_t *pixel = image_get_pixel(image, i, j);
-      pixel_t *new_pixel = image_get_pixel(new_image, i, j);
-
-      rgb_to_hsv(pixel->bytes, new_pixel->bytes);
-      new_pixel->bytes[3] = pixel->bytes[3];
-    }
-  }
+  filter_rgb_to_hsv_row(image->pixels, new_image->pixels,
+                        image->width * image->height);
 
   return new_image;
 
@@ -220,15 +252,8 @@ image_t *filter_to_rgb(image_t *image) {
     goto fail_exit;
   }
 
-  for (int j = 0; j < image->height; j++) {
-    for (int i = 0; i < image->width; i++) {
-      pixel_t *pixel = image_get_pixel(image, i, j);
-      pixel_t *new_pixel = image_get_pixel(new_image, i, j);
-
-      hsv_to_rgb(pixel->bytes, new_pixel->bytes);
-      new_pixel->bytes[3] = pixel->bytes[3];
-    }
-  }
+  filter_hsv_to_rgb_row(image->pixels, new_image->pixels,
+                        image->width * image->height);
 
   return new_image;
 
@@ -267,6 +292,11 @@ image_t *filter_desaturate(image_t *image) {
     goto fail_exit;
   }
 
+  if (filter_simd_level() != FILTER_SIMD_SCALAR) {
+    filter_simd_desaturate(image, new_image);
+    return new_image;
+  }
+
   for (int j = 0; j < image->height; j++) {
     for (int i = 0; i < image->width; i++) {
       pixel_t *pixel = image_get_pixel(image, i, j);
@@ -297,6 +327,20 @@ image_t *filter_convolution33(image_t *image, const double m[3][3]) {
     goto fail_exit;
   }
 
+  filter_convolution33_into(image, new_image, m);
+  return new_image;
+
+fail_exit:
+  return NULL;
+}
+
+void filter_convolution33_into(image_t *image, image_t *new_image,
+                               const double m[3][3]) {
+  if (filter_simd_level() != FILTER_SIMD_SCALAR) {
+    filter_simd_convolution33(image, new_image, m);
+    return;
+  }
+
   for (int j = 1; j < image->height - 1; j++) {
     for (int i = 1; i < image->width - 1; i++) {
       double values[3] = {0, 0, 0};
@@ -321,61 +365,56 @@ image_t *filter_convolution33(image_t *image, const double m[3][3]) {
       new_pixel->bytes[3] = pixel->bytes[3];
     }
   }
-
-  return new_image;
-
-fail_exit:
-  return NULL;
 }
 
-image_t *filter_edge_identity(image_t *image) {
-  const double m[3][3] = {
-      {0, 0, 0},
-      {0, 1, 0},
-      {0, 0, 0},
-  };
+const double filter_kernel_edge_identity[3][3] = {
+    {0, 0, 0},
+    {0, 1, 0},
+    {0, 0, 0},
+};
+
+const double filter_kernel_edge_detect[3][3] = {
+    {-1, -1, -1},
+    {-1, 8, -1},
+    {-1, -1, -1},
+};
+
+const double filter_kernel_sharpen[3][3] = {
+    {0, -2, 0},
+    {-2, 9, -2},
+    {0, -2, 0},
+};
+
+const double filter_kernel_box_blur[3][3] = {
+    {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
+    {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
+    {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
+};
+
+const double filter_kernel_gaussian_blur[3][3] = {
+    {1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0},
+    {2.0 / 16.0, 4.0 / 16.0, 4.0 / 16.0},
+    {1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0},
+};
 
-  return filter_convolution33(image, m);
+image_t *filter_edge_identity(image_t *image) {
+  return filter_convolution33(image, filter_kernel_edge_identity);
 }
 
 image_t *filter_edge_detect(image_t *image) {
-  const double m[3][3] = {
-      {-1, -1, -1},
-      {-1, 8, -1},
-      {-1, -1, -1},
-  };
-
-  return filter_convolution33(image, m);
+  return filter_convolution33(image, filter_kernel_edge_detect);
 }
 
 image_t *filter_sharpen(image_t *image) {
-  const double m[3][3] = {
-      {0, -2, 0},
-      {-2, 9, -2},
-      {0, -2, 0},
-  };
-
-  return filter_convolution33(image, m);
+  return filter_convolution33(image, filter_kernel_sharpen);
 }
 
 image_t *filter_box_blur(image_t *image) {
-  const double m[3][3] = {
-      {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
-      {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
-      {1.0 / 9.0, 1.0 / 9.0, 1.0 / 9.0},
-  };
-
-  return filter_convolution33(image, m);
+  return filter_convolution33(image, filter_kernel_box_blur);
 }
 
 image_t *filter_gaussian_blur(image_t *image) {
-  const double m[3][3] = {
-      {1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0},
-      {2.0 / 16.0, 4.0 / 16.0, 4.0 / 16.0},
-      {1.0 / 16.0, 2.0 / 16.0, 1.0 / 16.0},
-  };
-
-  return filter_convolution33(image, m);
+  return filter_convolution33(image, filter_kernel_gaussian_blur);
 }
 
 image_t *filter_horizontal_flip(image_t *image) {
@@ -421,3 +460,201 @@ image_t *filter_vertical_flip(image_t *image) {
 fail_exit:
   return NULL;
 }
+
+void filter_chain_init(filter_chain_t *chain) { chain->count = 0; }
+
+static filter_op_t *filter_chain_push(filter_chain_t *chain,
+                                      filter_op_kind_t kind) {
+  if (chain->count == FILTER_CHAIN_MAX_OPS) {
+    LOG_ERROR("filter chain is full");
+    return NULL;
+  }
+
+  filter_op_t *op = &chain->ops[chain->count++];
+  op->kind = kind;
+  op->factor = 1;
+  op->pixel = (pixel_t){.bytes = {0, 0, 0, 0}};
+  return op;
+}
+
+int filter_chain_scale_up(filter_chain_t *chain, size_t factor) {
+  filter_op_t *op = filter_chain_push(chain, FILTER_OP_SCALE_UP);
+  if (op == NULL) {
+    return -1;
+  }
+
+  op->factor = factor;
+  return 0;
+}
+
+int filter_chain_horizontal_flip(filter_chain_t *chain) {
+  return filter_chain_push(chain, FILTER_OP_HORIZONTAL_FLIP) ? 0 : -1;
+}
+
+int filter_chain_vertical_flip(filter_chain_t *chain) {
+  return filter_chain_push(chain, FILTER_OP_VERTICAL_FLIP) ? 0 : -1;
+}
+
+int filter_chain_add_pixel(filter_chain_t *chain, pixel_t *add_pixel) {
+  filter_op_t *op = filter_chain_push(chain, FILTER_OP_ADD_PIXEL);
+  if (op == NULL) {
+    return -1;
+  }
+
+  op->pixel = *add_pixel;
+  return 0;
+}
+
+int filter_chain_desaturate(filter_chain_t *chain) {
+  return filter_chain_push(chain, FILTER_OP_DESATURATE) ? 0 : -1;
+}
+
+int filter_chain_to_hsv(filter_chain_t *chain) {
+  return filter_chain_push(chain, FILTER_OP_TO_HSV) ? 0 : -1;
+}
+
+int filter_chain_to_rgb(filter_chain_t *chain) {
+  return filter_chain_push(chain, FILTER_OP_TO_RGB) ? 0 : -1;
+}
+
+/* point-wise filters applied in place on one row, same arithmetic as the
+ * standalone filters above */
+
+static void row_add_pixel(pixel_t *row, size_t width, pixel_t *add_pixel) {
+  for (size_t i = 0; i < width; i++) {
+    for (int k = 0; k < 3; k++) {
+      row[i].bytes[k] = row[i].bytes[k] + add_pixel->bytes[k];
+    }
+  }
+}
+
+static void row_desaturate(pixel_t *row, size_t width) {
+  for (size_t i = 0; i < width; i++) {
+    double value = 0;
+    value += 0.30 * ((double)row[i].bytes[0]);
+    value += 0.59 * ((double)row[i].bytes[1]);
+    value += 0.11 * ((double)row[i].bytes[2]);
+
+    row[i].bytes[0] = (unsigned char)value;
+    row[i].bytes[1] = (unsigned char)value;
+    row[i].bytes[2] = (unsigned char)value;
+  }
+}
+
+
+/* geometric filters commute with each other, fold them into one mapping */
+static void filter_chain_geometry(filter_chain_t *chain, size_t *factor,
+                                  bool *horizontal_flip, bool *vertical_flip) {
+  *factor = 1;
+  *horizontal_flip = false;
+  *vertical_flip = false;
+
+  for (size_t n = 0; n < chain->count; n++) {
+    filter_op_t *op = &chain->ops[n];
+    switch (op->kind) {
+    case FILTER_OP_SCALE_UP:
+      *factor *= op->factor;
+      break;
+    case FILTER_OP_HORIZONTAL_FLIP:
+      *horizontal_flip = !*horizontal_flip;
+      break;
+    case FILTER_OP_VERTICAL_FLIP:
+      *vertical_flip = !*vertical_flip;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+image_t *filter_chain_create_output(filter_chain_t *chain, image_t *image) {
+  size_t factor;
+  bool horizontal_flip;
+  bool vertical_flip;
+
+  filter_chain_geometry(chain, &factor, &horizontal_flip, &vertical_flip);
+  return image_create(image->id, factor * image->width,
+                      factor * image->height);
+}
+
+int filter_chain_apply_rows(filter_chain_t *chain, image_t *image,
+                            image_t *new_image, size_t first, size_t last) {
+  size_t factor;
+  bool horizontal_flip;
+  bool vertical_flip;
+
+  filter_chain_geometry(chain, &factor, &horizontal_flip, &vertical_flip);
+
+  pixel_t *row = malloc(image->width * sizeof(*row));
+  if (row == NULL) {
+    LOG_ERROR_ERRNO("malloc");
+    goto fail_exit;
+  }
+
+  for (size_t j = first; j < last; j++) {
+    memcpy(row, &image->pixels[j * image->width],
+           image->width * sizeof(*row));
+
+    for (size_t n = 0; n < chain->count; n++) {
+      filter_op_t *op = &chain->ops[n];
+      switch (op->kind) {
+      case FILTER_OP_ADD_PIXEL:
+        row_add_pixel(row, image->width, &op->pixel);
+        break;
+      case FILTER_OP_DESATURATE:
+        row_desaturate(row, image->width);
+        break;
+      case FILTER_OP_TO_HSV:
+        filter_rgb_to_hsv_row(row, row, image->width);
+        break;
+      case FILTER_OP_TO_RGB:
+        filter_hsv_to_rgb_row(row, row, image->width);
+        break;
+      default:
+        break;
+      }
+    }
+
+    /* write the first destination row, then replicate it factor-1 times */
+
+    size_t new_j = vertical_flip ? (image->height - 1) - j : j;
+    pixel_t *new_row = &new_image->pixels[factor * new_j * new_image->width];
+
+    for (size_t i = 0; i < image->width; i++) {
+      pixel_t pixel = row[horizontal_flip ? (image->width - 1) - i : i];
+      for (size_t ki = 0; ki < factor; ki++) {
+        new_row[factor * i + ki] = pixel;
+      }
+    }
+
+    for (size_t kj = 1; kj < factor; kj++) {
+      memcpy(&new_row[kj * new_image->width], new_row,
+             new_image->width * sizeof(*new_row));
+    }
+  }
+
+  free(row);
+  return 0;
+
+fail_exit:
+  return -1;
+}
+
+image_t *filter_chain_apply(filter_chain_t *chain, image_t *image) {
+  image_t *new_image = filter_chain_create_output(chain, image);
+  if (new_image == NULL) {
+    goto fail_exit;
+  }
+
+  if (filter_chain_apply_rows(chain, image, new_image, 0, image->height) <
+      0) {
+    goto fail_free_image;
+  }
+
+  return new_image;
+
+fail_free_image:
+  image_destroy(new_image);
+fail_exit:
+  return NULL;
+}
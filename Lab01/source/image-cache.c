@@ -0,0 +1,333 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image-cache.h"
+#include "image.h"
+#include "log.h"
+
+#define IMAGE_CACHE_PAGE 4096
+#define IMAGE_CACHE_MAGIC "IMGCACH1"
+
+/* the page in front of every frame, only valid once its magic is written */
+typedef struct image_cache_header {
+  char magic[8];
+  uint64_t width;
+  uint64_t height;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t source_size;
+  char path[IMAGE_CACHE_PAGE - 48];
+} image_cache_header_t;
+
+_Static_assert(sizeof(image_cache_header_t) <= IMAGE_CACHE_PAGE,
+               "a frame header must fit in a page");
+
+struct image_cache {
+  int fd;
+  void *map;
+  size_t map_size;
+
+  /* the newest frame of every source path in the mapping, sorted by path */
+  const image_cache_header_t **frames;
+  size_t count;
+
+  bool locked; /* no other run uses the file, frames can be appended */
+  pthread_mutex_t mutex;
+  size_t end;  /* where the next frame is appended */
+  bool failed; /* no frame is appended anymore */
+};
+
+static size_t image_cache_pixels_size(const image_cache_header_t *header) {
+  return header->width * header->height * sizeof(pixel_t);
+}
+
+/* bytes of the header and the pixels, 0 if the size makes no sense */
+static size_t image_cache_record_size(const image_cache_header_t *header) {
+  if (header->width == 0 || header->height == 0 ||
+      header->width > UINT32_MAX || header->height > UINT32_MAX) {
+    return 0;
+  }
+
+  size_t size = image_cache_pixels_size(header);
+  return IMAGE_CACHE_PAGE +
+         (size + IMAGE_CACHE_PAGE - 1) / IMAGE_CACHE_PAGE * IMAGE_CACHE_PAGE;
+}
+
+/* by path, then by position so that the newest of a path comes last */
+static int image_cache_compare(const void *a, const void *b) {
+  const image_cache_header_t *ha = *(const image_cache_header_t **)a;
+  const image_cache_header_t *hb = *(const image_cache_header_t **)b;
+
+  int cmp = strcmp(ha->path, hb->path);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (ha < hb) ? -1 : (ha > hb);
+}
+
+/* indexes the frames of the mapping up to the first one that is missing its
+ * header or its pixels, the rest is what a crashed run left behind */
+static int image_cache_index(image_cache_t *cache) {
+  size_t capacity = 0;
+  size_t offset = 0;
+
+  while (offset + IMAGE_CACHE_PAGE <= cache->map_size) {
+    const image_cache_header_t *header =
+        (const image_cache_header_t *)((char *)cache->map + offset);
+    if (memcmp(header->magic, IMAGE_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        memchr(header->path, '\0', sizeof(header->path)) == NULL) {
+      break;
+    }
+
+    size_t size = image_cache_record_size(header);
+    if (size == 0 || size > cache->map_size - offset) {
+      break;
+    }
+
+    if (cache->count == capacity) {
+      capacity = (capacity == 0) ? 64 : capacity * 2;
+      const image_cache_header_t **frames =
+          realloc(cache->frames, capacity * sizeof(*frames));
+      if (frames == NULL) {
+        LOG_ERROR_ERRNO("realloc");
+        return -1;
+      }
+      cache->frames = frames;
+    }
+
+    cache->frames[cache->count++] = header;
+    offset += size;
+  }
+  cache->end = offset;
+
+  if (cache->count == 0) {
+    return 0;
+  }
+
+  qsort(cache->frames, cache->count, sizeof(*cache->frames),
+        image_cache_compare);
+
+  size_t kept = 0;
+  for (size_t i = 0; i < cache->count; i++) {
+    if (i + 1 < cache->count &&
+        strcmp(cache->frames[i]->path, cache->frames[i + 1]->path) == 0) {
+      continue;
+    }
+    cache->frames[kept++] = cache->frames[i];
+  }
+  cache->count = kept;
+
+  return 0;
+}
+
+image_cache_t *image_cache_open(const char *path) {
+  image_cache_t *cache = calloc(1, sizeof(*cache));
+  if (cache == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_exit;
+  }
+
+  cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (cache->fd < 0) {
+    LOG_ERROR_ERRNO(path);
+    goto fail_free_cache;
+  }
+
+  /* a second run on the same file reads it but leaves it alone */
+  if (flock(cache->fd, LOCK_EX | LOCK_NB) < 0) {
+    fprintf(stderr, "frame cache `%s` is in use, no frame is added\n", path);
+    cache->failed = true;
+  } else {
+    cache->locked = true;
+  }
+
+  struct stat st;
+  if (fstat(cache->fd, &st) < 0) {
+    LOG_ERROR_ERRNO("fstat");
+    goto fail_close_fd;
+  }
+
+  cache->map_size = st.st_size;
+  if (cache->map_size > 0) {
+    /* copy-on-write, a filter writing to a frame doesn't touch the file */
+    cache->map = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, cache->fd, 0);
+    if (cache->map == MAP_FAILED) {
+      LOG_ERROR_ERRNO("mmap");
+      goto fail_close_fd;
+    }
+  }
+
+  if (image_cache_index(cache) < 0) {
+    goto fail_unmap;
+  }
+
+  pthread_mutex_init(&cache->mutex, NULL);
+  return cache;
+
+fail_unmap:
+  free(cache->frames);
+  if (cache->map != NULL) {
+    munmap(cache->map, cache->map_size);
+  }
+fail_close_fd:
+  close(cache->fd);
+fail_free_cache:
+  free(cache);
+fail_exit:
+  return NULL;
+}
+
+void image_cache_close(image_cache_t *cache) {
+  if (cache->map != NULL) {
+    munmap(cache->map, cache->map_size);
+  }
+  /* the padding of the last frame was never written, and what follows the
+   * frames of a crashed run can go */
+  if (cache->locked && ftruncate(cache->fd, cache->end) < 0) {
+    LOG_ERROR_ERRNO("ftruncate");
+  }
+  pthread_mutex_destroy(&cache->mutex);
+  free(cache->frames);
+  close(cache->fd);
+  free(cache);
+}
+
+size_t image_cache_count(const image_cache_t *cache) { return cache->count; }
+
+/* the key of `source`: its absolute path, mtime and size */
+static int image_cache_key(const char *source, char path[PATH_MAX],
+                           struct stat *st) {
+  if (realpath(source, path) == NULL || stat(path, st) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static int image_cache_find_compare(const void *key, const void *frame) {
+  return strcmp(key, (*(const image_cache_header_t **)frame)->path);
+}
+
+image_t *image_cache_load(image_cache_t *cache, const char *source,
+                          size_t id) {
+  if (cache->count == 0) {
+    return NULL;
+  }
+
+  char path[PATH_MAX];
+  struct stat st;
+  if (image_cache_key(source, path, &st) < 0) {
+    return NULL;
+  }
+
+  const image_cache_header_t **found =
+      bsearch(path, cache->frames, cache->count, sizeof(*cache->frames),
+              image_cache_find_compare);
+  if (found == NULL) {
+    return NULL;
+  }
+
+  const image_cache_header_t *header = *found;
+  if (st.st_size < 0 || header->mtime_sec != st.st_mtim.tv_sec ||
+      header->mtime_nsec != st.st_mtim.tv_nsec ||
+      header->source_size != (uint64_t)st.st_size) {
+    return NULL;
+  }
+
+  image_t *image = calloc(1, sizeof(*image));
+  if (image == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    return NULL;
+  }
+
+  image->id = id;
+  image->width = header->width;
+  image->height = header->height;
+  image->pixels = (pixel_t *)((char *)header + IMAGE_CACHE_PAGE);
+  image->mapped = true;
+
+  /* start reading the frame in before the filters fault on every page */
+  madvise(image->pixels, image_cache_record_size(header) - IMAGE_CACHE_PAGE,
+          MADV_WILLNEED);
+  return image;
+}
+
+static int image_cache_write(int fd, const void *data, size_t size,
+                             off_t offset) {
+  const char *it = data;
+  while (size > 0) {
+    ssize_t written = pwrite(fd, it, size, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR_ERRNO("pwrite");
+      return -1;
+    }
+
+    it += written;
+    size -= written;
+    offset += written;
+  }
+
+  return 0;
+}
+
+int image_cache_store(image_cache_t *cache, const char *source,
+                      const image_t *image) {
+  image_cache_header_t header = {
+      .width = image->width,
+      .height = image->height,
+  };
+
+  char path[PATH_MAX];
+  struct stat st;
+  if (image_cache_key(source, path, &st) < 0 ||
+      strlen(path) >= sizeof(header.path)) {
+    return -1;
+  }
+  strcpy(header.path, path);
+  header.mtime_sec = st.st_mtim.tv_sec;
+  header.mtime_nsec = st.st_mtim.tv_nsec;
+  header.source_size = st.st_size;
+
+  size_t size = image_cache_record_size(&header);
+  if (size == 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  bool failed = cache->failed;
+  off_t offset = cache->end;
+  cache->end += size;
+  pthread_mutex_unlock(&cache->mutex);
+
+  if (failed) {
+    return -1;
+  }
+
+  /* the pixels first, a frame is only found once its header is written */
+  memcpy(header.magic, IMAGE_CACHE_MAGIC, sizeof(header.magic));
+  if (image_cache_write(cache->fd, image->pixels,
+                        image_cache_pixels_size(&header),
+                        offset + IMAGE_CACHE_PAGE) < 0 ||
+      image_cache_write(cache->fd, &header, sizeof(header), offset) < 0) {
+    pthread_mutex_lock(&cache->mutex);
+    cache->failed = true;
+    pthread_mutex_unlock(&cache->mutex);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+
+#include "image-planar.h"
+#include "log.h"
+
+image_planar_t *image_planar_create(size_t id, size_t width, size_t height) {
+  image_planar_t *image = calloc(1, sizeof(*image));
+  if (image == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_exit;
+  }
+
+  image->id = id;
+  image->width = width;
+  image->height = height;
+
+  /* padded rows keep every row of every plane aligned, so vector loads
+   * never split a cache line at the start of a row */
+  image->stride = (width + IMAGE_PLANAR_ALIGN - 1) & ~(IMAGE_PLANAR_ALIGN - 1);
+  size_t plane_size = image->stride * height;
+
+  unsigned char *data =
+      aligned_alloc(IMAGE_PLANAR_ALIGN, (plane_size > 0) ? 4 * plane_size
+                                                         : IMAGE_PLANAR_ALIGN);
+  if (data == NULL) {
+    LOG_ERROR_ERRNO("aligned_alloc");
+    goto fail_free_image;
+  }
+
+  for (int k = 0; k < 4; k++) {
+    image->planes[k] = &data[k * plane_size];
+  }
+
+  return image;
+
+fail_free_image:
+  free(image);
+fail_exit:
+  return NULL;
+}
+
+void image_planar_destroy(image_planar_t *image) {
+  if (image == NULL) {
+    return;
+  }
+
+  free(image->planes[0]);
+  free(image);
+}
+
+image_planar_t *image_planar_from_image(image_t *image) {
+  image_planar_t *planar =
+      image_planar_create(image->id, image->width, image->height);
+  if (planar == NULL) {
+    return NULL;
+  }
+
+  for (size_t y = 0; y < image->height; y++) {
+    const pixel_t *pixels = &image->pixels[y * image->width];
+    unsigned char *rows[4];
+    for (int k = 0; k < 4; k++) {
+      rows[k] = image_planar_row(planar, k, y);
+    }
+
+    for (size_t x = 0; x < image->width; x++) {
+      for (int k = 0; k < 4; k++) {
+        rows[k][x] = pixels[x].bytes[k];
+      }
+    }
+  }
+
+  return planar;
+}
+
+image_t *image_planar_to_image(image_planar_t *image) {
+  image_t *interleaved = image_create(image->id, image->width, image->height);
+  if (interleaved == NULL) {
+    return NULL;
+  }
+
+  for (size_t y = 0; y < image->height; y++) {
+    pixel_t *pixels = &interleaved->pixels[y * image->width];
+    const unsigned char *rows[4];
+    for (int k = 0; k < 4; k++) {
+      rows[k] = image_planar_row(image, k, y);
+    }
+
+    for (size_t x = 0; x < image->width; x++) {
+      for (int k = 0; k < 4; k++) {
+        pixels[x].bytes[k] = rows[k][x];
+      }
+    }
+  }
+
+  return interleaved;
+}
@@ -0,0 +1,410 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "image-png.h"
+#include "log.h"
+
+#define PNG_BPP 4
+#define PNG_WINDOW_SIZE 32768
+
+struct png_strip {
+  image_t *image;
+  const image_png_options_t *options;
+  size_t first_row; /* rows [first_row, last_row) */
+  size_t last_row;
+  bool last;
+
+  unsigned char *out; /* raw deflate data, zlib header/trailer included */
+  size_t out_len;
+  size_t out_cap;
+  uLong adler;
+  size_t in_len;
+  int ret;
+};
+
+static const unsigned char png_signature[8] = {0x89, 'P',  'N',  'G',
+                                               '\r', '\n', 0x1a, '\n'};
+
+/* PNG filter type byte of each option, adaptive has none */
+static const int png_filter_types[] = {
+    [IMAGE_PNG_FILTER_NONE] = 0, [IMAGE_PNG_FILTER_SUB] = 1,
+    [IMAGE_PNG_FILTER_UP] = 2,   [IMAGE_PNG_FILTER_AVG] = 3,
+    [IMAGE_PNG_FILTER_PAETH] = 4,
+};
+
+static int png_paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return (pb <= pc) ? b : c;
+}
+
+/* `prev` is NULL on the first row of the image */
+static void png_filter_row(int type, const unsigned char *row,
+                           const unsigned char *prev, size_t len,
+                           unsigned char *out) {
+  *out++ = type;
+  for (size_t i = 0; i < len; i++) {
+    int a = (i >= PNG_BPP) ? row[i - PNG_BPP] : 0;
+    int b = (prev != NULL) ? prev[i] : 0;
+    int c = (i >= PNG_BPP && prev != NULL) ? prev[i - PNG_BPP] : 0;
+    int predictor = 0;
+
+    switch (type) {
+    case 1:
+      predictor = a;
+      break;
+    case 2:
+      predictor = b;
+      break;
+    case 3:
+      predictor = (a + b) >> 1;
+      break;
+    case 4:
+      predictor = png_paeth(a, b, c);
+      break;
+    }
+
+    out[i] = row[i] - predictor;
+  }
+}
+
+/* same heuristic as libpng: smallest sum of the bytes taken as signed */
+static void png_filter_row_adaptive(const unsigned char *row,
+                                    const unsigned char *prev, size_t len,
+                                    unsigned char *out,
+                                    unsigned char *scratch) {
+  unsigned long best_sum = ~0ul;
+
+  for (int type = 0; type <= 4; type++) {
+    png_filter_row(type, row, prev, len, scratch);
+
+    unsigned long sum = 0;
+    for (size_t i = 1; i <= len; i++) {
+      sum += abs((signed char)scratch[i]);
+    }
+
+    if (sum < best_sum) {
+      best_sum = sum;
+      memcpy(out, scratch, len + 1);
+    }
+  }
+}
+
+static int png_strip_filter(struct png_strip *strip, size_t first_row,
+                            unsigned char *out) {
+  image_t *image = strip->image;
+  size_t len = image->width * PNG_BPP;
+  unsigned char *scratch = NULL;
+
+  if (strip->options->filter == IMAGE_PNG_FILTER_ADAPTIVE) {
+    scratch = malloc(len + 1);
+    if (scratch == NULL) {
+      LOG_ERROR_ERRNO("malloc");
+      return -1;
+    }
+  }
+
+  for (size_t j = first_row; j < strip->last_row; j++) {
+    const unsigned char *row =
+        (const unsigned char *)&image->pixels[j * image->width];
+    const unsigned char *prev = (j > 0) ? row - len : NULL;
+
+    if (scratch != NULL) {
+      png_filter_row_adaptive(row, prev, len, out, scratch);
+    } else {
+      png_filter_row(png_filter_types[strip->options->filter], row, prev, len,
+                     out);
+    }
+    out += len + 1;
+  }
+
+  free(scratch);
+  return 0;
+}
+
+static int png_strip_grow(struct png_strip *strip, size_t min_cap) {
+  if (strip->out_cap >= min_cap) {
+    return 0;
+  }
+
+  size_t cap = (strip->out_cap * 2 > min_cap) ? strip->out_cap * 2 : min_cap;
+  unsigned char *out = realloc(strip->out, cap);
+  if (out == NULL) {
+    LOG_ERROR_ERRNO("realloc");
+    return -1;
+  }
+
+  strip->out = out;
+  strip->out_cap = cap;
+  return 0;
+}
+
+static int png_strip_deflate(struct png_strip *strip, unsigned char *in,
+                             size_t in_len, size_t dict_len) {
+  z_stream stream = {0};
+  int strategy = (strip->options->filter == IMAGE_PNG_FILTER_NONE)
+                     ? Z_DEFAULT_STRATEGY
+                     : Z_FILTERED;
+
+  if (deflateInit2(&stream, strip->options->level, Z_DEFLATED, -MAX_WBITS, 8,
+                   strategy) != Z_OK) {
+    LOG_ERROR("deflateInit2 failed");
+    return -1;
+  }
+
+  if (dict_len > 0 &&
+      deflateSetDictionary(&stream, in - dict_len, dict_len) != Z_OK) {
+    LOG_ERROR("deflateSetDictionary failed");
+    goto fail_deflate_end;
+  }
+
+  /* room for the sync flush marker and the zlib header/trailer */
+  if (png_strip_grow(strip, strip->out_len + deflateBound(&stream, in_len) +
+                                16) < 0) {
+    goto fail_deflate_end;
+  }
+
+  int flush = strip->last ? Z_FINISH : Z_SYNC_FLUSH;
+  stream.next_in = in;
+  stream.avail_in = in_len;
+
+  for (;;) {
+    stream.next_out = strip->out + strip->out_len;
+    stream.avail_out = strip->out_cap - strip->out_len;
+
+    int ret = deflate(&stream, flush);
+    strip->out_len = strip->out_cap - stream.avail_out;
+
+    if (ret == Z_STREAM_END ||
+        (flush == Z_SYNC_FLUSH && ret == Z_OK && stream.avail_out > 0)) {
+      break;
+    }
+
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      LOG_ERROR("deflate failed");
+      goto fail_deflate_end;
+    }
+
+    if (png_strip_grow(strip, strip->out_cap * 2) < 0) {
+      goto fail_deflate_end;
+    }
+  }
+
+  deflateEnd(&stream);
+  strip->adler = adler32(adler32(0, NULL, 0), in, in_len);
+  strip->in_len = in_len;
+  return 0;
+
+fail_deflate_end:
+  deflateEnd(&stream);
+  return -1;
+}
+
+static void *png_strip_run(void *arg) {
+  struct png_strip *strip = arg;
+  image_t *image = strip->image;
+  size_t row_len = image->width * PNG_BPP + 1;
+
+  /* the tail of the previous strip is filtered again to prime the window */
+  size_t dict_rows = (PNG_WINDOW_SIZE + row_len - 1) / row_len;
+  if (dict_rows > strip->first_row) {
+    dict_rows = strip->first_row;
+  }
+
+  size_t first_row = strip->first_row - dict_rows;
+  unsigned char *filtered = malloc((strip->last_row - first_row) * row_len);
+  if (filtered == NULL) {
+    LOG_ERROR_ERRNO("malloc");
+    goto fail_exit;
+  }
+
+  if (png_strip_filter(strip, first_row, filtered) < 0) {
+    goto fail_free_filtered;
+  }
+
+  size_t dict_len = dict_rows * row_len;
+  if (dict_len > PNG_WINDOW_SIZE) {
+    dict_len = PNG_WINDOW_SIZE;
+  }
+
+  if (png_strip_deflate(strip, filtered + dict_rows * row_len,
+                        (strip->last_row - strip->first_row) * row_len,
+                        dict_len) < 0) {
+    goto fail_free_filtered;
+  }
+
+  free(filtered);
+  strip->ret = 0;
+  return NULL;
+
+fail_free_filtered:
+  free(filtered);
+fail_exit:
+  strip->ret = -1;
+  return NULL;
+}
+
+static void png_put_u32(unsigned char *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static void png_write_chunk(FILE *file, const char *type,
+                            const unsigned char *data, size_t len) {
+  unsigned char header[8];
+  unsigned char footer[4];
+
+  png_put_u32(header, len);
+  memcpy(header + 4, type, 4);
+
+  /* crc32 resets to 0 when given a NULL buffer, as with IEND */
+  uLong crc = crc32(0, header + 4, 4);
+  if (len > 0) {
+    crc = crc32(crc, data, len);
+  }
+  png_put_u32(footer, crc);
+
+  fwrite(header, sizeof(header), 1, file);
+  fwrite(data, 1, len, file);
+  fwrite(footer, sizeof(footer), 1, file);
+}
+
+/* zlib header matching what deflateInit would have written for `level` */
+static void png_zlib_header(int level, unsigned char *p) {
+  int flevel = 2;
+  if (level == 0 || level == 1) {
+    flevel = 0;
+  } else if (level >= 2 && level <= 5) {
+    flevel = 1;
+  } else if (level >= 7) {
+    flevel = 3;
+  }
+
+  unsigned int header = 0x7800 | (flevel << 6);
+  header += 31 - header % 31;
+  p[0] = header >> 8;
+  p[1] = header;
+}
+
+int image_png_write_strips(image_t *image, FILE *file,
+                           const image_png_options_t *options) {
+  size_t count = options->threads;
+  if (count > image->height) {
+    count = image->height;
+  }
+
+  struct png_strip *strips = calloc(count, sizeof(*strips));
+  if (strips == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_exit;
+  }
+
+  pthread_t *threads = calloc(count, sizeof(*threads));
+  bool *spawned = calloc(count, sizeof(*spawned));
+  if (threads == NULL || spawned == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_free_threads;
+  }
+
+  for (size_t k = 0; k < count; k++) {
+    strips[k].image = image;
+    strips[k].options = options;
+    strips[k].first_row = image->height * k / count;
+    strips[k].last_row = image->height * (k + 1) / count;
+    strips[k].last = (k == count - 1);
+  }
+
+  /* the zlib header goes in front of the first strip */
+  if (png_strip_grow(&strips[0], 2) < 0) {
+    goto fail_free_strips;
+  }
+  png_zlib_header(options->level, strips[0].out);
+  strips[0].out_len = 2;
+
+  /* strip 0 runs on the calling thread, as does any strip that couldn't get
+   * its own */
+  for (size_t k = 1; k < count; k++) {
+    errno = pthread_create(&threads[k], NULL, png_strip_run, &strips[k]);
+    if (errno != 0) {
+      LOG_ERROR_ERRNO("pthread_create");
+      continue;
+    }
+    spawned[k] = true;
+  }
+
+  png_strip_run(&strips[0]);
+
+  for (size_t k = 1; k < count; k++) {
+    if (spawned[k]) {
+      pthread_join(threads[k], NULL);
+    } else {
+      png_strip_run(&strips[k]);
+    }
+  }
+
+  uLong adler = adler32(0, NULL, 0);
+  for (size_t k = 0; k < count; k++) {
+    if (strips[k].ret < 0) {
+      goto fail_free_strips;
+    }
+    adler = adler32_combine(adler, strips[k].adler, strips[k].in_len);
+  }
+
+  struct png_strip *last = &strips[count - 1];
+  if (png_strip_grow(last, last->out_len + 4) < 0) {
+    goto fail_free_strips;
+  }
+  png_put_u32(last->out + last->out_len, adler);
+  last->out_len += 4;
+
+  unsigned char ihdr[13];
+  png_put_u32(ihdr, image->width);
+  png_put_u32(ihdr + 4, image->height);
+  ihdr[8] = 8;  /* bit depth */
+  ihdr[9] = 6;  /* RGBA */
+  ihdr[10] = 0; /* deflate */
+  ihdr[11] = 0; /* adaptive filtering */
+  ihdr[12] = 0; /* no interlace */
+
+  fwrite(png_signature, sizeof(png_signature), 1, file);
+  png_write_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+  for (size_t k = 0; k < count; k++) {
+    png_write_chunk(file, "IDAT", strips[k].out, strips[k].out_len);
+  }
+  png_write_chunk(file, "IEND", NULL, 0);
+
+  if (ferror(file)) {
+    LOG_ERROR("couldn't write png");
+    goto fail_free_strips;
+  }
+
+  for (size_t k = 0; k < count; k++) {
+    free(strips[k].out);
+  }
+  free(spawned);
+  free(threads);
+  free(strips);
+  return 0;
+
+fail_free_strips:
+  for (size_t k = 0; k < count; k++) {
+    free(strips[k].out);
+  }
+fail_free_threads:
+  free(spawned);
+  free(threads);
+  free(strips);
+fail_exit:
+  return -1;
+}
@@ -0,0 +1,305 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "affinity.h"
+#include "image-pool.h"
+#include "log.h"
+
+#define IMAGE_POOL_MIN_SHIFT 12
+#define IMAGE_POOL_MIN_SIZE (1ul << IMAGE_POOL_MIN_SHIFT)
+#define IMAGE_POOL_CLASSES 128
+#define IMAGE_POOL_CACHE_SLOTS 2
+
+typedef struct image_pool_block {
+  struct image_pool_block *next;
+} image_pool_block_t;
+
+typedef struct image_pool_cache {
+  struct image_pool *pool;
+  struct image_pool_cache *next;
+  size_t count[IMAGE_POOL_CLASSES];
+  void *slots[IMAGE_POOL_CLASSES][IMAGE_POOL_CACHE_SLOTS];
+} image_pool_cache_t;
+
+struct image_pool {
+  size_t high_water;
+  pthread_key_t cache_key;
+
+  pthread_mutex_t mutex;
+  image_pool_block_t *free_lists[IMAGE_POOL_CLASSES];
+  image_pool_cache_t *caches;
+
+  atomic_size_t cached_bytes;
+  atomic_size_t peak_cached_bytes;
+  atomic_size_t allocs;
+  atomic_size_t thread_hits;
+  atomic_size_t shared_hits;
+  atomic_size_t system_allocs;
+  atomic_size_t system_frees;
+};
+
+static _Atomic(image_pool_t *) default_pool = NULL;
+static _Atomic(image_pool_t *) node_pools[AFFINITY_MAX_NODES];
+
+/* returns the class of `size` and its rounded-up size, or -1 if too large */
+static int image_pool_class(size_t size, size_t *class_size) {
+  if (size <= IMAGE_POOL_MIN_SIZE) {
+    *class_size = IMAGE_POOL_MIN_SIZE;
+    return 0;
+  }
+
+  /* 2^e < size <= 2^(e+1), split in 4 steps */
+  int e = 63 - __builtin_clzl(size - 1);
+  size_t base = 1ul << e;
+  size_t step = base >> 2;
+  size_t k = (size - base + step - 1) / step;
+
+  int class = 1 + (e - IMAGE_POOL_MIN_SHIFT) * 4 + (k - 1);
+  if (class >= IMAGE_POOL_CLASSES) {
+    return -1;
+  }
+
+  *class_size = base + k * step;
+  return class;
+}
+
+static void image_pool_release(image_pool_t *pool, void *ptr) {
+  atomic_fetch_add_explicit(&pool->system_frees, 1, memory_order_relaxed);
+  free(ptr);
+}
+
+/* reserves room for `size` bytes below the high-water mark */
+static int image_pool_reserve(image_pool_t *pool, size_t size) {
+  size_t cached = atomic_load(&pool->cached_bytes);
+  do {
+    if (cached + size > pool->high_water) {
+      return -1;
+    }
+  } while (!atomic_compare_exchange_weak(&pool->cached_bytes, &cached,
+                                         cached + size));
+
+  size_t peak = atomic_load(&pool->peak_cached_bytes);
+  while (cached + size > peak &&
+         !atomic_compare_exchange_weak(&pool->peak_cached_bytes, &peak,
+                                       cached + size)) {
+  }
+
+  return 0;
+}
+
+static void image_pool_flush_cache(image_pool_t *pool,
+                                   image_pool_cache_t *cache) {
+  for (int c = 0; c < IMAGE_POOL_CLASSES; c++) {
+    while (cache->count[c] > 0) {
+      image_pool_block_t *block = cache->slots[c][--cache->count[c]];
+      block->next = pool->free_lists[c];
+      pool->free_lists[c] = block;
+    }
+  }
+}
+
+static void image_pool_cache_destructor(void *arg) {
+  image_pool_cache_t *cache = arg;
+  image_pool_t *pool = cache->pool;
+
+  pthread_mutex_lock(&pool->mutex);
+  image_pool_flush_cache(pool, cache);
+  for (image_pool_cache_t **it = &pool->caches; *it != NULL;
+       it = &(*it)->next) {
+    if (*it == cache) {
+      *it = cache->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  free(cache);
+}
+
+static image_pool_cache_t *image_pool_cache(image_pool_t *pool) {
+  image_pool_cache_t *cache = pthread_getspecific(pool->cache_key);
+  if (cache != NULL) {
+    return cache;
+  }
+
+  cache = calloc(1, sizeof(*cache));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->pool = pool;
+
+  errno = pthread_setspecific(pool->cache_key, cache);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_setspecific");
+    free(cache);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  cache->next = pool->caches;
+  pool->caches = cache;
+  pthread_mutex_unlock(&pool->mutex);
+
+  return cache;
+}
+
+image_pool_t *image_pool_create(size_t high_water) {
+  image_pool_t *pool = calloc(1, sizeof(*pool));
+  if (pool == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_exit;
+  }
+
+  pool->high_water = high_water;
+
+  errno = pthread_mutex_init(&pool->mutex, NULL);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_mutex_init");
+    goto fail_free_pool;
+  }
+
+  errno = pthread_key_create(&pool->cache_key, image_pool_cache_destructor);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_key_create");
+    goto fail_destroy_mutex;
+  }
+
+  return pool;
+
+fail_destroy_mutex:
+  pthread_mutex_destroy(&pool->mutex);
+fail_free_pool:
+  free(pool);
+fail_exit:
+  return NULL;
+}
+
+void image_pool_destroy(image_pool_t *pool) {
+  image_pool_t *expected = pool;
+  atomic_compare_exchange_strong(&default_pool, &expected, NULL);
+  for (int node = 0; node < AFFINITY_MAX_NODES; node++) {
+    expected = pool;
+    atomic_compare_exchange_strong(&node_pools[node], &expected, NULL);
+  }
+
+  /* thread exit won't call the destructor anymore, caches are freed here */
+  pthread_key_delete(pool->cache_key);
+
+  while (pool->caches != NULL) {
+    image_pool_cache_t *cache = pool->caches;
+    pool->caches = cache->next;
+    image_pool_flush_cache(pool, cache);
+    free(cache);
+  }
+
+  for (int c = 0; c < IMAGE_POOL_CLASSES; c++) {
+    while (pool->free_lists[c] != NULL) {
+      image_pool_block_t *block = pool->free_lists[c];
+      pool->free_lists[c] = block->next;
+      free(block);
+    }
+  }
+
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool);
+}
+
+void *image_pool_alloc(image_pool_t *pool, size_t size) {
+  size_t class_size;
+  int class = image_pool_class(size, &class_size);
+  void *ptr = NULL;
+
+  atomic_fetch_add_explicit(&pool->allocs, 1, memory_order_relaxed);
+
+  if (class < 0) {
+    goto system_alloc;
+  }
+
+  image_pool_cache_t *cache = image_pool_cache(pool);
+  if (cache != NULL && cache->count[class] > 0) {
+    ptr = cache->slots[class][--cache->count[class]];
+    atomic_fetch_add_explicit(&pool->thread_hits, 1, memory_order_relaxed);
+    goto cached_alloc;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  image_pool_block_t *block = pool->free_lists[class];
+  if (block != NULL) {
+    pool->free_lists[class] = block->next;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (block != NULL) {
+    ptr = block;
+    atomic_fetch_add_explicit(&pool->shared_hits, 1, memory_order_relaxed);
+    goto cached_alloc;
+  }
+
+  size = class_size;
+
+system_alloc:
+  atomic_fetch_add_explicit(&pool->system_allocs, 1, memory_order_relaxed);
+  ptr = malloc(size);
+  if (ptr == NULL) {
+    LOG_ERROR_ERRNO("malloc");
+  }
+  return ptr;
+
+cached_alloc:
+  atomic_fetch_sub(&pool->cached_bytes, class_size);
+  return ptr;
+}
+
+void image_pool_free(image_pool_t *pool, void *ptr, size_t size) {
+  size_t class_size;
+  int class = image_pool_class(size, &class_size);
+
+  if (class < 0 || image_pool_reserve(pool, class_size) < 0) {
+    image_pool_release(pool, ptr);
+    return;
+  }
+
+  image_pool_cache_t *cache = image_pool_cache(pool);
+  if (cache != NULL && cache->count[class] < IMAGE_POOL_CACHE_SLOTS) {
+    cache->slots[class][cache->count[class]++] = ptr;
+    return;
+  }
+
+  image_pool_block_t *block = ptr;
+  pthread_mutex_lock(&pool->mutex);
+  block->next = pool->free_lists[class];
+  pool->free_lists[class] = block;
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+void image_pool_set_default(image_pool_t *pool) {
+  atomic_store(&default_pool, pool);
+}
+
+image_pool_t *image_pool_default(void) {
+  int node = affinity_current_node();
+  if (node >= 0) {
+    image_pool_t *pool = atomic_load(&node_pools[node]);
+    if (pool != NULL) {
+      return pool;
+    }
+  }
+
+  return atomic_load(&default_pool);
+}
+
+void image_pool_set_node_default(int node, image_pool_t *pool) {
+  atomic_store(&node_pools[node], pool);
+}
+
+void image_pool_get_stats(image_pool_t *pool, image_pool_stats_t *stats) {
+  stats->allocs = atomic_load(&pool->allocs);
+  stats->thread_hits = atomic_load(&pool->thread_hits);
+  stats->shared_hits = atomic_load(&pool->shared_hits);
+  stats->system_allocs = atomic_load(&pool->system_allocs);
+  stats->system_frees = atomic_load(&pool->system_frees);
+  stats->cached_bytes = atomic_load(&pool->cached_bytes);
+  stats->peak_cached_bytes = atomic_load(&pool->peak_cached_bytes);
+}
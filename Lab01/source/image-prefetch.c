@@ -0,0 +1,173 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image-prefetch.h"
+#include "image.h"
+#include "log.h"
+#include "queue.h"
+#include "trace.h"
+
+struct image_prefetch {
+  const char *dir_name;
+  size_t first;
+  queue_t *queue; /* holds at most `depth` files, NULL marks the end */
+  pthread_t thread;
+  atomic_bool stop;
+};
+
+void image_file_destroy(image_file_t *file) {
+  free(file->data);
+  free(file);
+}
+
+/* returns NULL when the file doesn't exist or can't be read */
+static image_file_t *image_prefetch_read(image_prefetch_t *prefetch,
+                                         size_t index) {
+  image_file_t *file = calloc(1, sizeof(*file));
+  if (file == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_exit;
+  }
+
+  file->index = index;
+  if (image_dir_input_path(prefetch->dir_name, index, file->path,
+                           sizeof(file->path)) < 0) {
+    goto fail_free_file;
+  }
+
+  int fd = open(file->path, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      LOG_ERROR_ERRNO("open");
+    }
+    goto fail_free_file;
+  }
+
+  /* start the whole file in the page cache before blocking on it */
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    LOG_ERROR_ERRNO("fstat");
+    goto fail_close_fd;
+  }
+
+  file->size = st.st_size;
+  file->data = malloc(file->size);
+  if (file->data == NULL) {
+    LOG_ERROR_ERRNO("malloc");
+    goto fail_close_fd;
+  }
+
+  for (size_t offset = 0; offset < file->size;) {
+    ssize_t count = read(fd, file->data + offset, file->size - offset);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      LOG_ERROR_ERRNO("read");
+      goto fail_close_fd;
+    }
+    offset += count;
+  }
+
+  close(fd);
+  return file;
+
+fail_close_fd:
+  close(fd);
+fail_free_file:
+  if (file != NULL) {
+    free(file->data);
+    free(file);
+  }
+fail_exit:
+  return NULL;
+}
+
+static void *image_prefetch_run(void *arg) {
+  image_prefetch_t *prefetch = arg;
+  trace_set_thread_name("prefetch", -1);
+
+  for (size_t index = prefetch->first;; index++) {
+    image_file_t *file = NULL;
+    if (!atomic_load(&prefetch->stop)) {
+      uint64_t start = trace_now();
+      file = image_prefetch_read(prefetch, index);
+      trace_span("read", start, index);
+    }
+
+    queue_push(prefetch->queue, file);
+    if (file == NULL) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+image_prefetch_t *image_prefetch_create(const char *dir_name, size_t first,
+                                        size_t depth) {
+  image_prefetch_t *prefetch = calloc(1, sizeof(*prefetch));
+  if (prefetch == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_exit;
+  }
+
+  prefetch->dir_name = dir_name;
+  prefetch->first = first;
+
+  prefetch->queue = queue_create(depth);
+  if (prefetch->queue == NULL) {
+    goto fail_free_prefetch;
+  }
+
+  errno = pthread_create(&prefetch->thread, NULL, image_prefetch_run,
+                         prefetch);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_create");
+    goto fail_destroy_queue;
+  }
+
+  return prefetch;
+
+fail_destroy_queue:
+  queue_destroy(prefetch->queue);
+fail_free_prefetch:
+  free(prefetch);
+fail_exit:
+  return NULL;
+}
+
+void image_prefetch_destroy(image_prefetch_t *prefetch) {
+  atomic_store(&prefetch->stop, true);
+
+  /* unblock the reader, it pushes the end marker once it sees `stop` */
+  image_file_t *file;
+  while ((file = image_prefetch_next(prefetch)) != NULL) {
+    image_file_destroy(file);
+  }
+
+  pthread_join(prefetch->thread, NULL);
+  queue_destroy(prefetch->queue);
+  free(prefetch);
+}
+
+image_file_t *image_prefetch_next(image_prefetch_t *prefetch) {
+  image_file_t *file = queue_pop(prefetch->queue);
+
+  /* the end marker goes back for the other consumers, the reader is gone
+   * so there is room for it */
+  if (file == NULL) {
+    queue_push(prefetch->queue, NULL);
+  }
+
+  return file;
+}
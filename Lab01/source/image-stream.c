@@ -0,0 +1,634 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image-pool.h"
+#include "image-stream.h"
+#include "log.h"
+#include "trace.h"
+
+#define Y4M_MAGIC "YUV4MPEG2"
+#define Y4M_FRAME "FRAME"
+#define Y4M_LINE_SIZE 1024
+#define Y4M_PARAM_SIZE 32
+
+typedef enum y4m_chroma {
+  Y4M_CHROMA_420, /* a U and a V sample per 2x2 pixels */
+  Y4M_CHROMA_444,
+  Y4M_CHROMA_MONO, /* no U and V planes */
+} y4m_chroma_t;
+
+/* a frame written ahead of its turn, already encoded */
+struct image_stream_pending {
+  struct image_stream_pending *next;
+  size_t id;
+  void *data;
+  size_t size;
+};
+
+struct image_stream {
+  int fd;
+  image_format_t format;
+  const image_stream_t *reader; /* writer: where the y4m header comes from */
+
+  pthread_mutex_t mutex;
+  bool header_done;
+  bool done;   /* reader: the end of the stream or an error was reached */
+  bool failed; /* a read or a write failed, nothing more gets written */
+  size_t width;
+  size_t height;
+  y4m_chroma_t chroma;
+  char rate[Y4M_PARAM_SIZE];   /* the F parameter of a y4m header */
+  char aspect[Y4M_PARAM_SIZE]; /* the A one */
+  size_t next_id;              /* to read, or to write */
+  struct image_stream_pending *pending; /* by increasing id */
+  size_t held;                          /* pending frames with data */
+};
+
+static image_stream_t *image_stream_create(int fd, image_format_t format) {
+  image_stream_t *stream = calloc(1, sizeof(*stream));
+  if (stream == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_exit;
+  }
+
+  errno = pthread_mutex_init(&stream->mutex, NULL);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_mutex_init");
+    goto fail_free_stream;
+  }
+
+  stream->fd = fd;
+  stream->format = format;
+  stream->chroma = Y4M_CHROMA_420;
+  snprintf(stream->rate, sizeof(stream->rate), "F25:1");
+  snprintf(stream->aspect, sizeof(stream->aspect), "A1:1");
+  return stream;
+
+fail_free_stream:
+  free(stream);
+fail_exit:
+  return NULL;
+}
+
+image_stream_t *image_stream_create_reader(int fd, image_format_t format,
+                                           size_t width, size_t height) {
+  if (format == IMAGE_FORMAT_RGBA_RAW && (width == 0 || height == 0)) {
+    LOG_ERROR("rgba-raw input needs the frame size");
+    return NULL;
+  }
+
+  image_stream_t *stream = image_stream_create(fd, format);
+  if (stream != NULL) {
+    stream->width = width;
+    stream->height = height;
+  }
+  return stream;
+}
+
+image_stream_t *image_stream_create_writer(int fd, image_format_t format,
+                                           const image_stream_t *reader) {
+  image_stream_t *stream = image_stream_create(fd, format);
+  if (stream != NULL) {
+    stream->reader = reader;
+  }
+  return stream;
+}
+
+/* reads until `size` bytes, the end of the stream or an error, returns the
+ * bytes read or -1 */
+static ssize_t stream_read_full(int fd, void *buffer, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t count = read(fd, (char *)buffer + done, size - done);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0) {
+      LOG_ERROR_ERRNO("read");
+      return -1;
+    }
+    if (count == 0) {
+      break;
+    }
+    done += count;
+  }
+  return done;
+}
+
+static int stream_write_full(int fd, const void *buffer, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t count = write(fd, (const char *)buffer + done, size - done);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0) {
+      LOG_ERROR_ERRNO("write");
+      return -1;
+    }
+    done += count;
+  }
+  return 0;
+}
+
+/* a header line without its '\n', a byte at a time so that nothing of the
+ * frame after it is consumed; 0 at the end of the stream */
+static int stream_read_line(int fd, char *line, size_t size) {
+  size_t length = 0;
+  while (1) {
+    char c;
+    ssize_t count = read(fd, &c, 1);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0) {
+      LOG_ERROR_ERRNO("read");
+      return -1;
+    }
+    if (count == 0 && length == 0) {
+      return 0;
+    }
+    if (count == 0) {
+      LOG_ERROR("y4m: truncated header");
+      return -1;
+    }
+    if (c == '\n') {
+      break;
+    }
+    if (length + 1 >= size) {
+      LOG_ERROR("y4m: header longer than %zu bytes", size);
+      return -1;
+    }
+    line[length++] = c;
+  }
+
+  line[length] = '\0';
+  return 1;
+}
+
+static int y4m_parse_chroma(const char *name, y4m_chroma_t *chroma) {
+  /* the 4:2:0 variants only differ by where the chroma samples sit */
+  if (strcmp(name, "420") == 0 || strcmp(name, "420jpeg") == 0 ||
+      strcmp(name, "420paldv") == 0 || strcmp(name, "420mpeg2") == 0) {
+    *chroma = Y4M_CHROMA_420;
+  } else if (strcmp(name, "444") == 0) {
+    *chroma = Y4M_CHROMA_444;
+  } else if (strcmp(name, "mono") == 0) {
+    *chroma = Y4M_CHROMA_MONO;
+  } else {
+    LOG_ERROR("y4m: unsupported colour space C%s", name);
+    return -1;
+  }
+  return 0;
+}
+
+static int y4m_read_header(image_stream_t *stream) {
+  char line[Y4M_LINE_SIZE];
+  int ret = stream_read_line(stream->fd, line, sizeof(line));
+  if (ret <= 0) {
+    if (ret == 0) {
+      LOG_ERROR("y4m: empty stream");
+    }
+    return -1;
+  }
+
+  size_t magic = strlen(Y4M_MAGIC);
+  if (strncmp(line, Y4M_MAGIC, magic) != 0 ||
+      (line[magic] != ' ' && line[magic] != '\0')) {
+    LOG_ERROR("y4m: not a YUV4MPEG2 stream");
+    return -1;
+  }
+
+  char *save;
+  for (char *param = strtok_r(line + magic, " ", &save); param != NULL;
+       param = strtok_r(NULL, " ", &save)) {
+    switch (param[0]) {
+    case 'W':
+      stream->width = strtoul(param + 1, NULL, 10);
+      break;
+    case 'H':
+      stream->height = strtoul(param + 1, NULL, 10);
+      break;
+    case 'F':
+      snprintf(stream->rate, sizeof(stream->rate), "%s", param);
+      break;
+    case 'A':
+      snprintf(stream->aspect, sizeof(stream->aspect), "%s", param);
+      break;
+    case 'C':
+      if (y4m_parse_chroma(param + 1, &stream->chroma) < 0) {
+        return -1;
+      }
+      break;
+    default: /* interlacing and X extensions don't change the layout */
+      break;
+    }
+  }
+
+  if (stream->width == 0 || stream->height == 0) {
+    LOG_ERROR("y4m: header without a frame size");
+    return -1;
+  }
+  return 0;
+}
+
+/* samples per row or column of the U and V planes */
+static size_t y4m_chroma_size(y4m_chroma_t chroma, size_t size) {
+  return (chroma == Y4M_CHROMA_420) ? (size + 1) / 2 : size;
+}
+
+static size_t y4m_frame_size(y4m_chroma_t chroma, size_t width,
+                             size_t height) {
+  if (chroma == Y4M_CHROMA_MONO) {
+    return width * height;
+  }
+  return width * height +
+         2 * y4m_chroma_size(chroma, width) * y4m_chroma_size(chroma, height);
+}
+
+static unsigned char clamp_byte(int value) {
+  return (value < 0) ? 0 : (value > 255) ? 255 : value;
+}
+
+/* BT.601 limited range, the default of ffmpeg for yuv420p */
+static void y4m_to_rgba(y4m_chroma_t chroma, const unsigned char *data,
+                        image_t *image) {
+  size_t width = image->width;
+  size_t cw = y4m_chroma_size(chroma, width);
+  size_t ch = y4m_chroma_size(chroma, image->height);
+  size_t shift = (chroma == Y4M_CHROMA_420) ? 1 : 0;
+  const unsigned char *u_plane = data + width * image->height;
+  const unsigned char *v_plane = u_plane + cw * ch;
+
+  for (size_t y = 0; y < image->height; y++) {
+    for (size_t x = 0; x < width; x++) {
+      int c = 298 * (data[y * width + x] - 16);
+      int d = 0;
+      int e = 0;
+      if (chroma != Y4M_CHROMA_MONO) {
+        size_t sample = (y >> shift) * cw + (x >> shift);
+        d = u_plane[sample] - 128;
+        e = v_plane[sample] - 128;
+      }
+
+      pixel_t *pixel = &image->pixels[y * width + x];
+      pixel->bytes[0] = clamp_byte((c + 409 * e + 128) >> 8);
+      pixel->bytes[1] = clamp_byte((c - 100 * d - 208 * e + 128) >> 8);
+      pixel->bytes[2] = clamp_byte((c + 516 * d + 128) >> 8);
+      pixel->bytes[3] = 255;
+    }
+  }
+}
+
+/* alpha is dropped, 4:2:0 chroma is taken from the mean of 2x2 pixels */
+static void rgba_to_y4m(y4m_chroma_t chroma, const image_t *image,
+                        unsigned char *data) {
+  size_t width = image->width;
+  size_t height = image->height;
+  for (size_t i = 0; i < width * height; i++) {
+    const unsigned char *p = image->pixels[i].bytes;
+    data[i] = ((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16;
+  }
+
+  if (chroma == Y4M_CHROMA_MONO) {
+    return;
+  }
+
+  size_t cw = y4m_chroma_size(chroma, width);
+  size_t ch = y4m_chroma_size(chroma, height);
+  size_t step = (chroma == Y4M_CHROMA_420) ? 2 : 1;
+  unsigned char *u_plane = data + width * height;
+  unsigned char *v_plane = u_plane + cw * ch;
+
+  for (size_t cy = 0; cy < ch; cy++) {
+    for (size_t cx = 0; cx < cw; cx++) {
+      int sum[3] = {0, 0, 0};
+      int count = 0;
+      for (size_t y = cy * step; y < cy * step + step && y < height; y++) {
+        for (size_t x = cx * step; x < cx * step + step && x < width; x++) {
+          const unsigned char *p = image->pixels[y * width + x].bytes;
+          sum[0] += p[0];
+          sum[1] += p[1];
+          sum[2] += p[2];
+          count++;
+        }
+      }
+
+      int r = (sum[0] + count / 2) / count;
+      int g = (sum[1] + count / 2) / count;
+      int b = (sum[2] + count / 2) / count;
+      u_plane[cy * cw + cx] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+      v_plane[cy * cw + cx] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+  }
+}
+
+/* scratch buffers for y4m frames come from the pool of the run */
+static void *stream_alloc(size_t size) {
+  image_pool_t *pool = image_pool_default();
+  void *buffer = (pool != NULL) ? image_pool_alloc(pool, size) : malloc(size);
+  if (buffer == NULL) {
+    LOG_ERROR_ERRNO("malloc");
+  }
+  return buffer;
+}
+
+static void stream_free(void *buffer, size_t size) {
+  image_pool_t *pool = image_pool_default();
+  if (pool != NULL) {
+    image_pool_free(pool, buffer, size);
+  } else {
+    free(buffer);
+  }
+}
+
+/* the y4m FRAME line, 0 at the end of the stream */
+static int y4m_read_frame_header(image_stream_t *stream) {
+  char line[Y4M_LINE_SIZE];
+  int ret = stream_read_line(stream->fd, line, sizeof(line));
+  if (ret <= 0) {
+    return ret;
+  }
+
+  size_t length = strlen(Y4M_FRAME);
+  if (strncmp(line, Y4M_FRAME, length) != 0 ||
+      (line[length] != ' ' && line[length] != '\0')) {
+    LOG_ERROR("y4m: expected a FRAME header");
+    return -1;
+  }
+  return 1;
+}
+
+image_t *image_stream_read(image_stream_t *stream) {
+  uint64_t start = trace_now();
+  void *buffer = NULL;
+  size_t size = 0;
+  image_t *image = NULL;
+
+  pthread_mutex_lock(&stream->mutex);
+  if (stream->done) {
+    goto fail_unlock;
+  }
+
+  if (stream->format == IMAGE_FORMAT_Y4M) {
+    if (!stream->header_done && y4m_read_header(stream) < 0) {
+      goto fail_error;
+    }
+    stream->header_done = true;
+
+    int ret = y4m_read_frame_header(stream);
+    if (ret == 0) {
+      goto end_of_stream;
+    }
+    if (ret < 0) {
+      goto fail_error;
+    }
+  }
+
+  image = image_create(stream->next_id, stream->width, stream->height);
+  if (image == NULL) {
+    goto fail_error;
+  }
+
+  /* rgba-raw frames land in the frame buffer itself */
+  buffer = image->pixels;
+  size = stream->width * stream->height * sizeof(pixel_t);
+  if (stream->format == IMAGE_FORMAT_Y4M) {
+    size = y4m_frame_size(stream->chroma, stream->width, stream->height);
+    buffer = stream_alloc(size);
+    if (buffer == NULL) {
+      goto fail_destroy_image;
+    }
+  }
+
+  ssize_t count = stream_read_full(stream->fd, buffer, size);
+  if (count == 0 && stream->format == IMAGE_FORMAT_RGBA_RAW) {
+    image_destroy(image);
+    goto end_of_stream;
+  }
+  if (count >= 0 && (size_t)count != size) {
+    LOG_ERROR("frame %zu is truncated (%zd of %zu bytes)", stream->next_id,
+              count, size);
+  }
+  if (count < 0 || (size_t)count != size) {
+    goto fail_free_buffer;
+  }
+
+  stream->next_id++;
+  pthread_mutex_unlock(&stream->mutex);
+
+  if (stream->format == IMAGE_FORMAT_Y4M) {
+    y4m_to_rgba(stream->chroma, buffer, image);
+    stream_free(buffer, size);
+  }
+
+  trace_span("stream read", start, image->id);
+  return image;
+
+fail_free_buffer:
+  if (buffer != image->pixels) {
+    stream_free(buffer, size);
+  }
+fail_destroy_image:
+  image_destroy(image);
+fail_error:
+  stream->failed = true;
+end_of_stream:
+  stream->done = true;
+fail_unlock:
+  pthread_mutex_unlock(&stream->mutex);
+  return NULL;
+}
+
+static int stream_write_header(image_stream_t *stream, const image_t *image) {
+  if (stream->header_done) {
+    if (image->width != stream->width || image->height != stream->height) {
+      LOG_ERROR("y4m: frame %zu is %zux%zu, the stream is %zux%zu", image->id,
+                image->width, image->height, stream->width, stream->height);
+      return -1;
+    }
+    return 0;
+  }
+
+  static const char *chroma_names[] = {
+      [Y4M_CHROMA_420] = "420jpeg",
+      [Y4M_CHROMA_444] = "444",
+      [Y4M_CHROMA_MONO] = "mono",
+  };
+
+  /* the reader parsed its header before the first frame came out of it */
+  const image_stream_t *reader = stream->reader;
+  if (reader != NULL && reader->format == IMAGE_FORMAT_Y4M) {
+    stream->chroma = reader->chroma;
+    memcpy(stream->rate, reader->rate, sizeof(stream->rate));
+    memcpy(stream->aspect, reader->aspect, sizeof(stream->aspect));
+  }
+
+  stream->width = image->width;
+  stream->height = image->height;
+  stream->header_done = true;
+
+  char header[Y4M_LINE_SIZE];
+  int length = snprintf(header, sizeof(header), "%s W%zu H%zu %s Ip %s C%s\n",
+                        Y4M_MAGIC, stream->width, stream->height,
+                        stream->rate, stream->aspect,
+                        chroma_names[stream->chroma]);
+  return stream_write_full(stream->fd, header, length);
+}
+
+/* writes the frames held back that are now next, or all of them; skipped
+ * frames have no data */
+static int stream_write_pending(image_stream_t *stream, bool all) {
+  int ret = 0;
+  while (stream->pending != NULL &&
+         (all || stream->pending->id == stream->next_id)) {
+    struct image_stream_pending *pending = stream->pending;
+    stream->pending = pending->next;
+
+    if (!stream->failed && pending->data != NULL &&
+        stream_write_full(stream->fd, pending->data, pending->size) < 0) {
+      stream->failed = true;
+      ret = -1;
+    }
+    stream->next_id = pending->id + 1;
+    if (pending->data != NULL) {
+      stream->held--;
+    }
+    free(pending->data);
+    free(pending);
+  }
+  return ret;
+}
+
+/* takes `data` over, NULL for a skipped frame */
+static int stream_hold(image_stream_t *stream, size_t id, void *data,
+                       size_t size) {
+  struct image_stream_pending *pending = malloc(sizeof(*pending));
+  if (pending == NULL) {
+    LOG_ERROR_ERRNO("malloc");
+    free(data);
+    return -1;
+  }
+
+  pending->id = id;
+  pending->data = data;
+  pending->size = size;
+
+  struct image_stream_pending **it = &stream->pending;
+  while (*it != NULL && (*it)->id < id) {
+    it = &(*it)->next;
+  }
+  pending->next = *it;
+  *it = pending;
+  if (data != NULL) {
+    stream->held++;
+  }
+  return 0;
+}
+
+int image_stream_write(image_stream_t *stream, image_t *image) {
+  uint64_t start = trace_now();
+  const void *data = image->pixels;
+  size_t size = image->width * image->height * sizeof(pixel_t);
+  unsigned char *encoded = NULL;
+
+  /* that of the y4m reader if any, stream_write_header copies it later */
+  if (stream->format == IMAGE_FORMAT_Y4M) {
+    y4m_chroma_t chroma = Y4M_CHROMA_420;
+    if (stream->reader != NULL && stream->reader->format == IMAGE_FORMAT_Y4M) {
+      chroma = stream->reader->chroma;
+    }
+
+    size_t header = strlen(Y4M_FRAME "\n");
+    size = header + y4m_frame_size(chroma, image->width, image->height);
+    encoded = malloc(size);
+    if (encoded == NULL) {
+      LOG_ERROR_ERRNO("malloc");
+      return -1;
+    }
+
+    memcpy(encoded, Y4M_FRAME "\n", header);
+    rgba_to_y4m(chroma, image, encoded + header);
+    data = encoded;
+  }
+
+  int ret = -1;
+  pthread_mutex_lock(&stream->mutex);
+  if (stream->failed) {
+    goto fail_unlock;
+  }
+
+  if (stream->format == IMAGE_FORMAT_Y4M &&
+      stream_write_header(stream, image) < 0) {
+    goto fail_unlock;
+  }
+
+  if (image->id == stream->next_id) {
+    if (stream_write_full(stream->fd, data, size) < 0) {
+      stream->failed = true;
+      goto fail_unlock;
+    }
+
+    stream->next_id++;
+    ret = stream_write_pending(stream, false);
+  } else {
+    /* rgba-raw frames are only copied when they have to wait */
+    if (encoded == NULL) {
+      encoded = malloc(size);
+      if (encoded == NULL) {
+        LOG_ERROR_ERRNO("malloc");
+        goto fail_unlock;
+      }
+      memcpy(encoded, data, size);
+    }
+
+    ret = stream_hold(stream, image->id, encoded, size);
+    encoded = NULL;
+  }
+
+fail_unlock:
+  pthread_mutex_unlock(&stream->mutex);
+  free(encoded);
+  trace_span("stream write", start, image->id);
+  return ret;
+}
+
+size_t image_stream_held(image_stream_t *stream) {
+  pthread_mutex_lock(&stream->mutex);
+  size_t held = stream->held;
+  pthread_mutex_unlock(&stream->mutex);
+  return held;
+}
+
+void image_stream_skip(image_stream_t *stream, size_t id) {
+  pthread_mutex_lock(&stream->mutex);
+  if (id == stream->next_id) {
+    stream->next_id++;
+    stream_write_pending(stream, false);
+  } else if (stream_hold(stream, id, NULL, 0) < 0) {
+    stream->failed = true;
+  }
+  pthread_mutex_unlock(&stream->mutex);
+}
+
+int image_stream_destroy(image_stream_t *stream) {
+  int ret = stream_write_pending(stream, true);
+  if (stream->failed) {
+    ret = -1;
+  }
+
+  if (close(stream->fd) < 0) {
+    LOG_ERROR_ERRNO("close");
+    ret = -1;
+  }
+
+  pthread_mutex_destroy(&stream->mutex);
+  free(stream);
+  return ret;
+}
@@ -2,10 +2,17 @@
 
 #include <png.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "image-cache.h"
+#include "image-png.h"
+#include "image-pool.h"
+#include "image-prefetch.h"
+#include "image-stream.h"
 #include "image.h"
 #include "log.h"
+#include "trace.h"
 
 image_t *image_create(size_t id, size_t width, size_t height) {
   image_t *image = calloc(1, sizeof(*image));
@@ -18,8 +25,15 @@ image_t *image_create(size_t id, size_t width, size_t height) {
   image->width = width;
   image->height = height;
 
-  image->pixels =
-      malloc((image->width * image->height) * sizeof(*image->pixels));
+  size_t size = (image->width * image->height) * sizeof(*image->pixels);
+
+  image->pool = image_pool_default();
+  if (image->pool != NULL) {
+    image->pixels = image_pool_alloc(image->pool, size);
+  } else {
+    image->pixels = malloc(size);
+  }
+
   if (image->pixels == NULL) {
     LOG_ERROR_ERRNO("malloc");
     goto fail_free_image;
@@ -34,24 +48,35 @@ fail_exit:
 }
 
 image_t *image_create_from_png(char *filename) {
-  if (filename == NULL) {
-    LOG_ERROR_NULL_PTR();
-    goto fail_exit;
-  }
+  return image_create_from_png_into(filename, NULL);
+}
 
-  /* source: https://gist.github.com/niw/5963798 */
+struct png_memory {
+  const unsigned char *data;
+  size_t size;
+  size_t offset;
+};
 
-  FILE *file = fopen(filename, "rb");
-  if (file == NULL) {
-    LOG_ERROR_ERRNO("fopen");
-    goto fail_exit;
+static void png_read_memory(png_structp png, png_bytep out, png_size_t len) {
+  struct png_memory *memory = png_get_io_ptr(png);
+  if (len > memory->size - memory->offset) {
+    png_error(png, "unexpected end of data");
   }
 
+  memcpy(out, memory->data + memory->offset, len);
+  memory->offset += len;
+}
+
+/* reads from `file` or, if NULL, from `memory`; `name` is only for logs */
+static image_t *image_read_png(const char *name, FILE *file,
+                               struct png_memory *memory, image_t *dest) {
+  /* source: https://gist.github.com/niw/5963798 */
+
   png_structp png =
       png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   if (png == NULL) {
     LOG_ERROR("couldn't create png_struct");
-    goto fail_close_file;
+    goto fail_exit;
   }
 
   png_infop info = png_create_info_struct(png);
@@ -60,21 +85,24 @@ image_t *image_create_from_png(char *filename) {
     goto fail_free_png_struct;
   }
 
+  /* assigned after setjmp and read after a longjmp */
+  image_t *volatile image = NULL;
+
   if (setjmp(png_jmpbuf(png))) {
-    goto fail_free_png_info;
+    goto fail_free_image;
   }
 
-  png_init_io(png, file);
-  png_read_info(png, info);
-
-  image_t *image = image_create(0, png_get_image_width(png, info),
-                                png_get_image_height(png, info));
-  if (image == NULL) {
-    goto fail_free_png_info;
+  if (file != NULL) {
+    png_init_io(png, file);
+  } else {
+    png_set_read_fn(png, memory, png_read_memory);
   }
+  png_read_info(png, info);
 
+  size_t width = png_get_image_width(png, info);
+  size_t height = png_get_image_height(png, info);
   png_byte color = png_get_color_type(png, info);
-  png_byte depth = png_get_color_type(png, info);
+  png_byte depth = png_get_bit_depth(png, info);
 
   /* read any color_type into 8 bit depth, RGBA format */
 
@@ -107,70 +135,87 @@ image_t *image_create_from_png(char *filename) {
     png_set_gray_to_rgb(png);
   }
 
+  int passes = png_set_interlace_handling(png);
   png_read_update_info(png, info);
 
-  /* read image data */
+  /* rows are decoded in place, they must have the layout of pixel_t */
 
-  png_bytep *row_pointers = calloc(image->height, sizeof(*row_pointers));
-  if (row_pointers == NULL) {
+  if (png_get_rowbytes(png, info) != width * sizeof(pixel_t)) {
+    LOG_ERROR("unsupported png format in `%s`", name);
     goto fail_free_image;
   }
 
-  for (int j = 0; j < image->height; j++) {
-    row_pointers[j] = malloc(png_get_rowbytes(png, info));
-    if (row_pointers[j] == NULL) {
-      goto fail_free_rows;
+  if (dest != NULL) {
+    if (dest->width != width || dest->height != height) {
+      LOG_ERROR("`%s` is %zux%zu, destination image is %zux%zu", name, width,
+                height, dest->width, dest->height);
+      goto fail_free_image;
+    }
+    image = dest;
+  } else {
+    image = image_create(0, width, height);
+    if (image == NULL) {
+      goto fail_free_image;
     }
   }
 
-  png_read_image(png, row_pointers);
-
-  /* copy image data */
+  /* read image data */
 
-  for (int j = 0; j < image->height; j++) {
-    for (int i = 0; i < image->width; i++) {
-      pixel_t *pixel = image_get_pixel(image, i, j);
-      pixel->bytes[0] = row_pointers[j][4 * i + 0];
-      pixel->bytes[1] = row_pointers[j][4 * i + 1];
-      pixel->bytes[2] = row_pointers[j][4 * i + 2];
-      pixel->bytes[3] = row_pointers[j][4 * i + 3];
+  for (int pass = 0; pass < passes; pass++) {
+    for (size_t j = 0; j < height; j++) {
+      png_read_row(png, (png_bytep)&image->pixels[j * width], NULL);
     }
   }
 
   /* cleanup */
 
-  for (int j = 0; j < image->height; j++) {
-    if (row_pointers[j] != NULL) {
-      free(row_pointers[j]);
-    }
-  }
-  free(row_pointers);
-
   png_destroy_read_struct(&png, &info, NULL);
-  fclose(file);
 
   return image;
 
-fail_free_rows:
-  for (int j = 0; j < image->height; j++) {
-    if (row_pointers[j] != NULL) {
-      free(row_pointers[j]);
-    }
-  }
-  free(row_pointers);
 fail_free_image:
-  image_destroy(image);
-fail_free_png_info:
+  if (image != NULL && image != dest) {
+    image_destroy(image);
+  }
   png_destroy_read_struct(&png, &info, NULL);
-  goto fail_free_image;
+  goto fail_exit;
 fail_free_png_struct:
   png_destroy_read_struct(&png, NULL, NULL);
-fail_close_file:
+fail_exit:
+  return NULL;
+}
+
+image_t *image_create_from_png_into(char *filename, image_t *dest) {
+  if (filename == NULL) {
+    LOG_ERROR_NULL_PTR();
+    goto fail_exit;
+  }
+
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL) {
+    LOG_ERROR_ERRNO("fopen");
+    goto fail_exit;
+  }
+
+  image_t *image = image_read_png(filename, file, NULL, dest);
   fclose(file);
+  return image;
+
 fail_exit:
   return NULL;
 }
 
+image_t *image_create_from_png_memory(const char *name, const void *data,
+                                      size_t size, image_t *dest) {
+  if (name == NULL || data == NULL) {
+    LOG_ERROR_NULL_PTR();
+    return NULL;
+  }
+
+  struct png_memory memory = {.data = data, .size = size, .offset = 0};
+  return image_read_png(name, NULL, &memory, dest);
+}
+
 image_t *image_copy(image_t *image) {
   image_t *new_image = image_create(image->id, image->width, image->height);
   if (new_image == NULL) {
@@ -193,14 +238,40 @@ fail_exit:
 }
 
 void image_destroy(image_t *image) {
-  if (image->pixels != NULL) {
+  if (image->mapped) {
+    /* the pixels belong to the frame cache */
+  } else if (image->pixels != NULL && image->pool != NULL) {
+    image_pool_free(image->pool, image->pixels,
+                    (image->width * image->height) * sizeof(*image->pixels));
+  } else if (image->pixels != NULL) {
     free(image->pixels);
   }
   free(image);
 }
 
+const image_png_options_t image_png_default_options = {
+    .level = IMAGE_PNG_LEVEL_DEFAULT,
+    .filter = IMAGE_PNG_FILTER_ADAPTIVE,
+    .threads = 1,
+};
+
+static const int png_filter_masks[] = {
+    [IMAGE_PNG_FILTER_ADAPTIVE] = PNG_ALL_FILTERS,
+    [IMAGE_PNG_FILTER_NONE] = PNG_FILTER_NONE,
+    [IMAGE_PNG_FILTER_SUB] = PNG_FILTER_SUB,
+    [IMAGE_PNG_FILTER_UP] = PNG_FILTER_UP,
+    [IMAGE_PNG_FILTER_AVG] = PNG_FILTER_AVG,
+    [IMAGE_PNG_FILTER_PAETH] = PNG_FILTER_PAETH,
+};
+
 int image_save_png(image_t *image, char *filename) {
-  if (image == NULL || filename == NULL) {
+  return image_save_png_with_options(image, filename,
+                                     &image_png_default_options);
+}
+
+int image_save_png_with_options(image_t *image, char *filename,
+                                const image_png_options_t *options) {
+  if (image == NULL || filename == NULL || options == NULL) {
     LOG_ERROR_NULL_PTR();
     goto fail_exit;
   }
@@ -213,6 +284,15 @@ int image_save_png(image_t *image, char *filename) {
     goto fail_exit;
   }
 
+  if (options->threads > 1 && image->height > 1) {
+    if (image_png_write_strips(image, file, options) < 0) {
+      goto fail_close_file;
+    }
+
+    fclose(file);
+    return 0;
+  }
+
   png_structp png =
       png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   if (png == NULL) {
@@ -232,6 +312,11 @@ int image_save_png(image_t *image, char *filename) {
 
   png_init_io(png, file);
 
+  if (options->level != IMAGE_PNG_LEVEL_DEFAULT) {
+    png_set_compression_level(png, options->level);
+  }
+  png_set_filter(png, PNG_FILTER_TYPE_BASE, png_filter_masks[options->filter]);
+
   /* output is 8 bit depth, RGBA format */
 
   png_set_IHDR(png, info, image->width, image->height, 8, PNG_COLOR_TYPE_RGBA,
@@ -240,56 +325,21 @@ int image_save_png(image_t *image, char *filename) {
 
   png_write_info(png, info);
 
-  /* copy image data */
-
-  png_bytep *row_pointers = calloc(image->height, sizeof(*row_pointers));
-  if (row_pointers == NULL) {
-    goto fail_free_png_struct;
-  }
+  /* pixel_t already is RGBA, rows are handed to libpng without a copy */
 
   for (int j = 0; j < image->height; j++) {
-    row_pointers[j] = malloc(png_get_rowbytes(png, info));
-    if (row_pointers[j] == NULL) {
-      goto fail_free_rows;
-    }
+    png_write_row(png, (png_const_bytep)&image->pixels[j * image->width]);
   }
 
-  for (int j = 0; j < image->height; j++) {
-    for (int i = 0; i < image->width; i++) {
-      pixel_t *pixel = image_get_pixel(image, i, j);
-      row_pointers[j][4 * i + 0] = pixel->bytes[0];
-      row_pointers[j][4 * i + 1] = pixel->bytes[1];
-      row_pointers[j][4 * i + 2] = pixel->bytes[2];
-      row_pointers[j][4 * i + 3] = pixel->bytes[3];
-    }
-  }
-
-  /* write PNG file */
-
-  png_write_image(png, row_pointers);
   png_write_end(png, NULL);
 
   /* cleanup */
 
-  for (int j = 0; j < image->height; j++) {
-    if (row_pointers[j] != NULL) {
-      free(row_pointers[j]);
-    }
-  }
-  free(row_pointers);
-
   png_destroy_write_struct(&png, &info);
   fclose(file);
 
   return 0;
 
-fail_free_rows:
-  for (int j = 0; j < image->height; j++) {
-    if (row_pointers[j] != NULL) {
-      free(row_pointers[j]);
-    }
-  }
-  free(row_pointers);
 fail_free_png_info:
   png_destroy_write_struct(&png, &info);
   goto fail_close_file;
@@ -301,54 +351,245 @@ fail_exit:
   return -1;
 }
 
-image_t *image_dir_load_next(image_dir_t *image_dir) {
+int image_dir_input_path(const char *input_dir_name, size_t index,
+                         char *buffer, size_t buffer_size) {
+  int count = snprintf(buffer, buffer_size, "%s/%04ld.png", input_dir_name,
+                       index);
+  if (count >= buffer_size - 1) {
+    LOG_ERROR("buffer too small");
+    return -1;
+  }
+
+  return 0;
+}
+
+int image_dir_open(image_dir_t *image_dir) {
+  if (image_dir->prefetch_depth == 0 || image_dir->prefetch != NULL ||
+      image_dir->input_stream != NULL) {
+    return 0;
+  }
+
+  /* the files of cached frames aren't read at all */
+  if (image_dir->cache != NULL && image_cache_count(image_dir->cache) > 0) {
+    return 0;
+  }
+
+  image_dir->prefetch =
+      image_prefetch_create(image_dir->input_dir_name, image_dir->load_current,
+                            image_dir->prefetch_depth);
+  return (image_dir->prefetch == NULL) ? -1 : 0;
+}
+
+void image_dir_close(image_dir_t *image_dir) {
+  if (image_dir->prefetch != NULL) {
+    image_prefetch_destroy(image_dir->prefetch);
+    image_dir->prefetch = NULL;
+  }
+}
+
+static void image_dir_log_empty(image_dir_t *image_dir, size_t index) {
+  if (index == 0) {
+    LOG_ERROR("no image found in directory `%s`", image_dir->input_dir_name);
+  }
+}
+
+static void image_dir_cache_store(image_dir_t *image_dir, const char *path,
+                                  image_t *image) {
+  if (image_dir->cache == NULL || image == NULL) {
+    return;
+  }
+
+  uint64_t start = trace_now();
+  image_cache_store(image_dir->cache, path, image);
+  trace_span("cache store", start, image->id);
+}
+
+/* -1 when the file is there but can't be decoded, `*image` is NULL when
+ * there is no such file */
+static int image_dir_load_index(image_dir_t *image_dir, size_t index,
+                                image_t **image) {
   const size_t buffer_size = 256;
   char buffer[buffer_size];
 
+  *image = NULL;
+  if (image_dir_input_path(image_dir->input_dir_name, index, buffer,
+                           buffer_size) < 0) {
+    return 0;
+  }
+
+  if (access(buffer, F_OK) < 0) {
+    image_dir_log_empty(image_dir, index);
+    return 0;
+  }
+
+  if (image_dir->cache != NULL) {
+    *image = image_cache_load(image_dir->cache, buffer, index);
+    if (*image != NULL) {
+      return 0;
+    }
+  }
+
+  uint64_t start = trace_now();
+  *image = image_create_from_png(buffer);
+  trace_span("png decode", start, index);
+  if (*image == NULL) {
+    LOG_ERROR("failed to decode `%s`", buffer);
+    return -1;
+  }
+
+  (*image)->id = index;
+  image_dir_cache_store(image_dir, buffer, *image);
+  return 0;
+}
+
+/* decodes the next file read ahead by the prefetch thread */
+static int image_dir_load_prefetched(image_dir_t *image_dir, image_t **image,
+                                     size_t *id) {
+  image_file_t *file = image_prefetch_next(image_dir->prefetch);
+  if (file == NULL) {
+    image_dir_log_empty(image_dir, __atomic_load_n(&image_dir->load_current,
+                                                   __ATOMIC_RELAXED));
+    *image = NULL;
+    return 0;
+  }
+
+  /* counted either way, the next run of the pipeline starts after it */
+  __atomic_fetch_add(&image_dir->load_current, 1, __ATOMIC_RELAXED);
+  *id = file->index;
+
+  uint64_t start = trace_now();
+  *image =
+      image_create_from_png_memory(file->path, file->data, file->size, NULL);
+  trace_span("png decode", start, file->index);
+  int ret = 0;
+  if (*image != NULL) {
+    (*image)->id = file->index;
+    image_dir_cache_store(image_dir, file->path, *image);
+  } else {
+    LOG_ERROR("failed to decode `%s`", file->path);
+    ret = -1;
+  }
+
+  image_file_destroy(file);
+  return ret;
+}
+
+int image_dir_load_next(image_dir_t *image_dir, image_t **image, size_t *id) {
+  int ret = 0;
+
+  *image = NULL;
   if (image_dir->stop) {
     goto stop_exit;
   }
 
-  int count = snprintf(buffer, buffer_size, "%s/%04ld.png",
-                       image_dir->input_dir_name, image_dir->load_current);
-  if (count >= buffer_size - 1) {
-    LOG_ERROR("buffer too small");
+  if (image_dir_open(image_dir) < 0) {
     goto fail_exit;
   }
 
-  if (access(buffer, F_OK) < 0) {
-    if (image_dir->load_current == 0) {
-      LOG_ERROR("no image found in directory `%s`", image_dir->input_dir_name);
+  if (image_dir->input_stream != NULL) {
+    *image = image_stream_read(image_dir->input_stream);
+  } else if (image_dir->prefetch != NULL) {
+    ret = image_dir_load_prefetched(image_dir, image, id);
+  } else {
+    *id = image_dir->load_current;
+    ret = image_dir_load_index(image_dir, *id, image);
+    if (ret < 0 || *image != NULL) {
+      image_dir->load_current++;
     }
+  }
+
+  if (ret == 0 && *image == NULL) {
+    goto fail_close;
+  }
+
+  return ret;
+
+stop_exit:
+fail_close:
+  image_dir_close(image_dir);
+fail_exit:
+  return 0;
+}
+
+int image_dir_load_any(image_dir_t *image_dir, image_t **image, size_t *id) {
+  *image = NULL;
+  if (image_dir->stop) {
+    return 0;
+  }
+
+  if (image_dir->input_stream != NULL) {
+    *image = image_stream_read(image_dir->input_stream);
+    return 0;
+  }
+
+  if (image_dir->prefetch != NULL) {
+    return image_dir_load_prefetched(image_dir, image, id);
+  }
+
+  *id = __atomic_fetch_add(&image_dir->load_current, 1, __ATOMIC_RELAXED);
+  return image_dir_load_index(image_dir, *id, image);
+}
+
+/* `tmp` selects the hidden name used until image_dir_commit */
+static int image_dir_output_path(image_dir_t *image_dir, size_t id, bool tmp,
+                                 char *buffer, size_t buffer_size) {
+  int count = snprintf(buffer, buffer_size,
+                       tmp ? "%s/.%s-%04ld.png.tmp" : "%s/%s-%04ld.png",
+                       image_dir->output_dir_name, image_dir->save_prefix, id);
+  if (count >= buffer_size - 1) {
+    LOG_ERROR("buffer too small");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int image_dir_write(image_dir_t *image_dir, image_t *image, bool tmp) {
+  const size_t buffer_size = 256;
+  char buffer[buffer_size];
+
+  if (image_dir->output_stream != NULL) {
+    return image_stream_write(image_dir->output_stream, image);
+  }
+
+  if (image_dir_output_path(image_dir, image->id, tmp, buffer, buffer_size) <
+      0) {
     goto fail_exit;
   }
 
-  image_t *image = image_create_from_png(buffer);
-  if (image == NULL) {
+  uint64_t start = trace_now();
+  int ret = image_save_png_with_options(image, buffer, &image_dir->png);
+  trace_span("png encode", start, image->id);
+  if (ret < 0) {
     goto fail_exit;
   }
 
-  image->id = image_dir->load_current++;
-  return image;
+  return 0;
 
-stop_exit:
 fail_exit:
-  return NULL;
+  return -1;
 }
 
 int image_dir_save(image_dir_t *image_dir, image_t *image) {
+  return image_dir_write(image_dir, image, false);
+}
+
+int image_dir_save_tmp(image_dir_t *image_dir, image_t *image) {
+  return image_dir_write(image_dir, image, true);
+}
+
+int image_dir_commit(image_dir_t *image_dir, size_t id) {
   const size_t buffer_size = 256;
-  char buffer[buffer_size];
+  char tmp[buffer_size];
+  char path[buffer_size];
 
-  int count =
-      snprintf(buffer, buffer_size, "%s/%s-%04ld.png",
-               image_dir->output_dir_name, image_dir->save_prefix, image->id);
-  if (count >= buffer_size - 1) {
-    LOG_ERROR("buffer too small");
+  if (image_dir_output_path(image_dir, id, true, tmp, buffer_size) < 0 ||
+      image_dir_output_path(image_dir, id, false, path, buffer_size) < 0) {
     goto fail_exit;
   }
 
-  if (image_save_png(image, buffer) < 0) {
+  if (rename(tmp, path) < 0) {
+    LOG_ERROR_ERRNO("rename");
     goto fail_exit;
   }
 
@@ -364,4 +605,5 @@ void image_dir_reset(image_dir_t *image_dir, const char *input_dir_name,
   image_dir->output_dir_name = output_dir_name;
   image_dir->save_prefix = save_prefix;
   image_dir->load_current = 0;
+  image_dir_close(image_dir);
 }
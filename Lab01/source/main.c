@@ -1,11 +1,16 @@
 /* DO NOT EDIT THIS FILE */
 
+#include <fcntl.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "image-cache.h"
+#include "image-stream.h"
 #include "image.h"
 #include "log.h"
 #include "pipeline.h"
@@ -16,8 +21,91 @@ static void show_help(FILE *f, const char *exec_name) {
   fprintf(f, "Options:\n");
   fprintf(f, "  --directory PATH                path to read images\n");
   fprintf(f, "  --out PATH                      path to write images\n");
+  fprintf(f, "  --input-format FORMAT           png (files in --directory), "
+             "y4m or\n");
+  fprintf(f, "                                  rgba-raw (a stream from "
+             "--input)\n");
+  fprintf(f, "  --output-format FORMAT          png (files in --out), y4m or "
+             "rgba-raw\n");
+  fprintf(f, "                                  (a stream to --output)\n");
+  fprintf(f, "  --input PATH                    stream to read, - for stdin "
+             "(default)\n");
+  fprintf(f, "  --output PATH                   stream to write, - for stdout "
+             "(default),\n");
+  fprintf(f, "                                  messages then go to stderr\n");
+  fprintf(f, "  --input-size WxH                size of the rgba-raw input "
+             "frames\n");
   fprintf(f, "  --quiet                         don't print anything\n");
-  fprintf(f, "  --pipeline [serial|pthread|tbb] pipeline algorithm to use\n");
+  fprintf(f, "  --pipeline [serial|pthread|tbb|tbb-flow|coro]\n");
+  fprintf(f, "                                  pipeline algorithm to use\n");
+  fprintf(f, "  --pool-high-water MB            MiB of frames kept for reuse "
+             "(0 disables)\n");
+  fprintf(f, "  --filters LIST                  comma separated filters to "
+             "run (default\n");
+  fprintf(f, "                                  " FILTER_GRAPH_DEFAULT ")\n");
+  fprintf(f, "  --planar                        run consecutive stencils on "
+             "planar frames\n");
+  fprintf(f, "  --split [auto|never|always]     filter a frame on several "
+             "threads (auto when\n");
+  fprintf(f, "                                  too few frames are queued)\n");
+  fprintf(f, "  --tile-rows N                   output rows of a stencil band "
+             "(0 fits L2)\n");
+  fprintf(f, "  --flow-concurrency L,F,E        tbb-flow load, filter and "
+             "encode\n");
+  fprintf(f, "                                  concurrency (0 for "
+             "unlimited)\n");
+  fprintf(f, "  --flow-budget MB                tbb-flow bytes of frames in "
+             "flight\n");
+  fprintf(f, "  --max-memory MB                 pthread and coro bytes of "
+             "frames in flight,\n");
+  fprintf(f, "                                  new frames wait above it (0 "
+             "for unlimited)\n");
+  fprintf(f, "  --numa                          pin pthread loaders and "
+             "workers to the NUMA\n");
+  fprintf(f, "                                  nodes, frames stay on the "
+             "node that\n");
+  fprintf(f, "                                  decoded them\n");
+  fprintf(f, "  --batch N                       pthread frames a loader "
+             "hands to the workers\n");
+  fprintf(f, "                                  at once (default 1)\n");
+  fprintf(f, "  --batch-latency US              longest a loader holds a "
+             "frame back to fill\n");
+  fprintf(f, "                                  a batch (default 1000)\n");
+  fprintf(f, "  --thumbnails                    tbb-flow also saves the "
+             "unscaled frames\n");
+  fprintf(f, "  --ordered                       make output files appear "
+             "in order\n");
+  fprintf(f, "  --loaders N                     threads decoding frames "
+             "(0 for one per core)\n");
+  fprintf(f, "  --workers N                     pthread or coro workers, tbb "
+             "tokens (0 for the\n");
+  fprintf(f, "                                  default)\n");
+  fprintf(f, "  --autotune N                    time the stages on the first "
+             "N frames and\n");
+  fprintf(f, "                                  size the loaders and workers "
+             "for the rest\n");
+  fprintf(f, "  --prefetch N                    frame files read ahead "
+             "(0 disables)\n");
+  fprintf(f, "  --frame-cache PATH              keep the decoded frames in "
+             "PATH and skip\n");
+  fprintf(f, "                                  their decode on the next "
+             "runs\n");
+  fprintf(f, "  --png-level [0-9]               zlib compression level\n");
+  fprintf(f, "  --png-filter FILTER             none, sub, up, avg, paeth or "
+             "adaptive\n");
+  fprintf(f, "  --png-threads N                 deflate each image in N "
+             "strips\n");
+  fprintf(f, "  --stats                         print allocation and page "
+             "fault counts,\n");
+  fprintf(f, "                                  stage latencies and "
+             "throughput\n");
+  fprintf(f, "  --stats-json PATH               write the stage latencies "
+             "and throughput\n");
+  fprintf(f, "                                  as JSON\n");
+  fprintf(f, "  --trace PATH                    write a timeline of the run "
+             "for\n");
+  fprintf(f, "                                  chrome://tracing or "
+             "ui.perfetto.dev\n");
 }
 
 static void fail_missing_argument(const char *exec_name, const char *opt) {
@@ -32,6 +120,35 @@ static void fail_unknown_argument(const char *exec_name, const char *opt) {
   exit(1);
 }
 
+static void fail_invalid_argument(const char *exec_name, const char *opt,
+                                  const char *arg) {
+  fprintf(stderr, "%s: invalid argument '%s' for option `%s`\n", exec_name,
+          arg, opt);
+  fprintf(stderr, "Try '%s --help' for more information.\n", exec_name);
+  exit(1);
+}
+
+static size_t parse_size(const char *exec_name, const char *opt,
+                         const char *arg) {
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0') {
+    fail_invalid_argument(exec_name, opt, arg);
+  }
+  return value;
+}
+
+/* bytes, rejecting what wouldn't fit in a size_t */
+static size_t parse_mib(const char *exec_name, const char *opt,
+                        const char *arg) {
+  size_t value = parse_size(exec_name, opt, arg);
+  if (value > SIZE_MAX / (1024 * 1024)) {
+    fail_invalid_argument(exec_name, opt, arg);
+  }
+  return value * 1024 * 1024;
+}
+
 static void fail_unknown_pipeline_algorithm(const char *exec_name,
                                             const char *arg) {
   fprintf(stderr, "%s: unrecognized argument '%s' for option `--pipeline`\n",
@@ -47,7 +164,97 @@ static void fail_multiple_pipeline(const char *exec_name) {
   exit(1);
 }
 
-static image_dir_t image_dir = {.load_current = 0, .stop = false};
+static image_dir_t image_dir = {
+    .load_current = 0,
+    .stop = false,
+    .prefetch_depth = 8,
+    .png = {.level = IMAGE_PNG_LEVEL_DEFAULT,
+            .filter = IMAGE_PNG_FILTER_ADAPTIVE,
+            .threads = 1},
+};
+
+static const char *png_filter_names[] = {
+    [IMAGE_PNG_FILTER_ADAPTIVE] = "adaptive",
+    [IMAGE_PNG_FILTER_NONE] = "none",
+    [IMAGE_PNG_FILTER_SUB] = "sub",
+    [IMAGE_PNG_FILTER_UP] = "up",
+    [IMAGE_PNG_FILTER_AVG] = "avg",
+    [IMAGE_PNG_FILTER_PAETH] = "paeth",
+};
+
+static image_png_filter_t parse_png_filter(const char *exec_name,
+                                           const char *opt, const char *arg) {
+  for (int f = 0; f < sizeof(png_filter_names) / sizeof(*png_filter_names);
+       f++) {
+    if (strcmp(png_filter_names[f], arg) == 0) {
+      return f;
+    }
+  }
+
+  fail_invalid_argument(exec_name, opt, arg);
+  return IMAGE_PNG_FILTER_ADAPTIVE;
+}
+
+static const char *image_format_names[] = {
+    [IMAGE_FORMAT_PNG] = "png",
+    [IMAGE_FORMAT_Y4M] = "y4m",
+    [IMAGE_FORMAT_RGBA_RAW] = "rgba-raw",
+};
+
+static image_format_t parse_image_format(const char *exec_name,
+                                         const char *opt, const char *arg) {
+  for (int f = 0; f < sizeof(image_format_names) / sizeof(*image_format_names);
+       f++) {
+    if (strcmp(image_format_names[f], arg) == 0) {
+      return f;
+    }
+  }
+
+  fail_invalid_argument(exec_name, opt, arg);
+  return IMAGE_FORMAT_PNG;
+}
+
+static void parse_frame_size(const char *exec_name, const char *opt,
+                             const char *arg, size_t *width, size_t *height) {
+  char *end;
+  errno = 0;
+  *width = strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != 'x') {
+    fail_invalid_argument(exec_name, opt, arg);
+  }
+
+  const char *it = end + 1;
+  *height = strtoull(it, &end, 10);
+  if (errno != 0 || end == it || *end != '\0' || *width == 0 ||
+      *height == 0) {
+    fail_invalid_argument(exec_name, opt, arg);
+  }
+}
+
+/* "-" is stdin or stdout; the stream gets its own copy of stdout, which
+ * then points to stderr so that messages don't end up in the frames */
+static int open_stream(const char *path, bool output) {
+  int fd;
+  if (strcmp(path, "-") != 0) {
+    fd = output ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                : open(path, O_RDONLY);
+  } else if (!output) {
+    fd = dup(STDIN_FILENO);
+  } else {
+    fflush(stdout);
+    fd = dup(STDOUT_FILENO);
+    if (fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+      LOG_ERROR_ERRNO("dup2");
+      close(fd);
+      return -1;
+    }
+  }
+
+  if (fd < 0) {
+    LOG_ERROR_ERRNO(path);
+  }
+  return fd;
+}
 
 static void sigint_handler(int sig) {
   printf("\n\rSIGINT received, stopping pipeline\n");
@@ -62,15 +269,55 @@ __attribute__((weak)) int pipeline_pthread(image_dir_t *image_dir) {
 
 __attribute__((weak)) int pipeline_tbb(image_dir_t *image_dir) { return -1; }
 
+__attribute__((weak)) int pipeline_tbb_flow(image_dir_t *image_dir) {
+  return -1;
+}
+
+__attribute__((weak)) int pipeline_coro(image_dir_t *image_dir) { return -1; }
+
+static void parse_flow_concurrency(const char *exec_name, const char *opt,
+                                   const char *arg) {
+  size_t *limits[] = {
+      &pipeline_options.flow_load,
+      &pipeline_options.flow_filter,
+      &pipeline_options.flow_encode,
+  };
+  const char *it = arg;
+
+  for (int k = 0; k < 3; k++) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(it, &end, 10);
+    if (errno != 0 || end == it || *end != (k < 2 ? ',' : '\0')) {
+      fail_invalid_argument(exec_name, opt, arg);
+    }
+
+    *limits[k] = value;
+    it = end + 1;
+  }
+}
+
 int main(int argc, char *argv[]) {
   char *exec_name = argv[0];
   bool use_pipeline_serial = false;
   bool use_pipeline_pthread = false;
   bool use_pipeline_tbb = false;
+  bool use_pipeline_tbb_flow = false;
+  bool use_pipeline_coro = false;
   int use_pipeline_count = 0;
-  char *input_dir_name;
+  char *input_dir_name = NULL;
   char *output_dir_name;
+  image_format_t input_format = IMAGE_FORMAT_PNG;
+  image_format_t output_format = IMAGE_FORMAT_PNG;
+  const char *input_path = "-";
+  const char *output_path = "-";
+  size_t input_width = 0;
+  size_t input_height = 0;
   bool quiet = false;
+  const char *filters = FILTER_GRAPH_DEFAULT;
+  bool planar = false;
+  const char *trace = NULL;
+  const char *frame_cache = NULL;
 
   output_dir_name = NULL;
 
@@ -102,11 +349,227 @@ int main(int argc, char *argv[]) {
       } else if (strcmp("tbb", argv[i + 1]) == 0) {
         use_pipeline_tbb = true;
         use_pipeline_count++;
+      } else if (strcmp("tbb-flow", argv[i + 1]) == 0) {
+        use_pipeline_tbb_flow = true;
+        use_pipeline_count++;
+      } else if (strcmp("coro", argv[i + 1]) == 0) {
+        use_pipeline_coro = true;
+        use_pipeline_count++;
       } else {
         fail_unknown_pipeline_algorithm(exec_name, argv[i + 1]);
       }
 
       i++;
+    } else if (strcmp("--pool-high-water", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      pipeline_options.pool_high_water =
+          parse_mib(exec_name, argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--filters", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      filters = argv[i + 1];
+      i++;
+    } else if (strcmp("--planar", argv[i]) == 0) {
+      planar = true;
+    } else if (strcmp("--split", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      if (strcmp("auto", argv[i + 1]) == 0) {
+        pipeline_options.split = PIPELINE_SPLIT_AUTO;
+      } else if (strcmp("never", argv[i + 1]) == 0) {
+        pipeline_options.split = PIPELINE_SPLIT_NEVER;
+      } else if (strcmp("always", argv[i + 1]) == 0) {
+        pipeline_options.split = PIPELINE_SPLIT_ALWAYS;
+      } else {
+        fail_invalid_argument(exec_name, argv[i], argv[i + 1]);
+      }
+      i++;
+    } else if (strcmp("--tile-rows", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      pipeline_options.tile_rows = parse_size(exec_name, argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--flow-concurrency", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      parse_flow_concurrency(exec_name, argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--flow-budget", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      /* the budget is all that bounds the frames tbb-flow admits */
+      size_t budget = parse_mib(exec_name, argv[i], argv[i + 1]);
+      if (budget == 0) {
+        fail_invalid_argument(exec_name, argv[i], argv[i + 1]);
+      }
+
+      pipeline_options.flow_budget = budget;
+      i++;
+    } else if (strcmp("--max-memory", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      pipeline_options.max_memory = parse_mib(exec_name, argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--numa", argv[i]) == 0) {
+      pipeline_options.numa = true;
+    } else if (strcmp("--batch", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      size_t batch = parse_size(exec_name, argv[i], argv[i + 1]);
+      if (batch < 1 || batch > PIPELINE_BATCH_MAX) {
+        fail_invalid_argument(exec_name, argv[i], argv[i + 1]);
+      }
+
+      pipeline_options.batch = batch;
+      i++;
+    } else if (strcmp("--batch-latency", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      pipeline_options.batch_latency_ns =
+          parse_size(exec_name, argv[i], argv[i + 1]) * 1000;
+      i++;
+    } else if (strcmp("--thumbnails", argv[i]) == 0) {
+      pipeline_options.thumbnails = true;
+    } else if (strcmp("--ordered", argv[i]) == 0) {
+      pipeline_options.ordered = true;
+    } else if (strcmp("--loaders", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      pipeline_options.loaders = parse_size(exec_name, argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--workers", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      pipeline_options.workers = parse_size(exec_name, argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--autotune", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      pipeline_options.autotune = parse_size(exec_name, argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--prefetch", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      image_dir.prefetch_depth = parse_size(exec_name, argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--frame-cache", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      frame_cache = argv[i + 1];
+      i++;
+    } else if (strcmp("--png-level", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      size_t level = parse_size(exec_name, argv[i], argv[i + 1]);
+      if (level > 9) {
+        fail_invalid_argument(exec_name, argv[i], argv[i + 1]);
+      }
+
+      image_dir.png.level = level;
+      i++;
+    } else if (strcmp("--png-filter", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      image_dir.png.filter = parse_png_filter(exec_name, argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--png-threads", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      size_t threads = parse_size(exec_name, argv[i], argv[i + 1]);
+      if (threads < 1 || threads > 256) {
+        fail_invalid_argument(exec_name, argv[i], argv[i + 1]);
+      }
+
+      image_dir.png.threads = threads;
+      i++;
+    } else if (strcmp("--stats", argv[i]) == 0) {
+      pipeline_options.stats = true;
+    } else if (strcmp("--stats-json", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      pipeline_options.stats_json = argv[i + 1];
+      i++;
+    } else if (strcmp("--trace", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      trace = argv[i + 1];
+      i++;
+    } else if (strcmp("--input-format", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      input_format = parse_image_format(exec_name, argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--output-format", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      output_format = parse_image_format(exec_name, argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--input", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      input_path = argv[i + 1];
+      i++;
+    } else if (strcmp("--output", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      output_path = argv[i + 1];
+      i++;
+    } else if (strcmp("--input-size", argv[i]) == 0) {
+      if (i + 1 > argc - 1) {
+        fail_missing_argument(exec_name, argv[i]);
+      }
+
+      parse_frame_size(exec_name, argv[i], argv[i + 1], &input_width,
+                       &input_height);
+      i++;
     } else if (strcmp("--quiet", argv[i]) == 0) {
       quiet = true;
     } else if (strcmp("--help", argv[i]) == 0) {
@@ -125,6 +588,61 @@ int main(int argc, char *argv[]) {
     use_pipeline_serial = true;
   }
 
+  if (filter_graph_parse(&pipeline_options.filters, filters) < 0) {
+    fprintf(stderr, "Known filters: %s\n", filter_graph_names());
+    fail_invalid_argument(exec_name, "--filters", filters);
+  }
+  filter_graph_set_planar(&pipeline_options.filters, planar);
+
+  if (!output_dir_name) {
+    output_dir_name = input_dir_name;
+  }
+
+  if (input_format == IMAGE_FORMAT_PNG && input_dir_name == NULL) {
+    fprintf(stderr, "%s: png input needs --directory\n", exec_name);
+    exit(1);
+  }
+  if (output_format == IMAGE_FORMAT_PNG && output_dir_name == NULL) {
+    fprintf(stderr, "%s: png output needs --out or --directory\n", exec_name);
+    exit(1);
+  }
+  if (input_format != IMAGE_FORMAT_PNG && frame_cache != NULL) {
+    fprintf(stderr, "%s: --frame-cache needs png input\n", exec_name);
+    exit(1);
+  }
+  if (input_format == IMAGE_FORMAT_RGBA_RAW && input_width == 0) {
+    fprintf(stderr, "%s: rgba-raw input needs --input-size\n", exec_name);
+    exit(1);
+  }
+
+  if (input_format != IMAGE_FORMAT_PNG) {
+    int fd = open_stream(input_path, false);
+    image_dir.input_stream =
+        (fd < 0) ? NULL
+                 : image_stream_create_reader(fd, input_format, input_width,
+                                              input_height);
+    if (image_dir.input_stream == NULL) {
+      exit(1);
+    }
+  }
+  if (output_format != IMAGE_FORMAT_PNG) {
+    int fd = open_stream(output_path, true);
+    image_dir.output_stream =
+        (fd < 0) ? NULL
+                 : image_stream_create_writer(fd, output_format,
+                                              image_dir.input_stream);
+    if (image_dir.output_stream == NULL) {
+      exit(1);
+    }
+  }
+
+  if (frame_cache != NULL) {
+    image_dir.cache = image_cache_open(frame_cache);
+    if (image_dir.cache == NULL) {
+      exit(1);
+    }
+  }
+
   if (signal(SIGINT, sigint_handler) == SIG_ERR) {
     LOG_ERROR_ERRNO("signal");
     exit(1);
@@ -135,26 +653,68 @@ int main(int argc, char *argv[]) {
     fclose(stderr);
   }
 
-  if (!output_dir_name) {
-    output_dir_name = input_dir_name;
-  }
-
   printf("Starting image pipeline, press CTRL+C to stop loading images\n");
 
+  bool metrics = pipeline_options.stats || pipeline_options.stats_json;
+  if (metrics) {
+    metrics_begin();
+  }
+  if (trace != NULL) {
+    trace_set_thread_name("main", -1);
+    trace_begin();
+  }
+
   int ret;
   if (use_pipeline_serial) {
     image_dir_reset(&image_dir, input_dir_name, output_dir_name, "serial");
-    pipeline_serial(&image_dir);
+    ret = pipeline_serial(&image_dir);
   } else if (use_pipeline_pthread) {
     image_dir_reset(&image_dir, input_dir_name, output_dir_name, "pthread");
-    pipeline_pthread(&image_dir);
+    ret = pipeline_pthread(&image_dir);
   } else if (use_pipeline_tbb) {
     image_dir_reset(&image_dir, input_dir_name, output_dir_name, "tbb");
-    pipeline_tbb(&image_dir);
+    ret = pipeline_tbb(&image_dir);
+  } else if (use_pipeline_tbb_flow) {
+    image_dir_reset(&image_dir, input_dir_name, output_dir_name, "tbb-flow");
+    ret = pipeline_tbb_flow(&image_dir);
+  } else if (use_pipeline_coro) {
+    image_dir_reset(&image_dir, input_dir_name, output_dir_name, "coro");
+    ret = pipeline_coro(&image_dir);
   } else {
     LOG_ERROR("no pipeline configured");
     exit(1);
   }
 
+  /* frames held back behind one that failed are written now */
+  if (image_dir.output_stream != NULL &&
+      image_stream_destroy(image_dir.output_stream) < 0) {
+    ret = -1;
+  }
+  if (image_dir.input_stream != NULL &&
+      image_stream_destroy(image_dir.input_stream) < 0) {
+    ret = -1;
+  }
+  if (image_dir.cache != NULL) {
+    image_cache_close(image_dir.cache);
+  }
+
+  if (trace != NULL) {
+    trace_end();
+    if (trace_write(trace) < 0) {
+      ret = -1;
+    }
+  }
+
+  if (metrics) {
+    metrics_end();
+    if (pipeline_options.stats) {
+      metrics_print(stdout);
+    }
+    if (pipeline_options.stats_json != NULL &&
+        metrics_write_json(pipeline_options.stats_json) < 0) {
+      ret = -1;
+    }
+  }
+
   return (ret < 0) ? 1 : 0;
 }
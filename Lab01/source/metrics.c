@@ -0,0 +1,336 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "metrics.h"
+
+#define MIB (1024.0 * 1024.0)
+
+typedef struct metrics_thread {
+  struct metrics_thread *next;
+  metrics_histogram_t series[METRICS_SERIES_COUNT];
+} metrics_thread_t;
+
+typedef struct metrics_stall {
+  const char *name;
+  uint64_t ns;
+  size_t count;
+} metrics_stall_t;
+
+static const char *metrics_series_names[METRICS_SERIES_COUNT] = {
+    [METRICS_LOAD] = "load",
+    [METRICS_FILTER] = "filter",
+    [METRICS_SAVE] = "save",
+    [METRICS_QUEUE_DEPTH] = "queue_depth",
+    [METRICS_IN_FLIGHT] = "in_flight_bytes",
+};
+
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_thread_t *metrics_threads;
+static metrics_stall_t metrics_stalls[METRICS_MAX_STALLS];
+static size_t metrics_stall_count;
+static uint64_t metrics_start_ns;
+static uint64_t metrics_end_ns;
+
+static atomic_bool metrics_recording;
+/* bumped by every begin, a thread buffer from an older run is dropped */
+static atomic_uint metrics_generation;
+
+static __thread metrics_thread_t *metrics_self;
+static __thread unsigned int metrics_self_generation;
+
+static uint64_t metrics_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void metrics_begin(void) {
+  pthread_mutex_lock(&metrics_mutex);
+  while (metrics_threads != NULL) {
+    metrics_thread_t *next = metrics_threads->next;
+    free(metrics_threads);
+    metrics_threads = next;
+  }
+  metrics_stall_count = 0;
+  atomic_fetch_add(&metrics_generation, 1);
+  metrics_start_ns = metrics_clock();
+  metrics_end_ns = metrics_start_ns;
+  pthread_mutex_unlock(&metrics_mutex);
+
+  atomic_store(&metrics_recording, true);
+}
+
+void metrics_end(void) {
+  atomic_store(&metrics_recording, false);
+
+  pthread_mutex_lock(&metrics_mutex);
+  metrics_end_ns = metrics_clock();
+  pthread_mutex_unlock(&metrics_mutex);
+}
+
+uint64_t metrics_now(void) {
+  if (!atomic_load_explicit(&metrics_recording, memory_order_relaxed)) {
+    return 0;
+  }
+  return metrics_clock();
+}
+
+static metrics_thread_t *metrics_thread(void) {
+  unsigned int generation =
+      atomic_load_explicit(&metrics_generation, memory_order_relaxed);
+  if (metrics_self != NULL && metrics_self_generation == generation) {
+    return metrics_self;
+  }
+
+  metrics_thread_t *self = calloc(1, sizeof(*self));
+  if (self == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&metrics_mutex);
+  self->next = metrics_threads;
+  metrics_threads = self;
+  pthread_mutex_unlock(&metrics_mutex);
+
+  metrics_self = self;
+  metrics_self_generation = generation;
+  return self;
+}
+
+/* values below METRICS_SUB_BUCKETS get a bucket each, then every power of
+ * two [2^e, 2^(e+1)) is cut into METRICS_SUB_BUCKETS equal buckets */
+static size_t metrics_bucket(uint64_t value) {
+  if (value < METRICS_SUB_BUCKETS) {
+    return value;
+  }
+
+  int exponent = 63 - __builtin_clzll(value);
+  size_t sub = (value >> (exponent - 4)) & (METRICS_SUB_BUCKETS - 1);
+  return (exponent - 3) * METRICS_SUB_BUCKETS + sub;
+}
+
+static uint64_t metrics_bucket_high(size_t bucket) {
+  if (bucket < METRICS_SUB_BUCKETS) {
+    return bucket;
+  }
+
+  int exponent = bucket / METRICS_SUB_BUCKETS + 3;
+  uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+  uint64_t width = 1ull << (exponent - 4);
+  return (METRICS_SUB_BUCKETS + sub) * width + width - 1;
+}
+
+void metrics_record(metrics_series_t series, uint64_t value) {
+  if (!atomic_load_explicit(&metrics_recording, memory_order_relaxed)) {
+    return;
+  }
+
+  metrics_thread_t *self = metrics_thread();
+  if (self == NULL) {
+    return;
+  }
+
+  metrics_histogram_t *histogram = &self->series[series];
+  histogram->count++;
+  histogram->sum += value;
+  if (value > histogram->max) {
+    histogram->max = value;
+  }
+  histogram->buckets[metrics_bucket(value)]++;
+}
+
+void metrics_record_since(metrics_series_t series, uint64_t start) {
+  /* start is 0 when recording was off at the beginning of the stage */
+  if (start == 0) {
+    return;
+  }
+  metrics_record(series, metrics_now() - start);
+}
+
+void metrics_add_stall(const char *name, uint64_t ns, size_t count) {
+  pthread_mutex_lock(&metrics_mutex);
+  size_t i = 0;
+  while (i < metrics_stall_count && strcmp(metrics_stalls[i].name, name)) {
+    i++;
+  }
+
+  if (i < METRICS_MAX_STALLS) {
+    if (i == metrics_stall_count) {
+      metrics_stalls[i].name = name;
+      metrics_stalls[i].ns = 0;
+      metrics_stalls[i].count = 0;
+      metrics_stall_count++;
+    }
+    metrics_stalls[i].ns += ns;
+    metrics_stalls[i].count += count;
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+}
+
+static uint64_t metrics_percentile(const metrics_histogram_t *histogram,
+                                   double percentile) {
+  uint64_t rank = (uint64_t)(histogram->count * percentile / 100.0 + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+    seen += histogram->buckets[b];
+    if (seen >= rank) {
+      uint64_t high = metrics_bucket_high(b);
+      return (high < histogram->max) ? high : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+void metrics_get_summary(metrics_series_t series, metrics_summary_t *summary) {
+  metrics_histogram_t *merged = calloc(1, sizeof(*merged));
+  memset(summary, 0, sizeof(*summary));
+  if (merged == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    return;
+  }
+
+  pthread_mutex_lock(&metrics_mutex);
+  for (metrics_thread_t *t = metrics_threads; t != NULL; t = t->next) {
+    const metrics_histogram_t *histogram = &t->series[series];
+    merged->count += histogram->count;
+    merged->sum += histogram->sum;
+    if (histogram->max > merged->max) {
+      merged->max = histogram->max;
+    }
+    for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+      merged->buckets[b] += histogram->buckets[b];
+    }
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+
+  if (merged->count > 0) {
+    summary->count = merged->count;
+    summary->mean = (double)merged->sum / merged->count;
+    summary->p50 = metrics_percentile(merged, 50);
+    summary->p99 = metrics_percentile(merged, 99);
+    summary->max = merged->max;
+  }
+  free(merged);
+}
+
+static double metrics_elapsed_s(void) {
+  pthread_mutex_lock(&metrics_mutex);
+  double elapsed = (metrics_end_ns - metrics_start_ns) / 1e9;
+  pthread_mutex_unlock(&metrics_mutex);
+  return elapsed;
+}
+
+/* frames are counted when they are saved */
+static uint64_t metrics_frames(void) {
+  metrics_summary_t save;
+  metrics_get_summary(METRICS_SAVE, &save);
+  return save.count;
+}
+
+void metrics_print(FILE *file) {
+  fprintf(file, "stage        count   mean ms    p50 ms    p99 ms    max ms\n");
+  for (int s = METRICS_LOAD; s <= METRICS_SAVE; s++) {
+    metrics_summary_t summary;
+    metrics_get_summary(s, &summary);
+    fprintf(file, "%-10s %7llu %9.2f %9.2f %9.2f %9.2f\n",
+            metrics_series_names[s], (unsigned long long)summary.count,
+            summary.mean / 1e6, summary.p50 / 1e6, summary.p99 / 1e6,
+            summary.max / 1e6);
+  }
+
+  double elapsed = metrics_elapsed_s();
+  uint64_t frames = metrics_frames();
+  fprintf(file, "frames: %llu in %.2f s, %.1f frames/s\n",
+          (unsigned long long)frames, elapsed,
+          (elapsed > 0) ? frames / elapsed : 0.0);
+
+  metrics_summary_t depth;
+  metrics_get_summary(METRICS_QUEUE_DEPTH, &depth);
+  if (depth.count > 0) {
+    fprintf(file,
+            "injection queue depth: mean %.1f, p50 %llu, p99 %llu, max %llu\n",
+            depth.mean, (unsigned long long)depth.p50,
+            (unsigned long long)depth.p99, (unsigned long long)depth.max);
+  }
+
+  metrics_summary_t in_flight;
+  metrics_get_summary(METRICS_IN_FLIGHT, &in_flight);
+  if (in_flight.count > 0) {
+    fprintf(file,
+            "in flight: mean %.1f MiB, p50 %.1f MiB, p99 %.1f MiB, "
+            "max %.1f MiB\n",
+            in_flight.mean / MIB, in_flight.p50 / MIB, in_flight.p99 / MIB,
+            in_flight.max / MIB);
+  }
+
+  pthread_mutex_lock(&metrics_mutex);
+  for (size_t i = 0; i < metrics_stall_count; i++) {
+    fprintf(file, "stall %s: %.2f ms over %zu waits\n", metrics_stalls[i].name,
+            metrics_stalls[i].ns / 1e6, metrics_stalls[i].count);
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+}
+
+static void metrics_write_json_summary(FILE *file, metrics_series_t series,
+                                       double scale) {
+  metrics_summary_t summary;
+  metrics_get_summary(series, &summary);
+  fprintf(file,
+          "{\"count\": %llu, \"mean\": %.6g, \"p50\": %.6g, \"p99\": %.6g, "
+          "\"max\": %.6g}",
+          (unsigned long long)summary.count, summary.mean / scale,
+          summary.p50 / scale, summary.p99 / scale, summary.max / scale);
+}
+
+int metrics_write_json(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    LOG_ERROR_ERRNO("fopen");
+    return -1;
+  }
+
+  double elapsed = metrics_elapsed_s();
+  uint64_t frames = metrics_frames();
+
+  fprintf(file, "{\n  \"elapsed_s\": %.6f,\n  \"frames\": %llu,\n", elapsed,
+          (unsigned long long)frames);
+  fprintf(file, "  \"frames_per_s\": %.3f,\n",
+          (elapsed > 0) ? frames / elapsed : 0.0);
+
+  /* latencies in milliseconds, depths in frames, in flight in bytes */
+  fprintf(file, "  \"stages_ms\": {\n");
+  for (int s = METRICS_LOAD; s <= METRICS_SAVE; s++) {
+    fprintf(file, "    \"%s\": ", metrics_series_names[s]);
+    metrics_write_json_summary(file, s, 1e6);
+    fprintf(file, (s < METRICS_SAVE) ? ",\n" : "\n");
+  }
+  fprintf(file, "  },\n  \"%s\": ", metrics_series_names[METRICS_QUEUE_DEPTH]);
+  metrics_write_json_summary(file, METRICS_QUEUE_DEPTH, 1);
+  fprintf(file, ",\n  \"%s\": ", metrics_series_names[METRICS_IN_FLIGHT]);
+  metrics_write_json_summary(file, METRICS_IN_FLIGHT, 1);
+
+  fprintf(file, ",\n  \"stalls_ms\": {");
+  pthread_mutex_lock(&metrics_mutex);
+  for (size_t i = 0; i < metrics_stall_count; i++) {
+    fprintf(file, "%s\n    \"%s\": {\"total\": %.6g, \"waits\": %zu}",
+            (i > 0) ? "," : "", metrics_stalls[i].name,
+            metrics_stalls[i].ns / 1e6, metrics_stalls[i].count);
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+  fprintf(file, "%s}\n}\n", (metrics_stall_count > 0) ? "\n  " : "");
+
+  if (fclose(file) != 0) {
+    LOG_ERROR_ERRNO("fclose");
+    return -1;
+  }
+  return 0;
+}
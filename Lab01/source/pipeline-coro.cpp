@@ -0,0 +1,456 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "budget.h"
+#include "filter-graph.h"
+#include "log.h"
+#include "pipeline.h"
+}
+
+/* Every frame is a coroutine that hops between two thread pools: the I/O
+ * threads (--loaders) read and decode it, the workers (--workers) filter
+ * and save it. A frame waiting for a thread of the next pool, or for its
+ * turn in the --ordered window, is suspended instead of holding a thread,
+ * so how many frames are in flight doesn't depend on how many threads
+ * there are. */
+
+/* frames in flight, as many as the pthread injection queue holds; their
+ * bytes are bounded by --max-memory */
+#define CORO_FRAMES 100
+
+/* a coroutine nobody waits on: it starts suspended, runs once posted to a
+ * pool and frees itself when it returns */
+struct CoroTask {
+  struct promise_type {
+    CoroTask get_return_object() noexcept {
+      return CoroTask{
+          std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    /* the handle is then NULL */
+    static CoroTask get_return_object_on_allocation_failure() noexcept {
+      return CoroTask{};
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+/* threads resuming the coroutines posted to them, oldest first */
+class CoroPool {
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<std::coroutine_handle<>> handles;
+  std::vector<std::thread> threads;
+  bool stopping;
+
+  void run(const char *name, int id) {
+    trace_set_thread_name(name, id);
+
+    while (true) {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready.wait(lock, [this] { return !handles.empty() || stopping; });
+      if (handles.empty()) {
+        return;
+      }
+
+      std::coroutine_handle<> handle = handles.front();
+      handles.pop_front();
+      lock.unlock();
+      handle.resume();
+    }
+  }
+
+public:
+  CoroPool(const char *name, size_t count) : stopping(false) {
+    for (size_t i = 0; i < count; i++) {
+      threads.emplace_back(&CoroPool::run, this, name, (int)i);
+    }
+  }
+
+  /* the threads finish what was posted before they exit */
+  ~CoroPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    ready.notify_all();
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+  }
+
+  /* notified with the mutex held: the coroutine may run to its end on
+   * another thread and let the pool be destroyed before this returns */
+  void post(std::coroutine_handle<> handle) {
+    std::lock_guard<std::mutex> lock(mutex);
+    handles.push_back(handle);
+    ready.notify_one();
+  }
+
+  size_t size() const { return threads.size(); }
+};
+
+/* resumes the coroutine on a thread of `pool` */
+struct CoroHop {
+  CoroPool *pool;
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> handle) const {
+    pool->post(handle);
+  }
+  void await_resume() const noexcept {}
+};
+
+/* the bands of a frame, shared with the helpers that may only start once
+ * the frame is done with them */
+struct CoroBands {
+  filter_band_fn_t fn;
+  void *arg;
+  size_t count;
+  std::atomic<size_t> next;
+  std::atomic<size_t> done;
+  std::mutex mutex;
+  std::condition_variable finished; /* the last band is done */
+
+  void run() {
+    size_t band;
+    while ((band = next++) < count) {
+      fn(arg, band);
+      if (++done == count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.notify_all();
+      }
+    }
+  }
+};
+
+static CoroTask coro_band_helper(std::shared_ptr<CoroBands> bands) {
+  bands->run();
+  co_return;
+}
+
+/* filter_splitter_t callback: idle workers help with the bands, the worker
+ * of the frame runs what is left and only sleeps on the bands that already
+ * run elsewhere, never on a helper still queued behind other frames */
+static void coro_split(void *ctx, size_t count, filter_band_fn_t fn,
+                       void *arg) {
+  CoroPool *workers = (CoroPool *)ctx;
+  std::shared_ptr<CoroBands> bands = std::make_shared<CoroBands>();
+  bands->fn = fn;
+  bands->arg = arg;
+  bands->count = count;
+  bands->next = 0;
+  bands->done = 0;
+
+  size_t helpers = std::min(count, workers->size()) - 1;
+  for (size_t i = 0; i < helpers; i++) {
+    CoroTask helper = coro_band_helper(bands);
+    if (helper.handle) {
+      workers->post(helper.handle);
+    }
+  }
+
+  bands->run();
+  std::unique_lock<std::mutex> lock(bands->mutex);
+  bands->finished.wait(lock, [&bands, count] { return bands->done == count; });
+}
+
+struct CoroState {
+  image_dir_t *image_dir;
+  reorder_t *reorder; /* NULL unless --ordered */
+  autotune_t *tune;   /* NULL once calibrated */
+  budget_t *budget;
+  CoroPool *io;
+  CoroPool *workers;
+
+  std::mutex mutex;
+  std::condition_variable finished; /* a frame is done, or the input */
+  size_t in_flight; /* started, some only find out the input is over */
+  size_t frames;    /* decoded and not saved yet */
+  size_t peak;      /* of `frames` */
+  bool done;        /* the input is exhausted */
+
+  /* --ordered: every id below `floor` was saved or skipped. A frame only
+   * saves once its id fits in the reorder window, so that no worker ever
+   * waits in reorder_push; the others are suspended in `waiting`. */
+  size_t window;
+  size_t floor;
+  std::vector<bool> saved; /* ids above `floor`, modulo the window */
+  std::vector<std::pair<size_t, std::coroutine_handle<>>> waiting;
+
+  CoroState(image_dir_t *image_dir, autotune_t *tune, size_t window)
+      : image_dir(image_dir), reorder(NULL), tune(tune), budget(NULL),
+        io(NULL), workers(NULL), in_flight(0), frames(0), peak(0),
+        done(false),
+        window(window), floor(image_dir->load_current), saved(window) {}
+};
+
+/* resumes the frame `id` right away if it fits in the reorder window, on a
+ * worker once it does otherwise */
+struct CoroWindow {
+  CoroState *state;
+  size_t id;
+
+  bool await_ready() const noexcept { return state->reorder == NULL; }
+  bool await_suspend(std::coroutine_handle<> handle) const {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (id < state->floor + state->window) {
+      return false;
+    }
+
+    state->waiting.emplace_back(id, handle);
+    return true;
+  }
+  void await_resume() const noexcept {}
+};
+
+/* `id` was saved or skipped, the frames it held back go on */
+static void coro_window_pass(CoroState *state, size_t id) {
+  if (state->reorder == NULL) {
+    return;
+  }
+
+  std::vector<std::coroutine_handle<>> admitted;
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->saved[id % state->window] = true;
+    while (state->saved[state->floor % state->window]) {
+      state->saved[state->floor % state->window] = false;
+      state->floor++;
+    }
+
+    auto it = state->waiting.begin();
+    while (it != state->waiting.end()) {
+      if (it->first < state->floor + state->window) {
+        admitted.push_back(it->second);
+        it = state->waiting.erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+
+  for (std::coroutine_handle<> handle : admitted) {
+    state->workers->post(handle);
+  }
+}
+
+static void coro_frame_begin(CoroState *state) {
+  std::lock_guard<std::mutex> lock(state->mutex);
+  state->frames++;
+  state->peak = std::max(state->peak, state->frames);
+}
+
+static size_t coro_backlog(CoroState *state) {
+  std::lock_guard<std::mutex> lock(state->mutex);
+  return state->frames - 1;
+}
+
+/* notified with the mutex held: once in_flight drops to 0, the driver may
+ * return and destroy the state */
+static void coro_frame_end(CoroState *state, bool decoded, bool last) {
+  std::lock_guard<std::mutex> lock(state->mutex);
+  state->in_flight--;
+  if (decoded) {
+    state->frames--;
+  }
+  if (last) {
+    state->done = true;
+  }
+  state->finished.notify_all();
+}
+
+/* a frame from its load to its save, posted to the I/O threads with
+ * `charged` bytes of the budget */
+static CoroTask coro_frame(CoroState *state, size_t charged) {
+  pipeline_mark_t mark;
+  pipeline_stage_begin(state->tune, &mark);
+  image_t *image;
+  size_t id;
+  if (image_dir_load_any(state->image_dir, &image, &id) < 0) {
+    /* the id won't come, the later frames go on without it */
+    budget_cancel(state->budget, charged);
+    co_await CoroWindow{state, id};
+    pipeline_save_skip(state->image_dir, state->reorder, id);
+    coro_window_pass(state, id);
+    coro_frame_end(state, false, false);
+    co_return;
+  }
+  if (image == NULL) {
+    budget_cancel(state->budget, charged);
+    coro_frame_end(state, false, true);
+    co_return;
+  }
+  pipeline_stage_end(state->tune, AUTOTUNE_LOAD, &mark);
+  coro_frame_begin(state);
+
+  id = image->id;
+  size_t bytes = filter_graph_footprint(&pipeline_options.filters,
+                                        image->width, image->height);
+  budget_settle(state->budget, charged, bytes);
+
+  co_await CoroHop{state->workers};
+
+  /* point-wise and geometric filters are fused, large frames are also cut
+   * into bands when too few other frames are in flight */
+  filter_splitter_t splitter = {
+      coro_split, state->workers,
+      pipeline_split_threads(image, state->workers->size(),
+                             coro_backlog(state)),
+      pipeline_options.tile_rows};
+  pipeline_stage_begin(state->tune, &mark);
+  image_t *filtered =
+      filter_graph_apply(&pipeline_options.filters, image, &splitter);
+  pipeline_stage_end(state->tune, AUTOTUNE_FILTER, &mark);
+  image_destroy(image);
+
+  co_await CoroWindow{state, id};
+
+  if (filtered != NULL) {
+    pipeline_stage_begin(state->tune, &mark);
+    pipeline_save(state->image_dir, state->reorder, filtered);
+    pipeline_stage_end(state->tune, AUTOTUNE_SAVE, &mark);
+    image_destroy(filtered);
+    printf(".");
+    fflush(stdout);
+  } else {
+    fprintf(stderr, "Error filtering image %zu\n", id);
+    pipeline_save_skip(state->image_dir, state->reorder, id);
+  }
+  coro_window_pass(state, id);
+
+  budget_release(state->budget, bytes);
+  coro_frame_end(state, true, false);
+}
+
+/* starts frames while there is room for them, until the input or the
+ * calibration frames of `tune` are exhausted, then waits for the last ones */
+static void coro_launch(CoroState *state) {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(state->mutex);
+      state->finished.wait(lock, [state] {
+        return state->done || state->in_flight < CORO_FRAMES;
+      });
+      if (state->done) {
+        break;
+      }
+    }
+
+    if (state->tune != NULL && !autotune_claim(state->tune)) {
+      break;
+    }
+
+    /* charged before the frame is claimed, as the pthread loaders do */
+    size_t charged = budget_charge(state->budget);
+    CoroTask frame = coro_frame(state, charged);
+    if (!frame.handle) {
+      LOG_ERROR("cannot allocate a frame coroutine");
+      budget_cancel(state->budget, charged);
+      break;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->in_flight++;
+    }
+    state->io->post(frame.handle);
+  }
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->finished.wait(lock, [state] { return state->in_flight == 0; });
+}
+
+static void pipeline_coro_print_stats(CoroState *state,
+                                      const autotune_config_t *config) {
+  budget_stats_t stats;
+  budget_get_stats(state->budget, &stats);
+  metrics_add_stall("frames_over_budget", stats.wait_ns, stats.waits);
+
+  if (pipeline_options.stats) {
+    printf("coro: %zu frames and %.1f MiB peak in flight on %zu I/O "
+           "threads and %zu workers\n",
+           state->peak, stats.peak / (1024.0 * 1024.0), config->loaders,
+           config->workers);
+  }
+}
+
+/* runs frames until the directory, or the calibration frames of `tune`, are
+ * exhausted */
+static int pipeline_coro_run(image_dir_t *image_dir, autotune_t *tune,
+                             const autotune_config_t *config) {
+  /* frames wait for the window suspended, its size only bounds how far
+   * ahead of the oldest frame the others get saved */
+  CoroState state(image_dir, tune, CORO_FRAMES);
+  state.budget = budget_create(pipeline_options.max_memory);
+  if (state.budget == NULL) {
+    return -1;
+  }
+  state.reorder = pipeline_reorder_begin(image_dir, state.window);
+
+  {
+    CoroPool io("io", config->loaders);
+    CoroPool workers("worker", config->workers);
+    state.io = &io;
+    state.workers = &workers;
+
+    coro_launch(&state);
+  }
+
+  pipeline_reorder_end(state.reorder);
+  printf("\n");
+
+  pipeline_coro_print_stats(&state, config);
+  budget_destroy(state.budget);
+  return 0;
+}
+
+int pipeline_coro(image_dir_t *image_dir) {
+  autotune_config_t config = {
+      .loaders = pipeline_loader_count(),
+      .workers = pipeline_worker_count(),
+  };
+
+  image_pool_t *pool = pipeline_pool_begin();
+  if (image_dir_open(image_dir) < 0) {
+    pipeline_pool_end(pool);
+    return -1;
+  }
+
+  int ret = 0;
+  autotune_t *tune = pipeline_autotune_begin();
+  if (tune != NULL) {
+    ret = pipeline_coro_run(image_dir, tune, &config);
+    pipeline_autotune_end(tune, &config);
+    if (ret == 0) {
+      printf("autotune: %zu I/O threads, %zu workers (pin with --loaders %zu "
+             "--workers %zu)\n",
+             config.loaders, config.workers, config.loaders, config.workers);
+    }
+  }
+
+  if (ret == 0) {
+    ret = pipeline_coro_run(image_dir, NULL, &config);
+  }
+
+  image_dir_close(image_dir);
+  pipeline_pool_end(pool);
+  return ret;
+}
@@ -1,182 +1,517 @@
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <threads.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "filter.h"
+#include "affinity.h"
+#include "budget.h"
+#include "filter-graph.h"
+#include "log.h"
 #include "pipeline.h"
-#include "queue.h"
+#include "scheduler.h"
 
 #define QUEUE_SIZE 100
 
-struct thread_args {
-  queue_t *input_queue;
-  queue_t **output_queues;
-  int num_output_queues;
-  int thread_id;
-};
+/* every frame is a task that re-spawns itself for the next stage, frames
+ * never wait behind a slow frame in a private lane: idle workers steal.
+ * Loaders charge the bytes a frame needs through the filters to a budget
+ * before they claim it and the frame gives them back once saved, so the
+ * frames in flight stay under --max-memory however deep the queues are.
+ * With --batch, a loader hands its frames over a few at a time, with one
+ * push and one wakeup for all of them. */
 
-struct load_args {
+struct frame_task {
+  task_t task;
+  scheduler_t *scheduler;
   image_dir_t *image_dir;
-  queue_t **output_queues;
-  int num_output_queues;
-  int thread_id;
+  reorder_t *reorder; /* NULL unless --ordered */
+  autotune_t *tune;   /* NULL once calibrated */
+  budget_t *budget;
+  size_t bytes; /* charged to `budget` */
+  int node;     /* where the frame was last worked on, -1 without --numa */
+  image_t *image;
 };
 
-struct save_args {
-  queue_t *input_queue;
+struct frame_loader {
+  int id;
+  pthread_t thread;
+  bool spawned;
+  scheduler_t *scheduler;
   image_dir_t *image_dir;
-  int thread_id;
+  reorder_t *reorder;
+  autotune_t *tune;
+  budget_t *budget;
+  const affinity_t *affinity; /* NULL without --numa */
+};
+
+/* frames a loader holds back to hand them to the workers at once */
+struct frame_batch {
+  task_t *tasks[PIPELINE_BATCH_MAX];
+  size_t count;
+  uint64_t oldest_ns; /* when the first of them was loaded */
 };
 
-int calculate_optimal_threads_num(long num_cores) {
-  int optimal_threads = (num_cores * 8) / 4;
-  return (optimal_threads < 2)    ? 2
-         : (optimal_threads > 27) ? 27
-                                  : optimal_threads;
+/* with --numa, stages of a frame that ran on another node than the one
+ * before them */
+static atomic_size_t numa_handoffs;
+static atomic_size_t numa_cross_node;
+
+static void frame_handoff(struct frame_task *frame) {
+  if (frame->node < 0) {
+    return;
+  }
+
+  int node = affinity_current_node();
+  atomic_fetch_add_explicit(&numa_handoffs, 1, memory_order_relaxed);
+  if (node != frame->node) {
+    atomic_fetch_add_explicit(&numa_cross_node, 1, memory_order_relaxed);
+    frame->node = node;
+  }
 }
 
-void *image_load_wrapper(void *arg) {
-  struct load_args *args = (struct load_args *)arg;
-  int image_count = 0;
-  while (1) {
-    image_t *image = image_dir_load_next(args->image_dir);
-    if (image == NULL) {
-      for (int i = 0; i < args->num_output_queues; i++) {
-        queue_push(args->output_queues[i], NULL);
-      }
-      break;
-    }
-    queue_push(args->output_queues[image_count % args->num_output_queues],
-               image);
-    image_count++;
+static void frame_finish(struct frame_task *frame) {
+  budget_release(frame->budget, frame->bytes);
+  image_destroy(frame->image);
+  free(frame);
+}
+
+static void frame_next_stage(struct frame_task *frame, task_fn_t fn) {
+  frame->task.fn = fn;
+  if (scheduler_spawn(frame->scheduler, &frame->task) < 0) {
+    pipeline_save_skip(frame->image_dir, frame->reorder, frame->image->id);
+    frame_finish(frame);
   }
-  return NULL;
 }
 
-void *filter_scale_up_wrapper(void *arg) {
-  struct thread_args *args = (struct thread_args *)arg;
+static void frame_save(task_t *task) {
+  struct frame_task *frame = (struct frame_task *)task;
+  pipeline_mark_t mark;
+
+  frame_handoff(frame);
+  pipeline_stage_begin(frame->tune, &mark);
+  pipeline_save(frame->image_dir, frame->reorder, frame->image);
+  pipeline_stage_end(frame->tune, AUTOTUNE_SAVE, &mark);
+  printf(".");
+  fflush(stdout);
+
+  frame_finish(frame);
+}
+
+static void frame_split(void *ctx, size_t bands, filter_band_fn_t fn,
+                        void *arg) {
+  scheduler_parallel_for(ctx, bands, fn, arg);
+}
+
+/* point-wise and geometric filters are fused, large frames are also cut
+ * into bands that idle workers steal when too few other frames are pending
+ * to keep them busy */
+static void frame_filter(task_t *task) {
+  struct frame_task *frame = (struct frame_task *)task;
+  pipeline_mark_t mark;
+  size_t backlog = atomic_load(&frame->scheduler->pending) - 1;
+  filter_splitter_t splitter = {
+      .run = frame_split,
+      .ctx = frame->scheduler,
+      .threads = pipeline_split_threads(
+          frame->image, frame->scheduler->num_workers, backlog),
+      .tile_rows = pipeline_options.tile_rows,
+  };
+
+  frame_handoff(frame);
+  pipeline_stage_begin(frame->tune, &mark);
+  image_t *filtered_image = filter_graph_apply(&pipeline_options.filters,
+                                               frame->image, &splitter);
+  pipeline_stage_end(frame->tune, AUTOTUNE_FILTER, &mark);
+  if (filtered_image == NULL) {
+    pipeline_save_skip(frame->image_dir, frame->reorder, frame->image->id);
+    frame_finish(frame);
+    return;
+  }
+  image_destroy(frame->image);
+
+  frame->image = filtered_image;
+  frame_next_stage(frame, frame_save);
+}
+
+static uint64_t frame_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* hands the held frames to the workers, the ones that can't be spawned are
+ * skipped */
+static int frame_flush(struct frame_loader *loader, struct frame_batch *batch) {
+  if (batch->count == 0) {
+    return 0;
+  }
+
+  size_t spawned =
+      scheduler_spawn_batch(loader->scheduler, batch->tasks, batch->count);
+  for (size_t i = spawned; i < batch->count; i++) {
+    struct frame_task *frame = (struct frame_task *)batch->tasks[i];
+    pipeline_save_skip(frame->image_dir, frame->reorder, frame->image->id);
+    frame_finish(frame);
+  }
+
+  bool failed = spawned < batch->count;
+  batch->count = 0;
+  metrics_record(METRICS_QUEUE_DEPTH,
+                 scheduler_injection_depth(loader->scheduler));
+  return failed ? -1 : 0;
+}
+
+/* with --ordered or stream output, holds the loader back until `id` fits in
+ * the reorder window, so that no worker ever waits in reorder_push while an
+ * earlier frame still needs one. That frame may be held in the batch, which
+ * goes first; -1 if it couldn't be spawned. */
+static int frame_wait_window(struct frame_loader *loader,
+                             struct frame_batch *batch, size_t id) {
+  if (loader->reorder == NULL || reorder_fits(loader->reorder, id)) {
+    return 0;
+  }
+
+  int ret = frame_flush(loader, batch);
+  reorder_wait(loader->reorder, id);
+  return ret;
+}
+
+/* loaders decode concurrently, the budget and the bounded injection queue
+ * block them whenever the workers fall behind; with --numa they are pinned
+ * to the nodes in turn and feed the workers of theirs */
+static void *frame_load(void *arg) {
+  struct frame_loader *loader = arg;
+  trace_set_thread_name("loader", loader->id);
+
+  if (loader->affinity != NULL) {
+    affinity_pin(loader->affinity,
+                 loader->id % affinity_node_count(loader->affinity));
+  }
+
+  struct frame_batch batch = {.count = 0};
   while (1) {
-    image_t *image = queue_pop(args->input_queue);
+    if (loader->tune != NULL && !autotune_claim(loader->tune)) {
+      break;
+    }
+
+    /* charged before the frame is claimed: a frame waiting on the reorder
+     * window never holds back bytes an earlier frame needs to be loaded.
+     * The held frames go first, the workers can't give their bytes back. */
+    size_t charged;
+    if (!budget_try_charge(loader->budget, &charged)) {
+      if (frame_flush(loader, &batch) < 0) {
+        break;
+      }
+      charged = budget_charge(loader->budget);
+    }
+
+    pipeline_mark_t mark;
+    pipeline_stage_begin(loader->tune, &mark);
+    uint64_t load_start = frame_now_ns();
+    image_t *image;
+    size_t id;
+    if (image_dir_load_any(loader->image_dir, &image, &id) < 0) {
+      /* the id won't come, the later frames go on without it */
+      budget_cancel(loader->budget, charged);
+      int ret = frame_wait_window(loader, &batch, id);
+      pipeline_save_skip(loader->image_dir, loader->reorder, id);
+      if (ret < 0) {
+        break;
+      }
+      continue;
+    }
     if (image == NULL) {
-      queue_push(args->output_queues[args->thread_id], NULL);
+      budget_cancel(loader->budget, charged);
+      break;
+    }
+    pipeline_stage_end(loader->tune, AUTOTUNE_LOAD, &mark);
+    uint64_t loaded = frame_now_ns();
+
+    size_t bytes = filter_graph_footprint(&pipeline_options.filters,
+                                          image->width, image->height);
+    budget_settle(loader->budget, charged, bytes);
+
+    if (frame_wait_window(loader, &batch, image->id) < 0) {
+      pipeline_save_skip(loader->image_dir, loader->reorder, image->id);
+      budget_release(loader->budget, bytes);
+      image_destroy(image);
+      break;
+    }
+
+    struct frame_task *frame = malloc(sizeof(*frame));
+    if (frame == NULL) {
+      LOG_ERROR_ERRNO("malloc");
+      pipeline_save_skip(loader->image_dir, loader->reorder, image->id);
+      budget_release(loader->budget, bytes);
+      image_destroy(image);
       break;
     }
-    image_t *scaled_image = filter_scale_up(image, 3);
-    image_destroy(image);
-    queue_push(args->output_queues[args->thread_id], scaled_image);
+
+    frame->task.fn = frame_filter;
+    frame->scheduler = loader->scheduler;
+    frame->image_dir = loader->image_dir;
+    frame->reorder = loader->reorder;
+    frame->tune = loader->tune;
+    frame->budget = loader->budget;
+    frame->bytes = bytes;
+    frame->node = affinity_current_node();
+    frame->image = image;
+
+    if (batch.count == 0) {
+      batch.oldest_ns = loaded;
+    }
+    batch.tasks[batch.count++] = &frame->task;
+
+    /* flushed when full, or when waiting for one more frame would keep the
+     * oldest held past --batch-latency */
+    if (batch.count == pipeline_options.batch ||
+        loaded - batch.oldest_ns + (loaded - load_start) >
+            pipeline_options.batch_latency_ns) {
+      if (frame_flush(loader, &batch) < 0) {
+        break;
+      }
+    }
+  }
+  frame_flush(loader, &batch);
+
+  /* the first loader runs on the calling thread and gives it back, the
+   * others exit */
+  if (loader->affinity != NULL && loader->id == 0) {
+    affinity_unpin(loader->affinity);
   }
   return NULL;
 }
 
-void *filter_add_pixel_wrapper(void *arg) {
-  pixel_t pixel = {.bytes = {0, 0, 0, 0}};
-  struct thread_args *args = (struct thread_args *)arg;
-  while (1) {
-    image_t *image = queue_pop(args->input_queue);
-    if (image == NULL) {
-      queue_push(args->output_queues[args->thread_id], NULL);
+/* loaders blocked on a full injection queue or on the budget, workers
+ * asleep without tasks */
+static void pipeline_pthread_stalls(scheduler_t *scheduler, budget_t *budget) {
+  queue_stats_t queue;
+  scheduler_get_injection_stats(scheduler, &queue);
+  metrics_add_stall("loaders_blocked", queue.push_wait_ns, queue.push_waits);
+
+  budget_stats_t stats;
+  budget_get_stats(budget, &stats);
+  metrics_add_stall("loaders_over_budget", stats.wait_ns, stats.waits);
+
+  uint64_t idle_ns = 0;
+  size_t idle = 0;
+  for (int i = 0; i < scheduler->num_workers; i++) {
+    idle_ns += scheduler->workers[i].idle_ns;
+    idle += scheduler->workers[i].idle;
+  }
+  metrics_add_stall("workers_idle", idle_ns, idle);
+}
+
+static void pipeline_pthread_print_budget(budget_t *budget) {
+  if (!pipeline_options.stats) {
+    return;
+  }
+
+  budget_stats_t stats;
+  budget_get_stats(budget, &stats);
+  if (stats.limit > 0) {
+    printf("pthread: %.1f MiB peak in flight (%.1f MiB budget)\n",
+           stats.peak / (1024.0 * 1024.0), stats.limit / (1024.0 * 1024.0));
+  } else {
+    printf("pthread: %.1f MiB peak in flight\n",
+           stats.peak / (1024.0 * 1024.0));
+  }
+}
+
+static void pipeline_pthread_print_numa(const affinity_t *affinity) {
+  if (!pipeline_options.stats || affinity == NULL) {
+    return;
+  }
+
+  size_t handoffs = atomic_load(&numa_handoffs);
+  size_t cross_node = atomic_load(&numa_cross_node);
+  printf("numa: %zu of %zu stage handoffs crossed nodes (%.1f%%)\n",
+         cross_node, handoffs,
+         (handoffs > 0) ? 100.0 * cross_node / handoffs : 0.0);
+}
+
+/* runs frames until the directory, or the calibration frames of `tune`, are
+ * exhausted */
+static int pipeline_pthread_run(image_dir_t *image_dir, autotune_t *tune,
+                                const autotune_config_t *config,
+                                const affinity_t *affinity) {
+  atomic_store(&numa_handoffs, 0);
+  atomic_store(&numa_cross_node, 0);
+
+  scheduler_t *scheduler =
+      scheduler_create(config->workers, QUEUE_SIZE, affinity,
+                       pipeline_options.batch);
+  if (scheduler == NULL) {
+    goto fail_exit;
+  }
+
+  budget_t *budget = budget_create(pipeline_options.max_memory);
+  if (budget == NULL) {
+    goto fail_destroy_scheduler;
+  }
+
+  struct frame_loader *loaders = calloc(config->loaders, sizeof(*loaders));
+  if (loaders == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_destroy_budget;
+  }
+
+  /* how far the loaders run ahead of the oldest frame not saved yet, enough
+   * to keep the injection queues full; they wait on it themselves in
+   * frame_load, so the workers go on whatever its size */
+  size_t window = scheduler_injection_capacity(scheduler) +
+                  (config->workers + config->loaders) * pipeline_options.batch;
+  reorder_t *reorder = pipeline_reorder_begin(image_dir, window);
+
+  /* the first loader runs on this thread */
+  for (size_t i = 0; i < config->loaders; i++) {
+    loaders[i].id = i;
+    loaders[i].scheduler = scheduler;
+    loaders[i].image_dir = image_dir;
+    loaders[i].reorder = reorder;
+    loaders[i].tune = tune;
+    loaders[i].budget = budget;
+    loaders[i].affinity = affinity;
+    if (i == 0) {
+      continue;
+    }
+
+    errno = pthread_create(&loaders[i].thread, NULL, frame_load, &loaders[i]);
+    if (errno != 0) {
+      LOG_ERROR_ERRNO("pthread_create");
       break;
     }
-    pixel.bytes[0] = (unsigned char)((4 * (image->id + 1)) % 256);
-    image_t *pixel_added_image = filter_add_pixel(image, &pixel);
-    image_destroy(image);
-    queue_push(args->output_queues[args->thread_id], pixel_added_image);
+    loaders[i].spawned = true;
   }
-  return NULL;
+
+  frame_load(&loaders[0]);
+
+  for (size_t i = 1; i < config->loaders; i++) {
+    if (loaders[i].spawned) {
+      pthread_join(loaders[i].thread, NULL);
+    }
+  }
+  free(loaders);
+
+  scheduler_join(scheduler);
+  pipeline_reorder_end(reorder);
+  printf("\n");
+
+  scheduler_print_stats(scheduler, stdout);
+  pipeline_pthread_stalls(scheduler, budget);
+  pipeline_pthread_print_budget(budget);
+  pipeline_pthread_print_numa(affinity);
+  budget_destroy(budget);
+  scheduler_destroy(scheduler);
+  return 0;
+
+fail_destroy_budget:
+  budget_destroy(budget);
+fail_destroy_scheduler:
+  scheduler_join(scheduler);
+  scheduler_destroy(scheduler);
+fail_exit:
+  return -1;
 }
 
-void *image_save_wrapper(void *arg) {
-  struct save_args *args = (struct save_args *)arg;
-  while (1) {
-    image_t *image = queue_pop(args->input_queue);
-    if (image == NULL) {
-      break;
+/* with --numa, every node gets an image pool of its own so that a buffer is
+ * only reused on the node it was first touched on */
+static affinity_t *pipeline_pthread_numa_begin(image_pool_t **pools) {
+  if (!pipeline_options.numa) {
+    return NULL;
+  }
+
+  affinity_t *affinity = affinity_create();
+  if (affinity == NULL) {
+    return NULL;
+  }
+
+  size_t nodes = affinity_node_count(affinity);
+  printf("NUMA nodes:");
+  for (size_t n = 0; n < nodes; n++) {
+    printf(" %d (%zu cpus)", affinity_node_id(affinity, n),
+           affinity_node_cpus(affinity, n));
+
+    pools[n] = image_pool_create(pipeline_options.pool_high_water / nodes);
+    image_pool_set_node_default(n, pools[n]);
+  }
+  printf("\n");
+
+  return affinity;
+}
+
+static void pipeline_pthread_numa_end(affinity_t *affinity,
+                                      image_pool_t **pools) {
+  if (affinity == NULL) {
+    return;
+  }
+
+  for (size_t n = 0; n < affinity_node_count(affinity); n++) {
+    if (pools[n] == NULL) {
+      continue;
+    }
+
+    if (pipeline_options.stats) {
+      image_pool_stats_t stats;
+      image_pool_get_stats(pools[n], &stats);
+      printf("image pool of node %d: %zu allocs, %zu thread hits, %zu shared "
+             "hits, %zu mallocs, %zu frees\n",
+             affinity_node_id(affinity, n), stats.allocs, stats.thread_hits,
+             stats.shared_hits, stats.system_allocs, stats.system_frees);
     }
-    image_dir_save(args->image_dir, image);
-    printf(".");
-    fflush(stdout);
-    image_destroy(image);
+    image_pool_destroy(pools[n]);
   }
-  return NULL;
+  affinity_destroy(affinity);
 }
 
 int pipeline_pthread(image_dir_t *image_dir) {
   long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
   printf("Number of cores: %ld\n", num_cores);
-  const int NUM_THREADS = calculate_optimal_threads_num(num_cores);
-  printf("Optimal number of threads: %d\n", NUM_THREADS);
-
-  queue_t *loaded_img_queue[NUM_THREADS];
-  queue_t *scaled_img_queue[NUM_THREADS];
-  queue_t *pixel_added_img_queue[NUM_THREADS];
-
-  pthread_t load_thread;
-  pthread_t scale_threads[NUM_THREADS];
-  pthread_t pixel_threads[NUM_THREADS];
-  pthread_t save_threads[NUM_THREADS];
-
-  struct load_args load_args = {image_dir, loaded_img_queue, NUM_THREADS, 0};
-  struct thread_args scale_args[NUM_THREADS];
-  struct thread_args pixel_args[NUM_THREADS];
-  struct save_args save_args[NUM_THREADS];
-
-  // Create queues
-  for (int i = 0; i < NUM_THREADS; i++) {
-    loaded_img_queue[i] = queue_create(QUEUE_SIZE);
-    scaled_img_queue[i] = queue_create(QUEUE_SIZE);
-    pixel_added_img_queue[i] = queue_create(QUEUE_SIZE);
-    if (!loaded_img_queue[i] || !scaled_img_queue[i] ||
-        !pixel_added_img_queue[i]) {
-      fprintf(stderr, "Failed to create queue %d\n", i);
-      goto cleanup;
-    }
-  }
+  autotune_config_t config = {
+      .loaders = pipeline_loader_count(),
+      .workers = pipeline_worker_count(),
+  };
+  printf("Optimal number of threads: %zu\n", config.workers);
 
-  // Create load thread
-  if (pthread_create(&load_thread, NULL, image_load_wrapper, &load_args) != 0) {
-    fprintf(stderr, "Error creating load thread\n");
-    goto cleanup;
-  }
-
-  // Create scale, pixel, and save threads
-  for (int i = 0; i < NUM_THREADS; i++) {
-    scale_args[i] = (struct thread_args){loaded_img_queue[i], scaled_img_queue,
-                                         NUM_THREADS, i};
-    pixel_args[i] = (struct thread_args){scaled_img_queue[i],
-                                         pixel_added_img_queue, NUM_THREADS, i};
-    save_args[i] = (struct save_args){pixel_added_img_queue[i], image_dir, i};
-
-    if (pthread_create(&scale_threads[i], NULL, filter_scale_up_wrapper,
-                       &scale_args[i]) != 0 ||
-        pthread_create(&pixel_threads[i], NULL, filter_add_pixel_wrapper,
-                       &pixel_args[i]) != 0 ||
-        pthread_create(&save_threads[i], NULL, image_save_wrapper,
-                       &save_args[i]) != 0) {
-      fprintf(stderr, "Error creating thread %d\n", i);
-      goto cleanup;
-    }
+  image_pool_t *pool = pipeline_pool_begin();
+  image_pool_t *node_pools[AFFINITY_MAX_NODES] = {NULL};
+  affinity_t *affinity = pipeline_pthread_numa_begin(node_pools);
+  if (pipeline_options.numa && affinity == NULL) {
+    goto fail_exit;
   }
 
-  // Join threads
-  pthread_join(load_thread, NULL);
-  for (int i = 0; i < NUM_THREADS; i++) {
-    pthread_join(scale_threads[i], NULL);
-    pthread_join(pixel_threads[i], NULL);
-    pthread_join(save_threads[i], NULL);
+  if (image_dir_open(image_dir) < 0) {
+    goto fail_exit;
   }
 
-  printf("\n");
+  autotune_t *tune = pipeline_autotune_begin();
+  if (tune != NULL) {
+    int ret = pipeline_pthread_run(image_dir, tune, &config, affinity);
+    pipeline_autotune_end(tune, &config);
+    if (ret < 0) {
+      goto fail_close_dir;
+    }
 
-cleanup:
-  for (int i = 0; i < NUM_THREADS; i++) {
-    if (loaded_img_queue[i])
-      queue_destroy(loaded_img_queue[i]);
-    if (scaled_img_queue[i])
-      queue_destroy(scaled_img_queue[i]);
-    if (pixel_added_img_queue[i])
-      queue_destroy(pixel_added_img_queue[i]);
+    printf("autotune: %zu loaders, %zu workers (pin with --loaders %zu "
+           "--workers %zu)\n",
+           config.loaders, config.workers, config.loaders, config.workers);
   }
+
+  if (pipeline_pthread_run(image_dir, NULL, &config, affinity) < 0) {
+    goto fail_close_dir;
+  }
+
+  image_dir_close(image_dir);
+  pipeline_pthread_numa_end(affinity, node_pools);
+  pipeline_pool_end(pool);
   return 0;
+
+fail_close_dir:
+  image_dir_close(image_dir);
+fail_exit:
+  pipeline_pthread_numa_end(affinity, node_pools);
+  pipeline_pool_end(pool);
+  return -1;
 }
@@ -2,39 +2,49 @@
 
 #include <stdio.h>
 
-#include "filter.h"
+#include "filter-graph.h"
 #include "pipeline.h"
 
+/* the reference the other pipelines are checked against: every filter runs
+ * on its own, nothing is fused or split */
 int pipeline_serial(image_dir_t *image_dir) {
-  pixel_t pixel = {.bytes = {0, 0, 0, 0}};
+  image_pool_t *pool = pipeline_pool_begin();
   while (1) {
-    image_t *image1 = image_dir_load_next(image_dir);
+    pipeline_mark_t mark;
+    pipeline_stage_begin(NULL, &mark);
+    image_t *image1;
+    size_t id;
+    if (image_dir_load_next(image_dir, &image1, &id) < 0) {
+      pipeline_save_skip(image_dir, NULL, id);
+      continue;
+    }
     if (image1 == NULL) {
       break;
     }
+    pipeline_stage_end(NULL, AUTOTUNE_LOAD, &mark);
 
-    image_t *image2 = filter_scale_up(image1, 3);
+    pipeline_stage_begin(NULL, &mark);
+    image_t *image2 =
+        filter_graph_apply_unfused(&pipeline_options.filters, image1);
     image_destroy(image1);
     if (image2 == NULL) {
       goto fail_exit;
     }
+    pipeline_stage_end(NULL, AUTOTUNE_FILTER, &mark);
 
-    pixel.bytes[0] = (pixel.bytes[0] + 4) % 256;
-    image_t *image3 = filter_add_pixel(image2, &pixel);
-    image_destroy(image2);
-    if (image3 == NULL) {
-      goto fail_exit;
-    }
-
-    image_dir_save(image_dir, image3);
+    pipeline_stage_begin(NULL, &mark);
+    image_dir_save(image_dir, image2);
+    pipeline_stage_end(NULL, AUTOTUNE_SAVE, &mark);
     printf(".");
     fflush(stdout);
-    image_destroy(image3);
+    image_destroy(image2);
   }
 
   printf("\n");
+  pipeline_pool_end(pool);
   return 0;
 
 fail_exit:
+  pipeline_pool_end(pool);
   return -1;
 }
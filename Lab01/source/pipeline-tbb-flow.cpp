@@ -0,0 +1,277 @@
+#include "tbb/flow_graph.h"
+#include "tbb/task_arena.h"
+#include <atomic>
+#include <memory>
+#include <stdio.h>
+#include <tuple>
+#include <vector>
+
+extern "C" {
+#include "budget.h"
+#include "filter-graph.h"
+#include "image-stream.h"
+#include "log.h"
+#include "pipeline.h"
+}
+
+struct FlowFrame;
+
+typedef tbb::flow::multifunction_node<size_t, std::tuple<FlowFrame *>>
+    FlowLoadNode;
+
+/* frames an output stream may hold back behind a slow one before no more
+ * are admitted */
+#define FLOW_STREAM_HELD 100
+
+/* The bytes of the frames in flight are charged to a budget before asking
+ * the load node for a frame, the load node settles the charge once the frame
+ * is decoded and the last node to finish with the frame gives it back.
+ * Nothing blocks on it: with a single core the graph only runs while the
+ * caller waits for it, so whoever returns bytes admits the next frames
+ * itself. */
+struct FlowState {
+  image_dir_t *image_dir;
+  image_dir_t thumb_dir; /* same directory, thumbnail prefix */
+  budget_t *budget;
+  FlowLoadNode *load;
+  std::atomic<bool> done;
+  std::atomic<size_t> in_flight; /* frames decoded and not yet released */
+
+  FlowState(image_dir_t *image_dir, budget_t *budget)
+      : image_dir(image_dir), thumb_dir(*image_dir), budget(budget),
+        load(NULL), done(false), in_flight(0) {}
+};
+
+/* a decoded frame, shared by the full-size and the thumbnail branches */
+struct FlowFrame {
+  FlowState *state;
+  image_t *image;
+  image_t *output; /* NULL once a filter failed */
+  size_t bytes;
+  uint64_t filter_ns; /* over every stage, for --stats */
+  std::atomic<int> refs;
+};
+
+/* hands the load node as many frames as the budget, and the frames held by
+ * an output stream, allow; the charge of each one travels with it */
+static void flow_admit(FlowState *state) {
+  image_stream_t *stream = state->image_dir->output_stream;
+  while (!state->done) {
+    /* the frame they wait for is in flight, its release admits the next */
+    if (stream != NULL && image_stream_held(stream) >= FLOW_STREAM_HELD) {
+      return;
+    }
+
+    size_t charged;
+    if (!budget_try_charge(state->budget, &charged)) {
+      return;
+    }
+
+    state->load->try_put(charged);
+  }
+}
+
+static void flow_frame_unref(FlowFrame *frame) {
+  if (frame->refs.fetch_sub(1) > 1) {
+    return;
+  }
+
+  FlowState *state = frame->state;
+  state->in_flight--;
+  budget_release(state->budget, frame->bytes);
+  image_destroy(frame->image);
+  delete frame;
+  flow_admit(state);
+}
+
+class FlowLoad {
+  FlowState *state;
+  int branches;
+
+public:
+  FlowLoad(FlowState *state, int branches)
+      : state(state), branches(branches) {}
+
+  void operator()(size_t charged, FlowLoadNode::output_ports_type &ports) {
+    pipeline_mark_t mark;
+    pipeline_stage_begin(NULL, &mark);
+    image_t *image;
+    size_t id;
+    if (image_dir_load_any(state->image_dir, &image, &id) < 0) {
+      /* the id won't come, its charge admits the next frame instead */
+      budget_cancel(state->budget, charged);
+      pipeline_save_skip(state->image_dir, NULL, id);
+      flow_admit(state);
+      return;
+    }
+    if (image == NULL) {
+      state->done = true;
+      budget_cancel(state->budget, charged);
+      return;
+    }
+    pipeline_stage_end(NULL, AUTOTUNE_LOAD, &mark);
+
+    FlowFrame *frame = new FlowFrame;
+    frame->state = state;
+    frame->image = image;
+    frame->output = NULL;
+    frame->filter_ns = 0;
+    frame->bytes = filter_graph_footprint(&pipeline_options.filters,
+                                          image->width, image->height);
+    frame->refs = branches;
+
+    state->in_flight++;
+    budget_settle(state->budget, charged, frame->bytes);
+    std::get<0>(ports).try_put(frame);
+    flow_admit(state);
+  }
+};
+
+typedef tbb::flow::function_node<FlowFrame *, FlowFrame *> FlowStageNode;
+
+/* a stage of the filter graph, the decoded frame is kept for the thumbnail
+ * and the intermediate images are freed as soon as the next stage is done */
+class FlowStage {
+  size_t index;
+
+public:
+  FlowStage(size_t index) : index(index) {}
+
+  FlowFrame *operator()(FlowFrame *frame) const {
+    image_t *in = (index == 0) ? frame->image : frame->output;
+    if (in == NULL) {
+      return frame;
+    }
+
+    uint64_t start = metrics_now();
+
+    filter_splitter_t splitter = {
+        pipeline_tbb_split, NULL,
+        pipeline_split_threads(in, tbb::this_task_arena::max_concurrency(),
+                               frame->state->in_flight - 1),
+        pipeline_options.tile_rows};
+    frame->output = filter_graph_apply_stage(&pipeline_options.filters,
+                                             index, in, &splitter);
+    if (index > 0) {
+      image_destroy(in);
+    }
+
+    /* stages of a frame queue up between nodes, only count the work */
+    if (start != 0) {
+      frame->filter_ns += metrics_now() - start;
+      if (index + 1 == pipeline_options.filters.stage_count &&
+          frame->output != NULL) {
+        metrics_record(METRICS_FILTER, frame->filter_ns);
+      }
+    }
+    return frame;
+  }
+};
+
+class FlowEncode {
+public:
+  tbb::flow::continue_msg operator()(FlowFrame *frame) const {
+    if (frame->output != NULL) {
+      pipeline_mark_t mark;
+      pipeline_stage_begin(NULL, &mark);
+      frame->output->id = frame->image->id;
+      image_dir_save(frame->state->image_dir, frame->output);
+      pipeline_stage_end(NULL, AUTOTUNE_SAVE, &mark);
+      image_destroy(frame->output);
+      printf(".");
+      fflush(stdout);
+    } else {
+      pipeline_save_skip(frame->state->image_dir, NULL, frame->image->id);
+    }
+
+    flow_frame_unref(frame);
+    return tbb::flow::continue_msg();
+  }
+};
+
+/* the decoded frame, before any filter */
+class FlowThumbnail {
+public:
+  tbb::flow::continue_msg operator()(FlowFrame *frame) const {
+    image_dir_save(&frame->state->thumb_dir, frame->image);
+    flow_frame_unref(frame);
+    return tbb::flow::continue_msg();
+  }
+};
+
+int pipeline_tbb_flow(image_dir_t *image_dir) {
+  if (pipeline_options.ordered) {
+    LOG_ERROR("--ordered isn't supported by the tbb-flow pipeline");
+    return -1;
+  }
+
+  /* they would be interleaved with the filtered frames */
+  if (pipeline_options.thumbnails && image_dir->output_stream != NULL) {
+    LOG_ERROR("--thumbnails needs PNG output");
+    return -1;
+  }
+
+  image_pool_t *pool = pipeline_pool_begin();
+  if (image_dir_open(image_dir) < 0) {
+    pipeline_pool_end(pool);
+    return -1;
+  }
+
+  budget_t *budget = budget_create(pipeline_options.flow_budget);
+  if (budget == NULL) {
+    image_dir_close(image_dir);
+    pipeline_pool_end(pool);
+    return -1;
+  }
+
+  FlowState state(image_dir, budget);
+  state.thumb_dir.save_prefix = "tbb-flow-thumb";
+
+  size_t load_concurrency = pipeline_options.flow_load;
+  if (load_concurrency == 0) {
+    load_concurrency = pipeline_loader_count();
+  }
+
+  /* a limit of 0 is tbb::flow::unlimited */
+  tbb::flow::graph graph;
+  FlowLoadNode load(graph, load_concurrency,
+                    FlowLoad(&state, pipeline_options.thumbnails ? 2 : 1));
+  tbb::flow::function_node<FlowFrame *> encode(
+      graph, pipeline_options.flow_encode, FlowEncode());
+  tbb::flow::function_node<FlowFrame *> thumbnail(
+      graph, pipeline_options.flow_encode, FlowThumbnail());
+
+  std::vector<std::unique_ptr<FlowStageNode>> stages;
+  for (size_t i = 0; i < pipeline_options.filters.stage_count; i++) {
+    stages.emplace_back(new FlowStageNode(
+        graph, pipeline_options.flow_filter, FlowStage(i)));
+    if (i == 0) {
+      tbb::flow::make_edge(tbb::flow::output_port<0>(load), *stages[i]);
+    } else {
+      tbb::flow::make_edge(*stages[i - 1], *stages[i]);
+    }
+  }
+  tbb::flow::make_edge(*stages.back(), encode);
+
+  if (pipeline_options.thumbnails) {
+    tbb::flow::make_edge(tbb::flow::output_port<0>(load), thumbnail);
+  }
+
+  /* the first frame takes the whole budget until its size is known */
+  state.load = &load;
+  flow_admit(&state);
+  graph.wait_for_all();
+  printf("\n");
+
+  if (pipeline_options.stats) {
+    budget_stats_t stats;
+    budget_get_stats(budget, &stats);
+    printf("tbb-flow: %.1f MiB peak in flight (%.1f MiB budget)\n",
+           stats.peak / (1024.0 * 1024.0), stats.limit / (1024.0 * 1024.0));
+  }
+  budget_destroy(budget);
+
+  image_dir_close(image_dir);
+  pipeline_pool_end(pool);
+  return 0;
+}
@@ -1,22 +1,48 @@
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
 #include "tbb/pipeline.h"
+#include "tbb/task_arena.h"
+#include <atomic>
 #include <stdio.h>
-#include <unistd.h>
 
 
 extern "C" {
-#include "filter.h"
+#include "filter-graph.h"
 #include "pipeline.h"
 }
 
+/* frames between their load and their save */
+typedef std::atomic<size_t> TBBInFlight;
+
 class TBBLoadNext {
   image_dir_t *image_dir;
+  reorder_t *reorder;
+  autotune_t *tune;
+  TBBInFlight *in_flight;
 
 public:
-  TBBLoadNext(image_dir_t *image_dir) : image_dir(image_dir) {}
+  TBBLoadNext(image_dir_t *image_dir, reorder_t *reorder, autotune_t *tune,
+              TBBInFlight *in_flight)
+      : image_dir(image_dir), reorder(reorder), tune(tune),
+        in_flight(in_flight) {}
 
   image_t *operator()(tbb::flow_control &fc) const {
-    image_t *out = image_dir_load_next(image_dir);
+    if (tune != NULL && !autotune_claim(tune)) {
+      fc.stop();
+      return NULL;
+    }
+
+    pipeline_mark_t mark;
+    pipeline_stage_begin(tune, &mark);
+    image_t *out;
+    size_t id;
+    /* the frames that fail to decode are skipped, the token goes on */
+    while (image_dir_load_any(image_dir, &out, &id) < 0) {
+      pipeline_save_skip(image_dir, reorder, id);
+    }
     if (out != NULL) {
+      pipeline_stage_end(tune, AUTOTUNE_LOAD, &mark);
+      (*in_flight)++;
       return out;
     } else {
       fc.stop();
@@ -25,69 +51,135 @@ public:
   }
 };
 
-class TBBScaleUp {
+class TBBBands {
+  filter_band_fn_t fn;
+  void *arg;
+
 public:
-  TBBScaleUp() {}
-  image_t *operator()(image_t *in) const {
-    image_t *out = filter_scale_up(in, 3);
-    if (out != NULL) {
-      image_destroy(in);
-      return out;
+  TBBBands(filter_band_fn_t fn, void *arg) : fn(fn), arg(arg) {}
+
+  void operator()(const tbb::blocked_range<size_t> &range) const {
+    for (size_t i = range.begin(); i != range.end(); i++) {
+      fn(arg, i);
     }
-    fprintf(stderr, "Error scaling up image %zu\n", in->id);
-    return NULL;
   }
 };
 
-class TBBAddPixel {
+void pipeline_tbb_split(void *ctx, size_t bands, filter_band_fn_t fn,
+                        void *arg) {
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, bands), TBBBands(fn, arg));
+}
+
+class TBBFilter {
+  image_dir_t *image_dir;
+  reorder_t *reorder;
+  autotune_t *tune;
+  TBBInFlight *in_flight;
+
 public:
-  TBBAddPixel() {}
+  TBBFilter(image_dir_t *image_dir, reorder_t *reorder, autotune_t *tune,
+            TBBInFlight *in_flight)
+      : image_dir(image_dir), reorder(reorder), tune(tune),
+        in_flight(in_flight) {}
   image_t *operator()(image_t *in) const {
-    pixel_t pixel = {0};
-    pixel.bytes[0] = (4 * (in->id + 1)) % 256;
+    pipeline_mark_t mark;
+    pipeline_stage_begin(tune, &mark);
 
-    image_t *out = filter_add_pixel(in, &pixel);
+    /* point-wise and geometric filters are fused, large frames are also
+     * cut into bands when the other tokens can't keep the threads busy */
+    filter_splitter_t splitter = {
+        pipeline_tbb_split, NULL,
+        pipeline_split_threads(in, tbb::this_task_arena::max_concurrency(),
+                               *in_flight - 1),
+        pipeline_options.tile_rows};
+    image_t *out =
+        filter_graph_apply(&pipeline_options.filters, in, &splitter);
+    pipeline_stage_end(tune, AUTOTUNE_FILTER, &mark);
     if (out != NULL) {
       image_destroy(in);
       return out;
     }
-    fprintf(stderr, "Error adding pixel to image %zu\n", in->id);
+    fprintf(stderr, "Error filtering image %zu\n", in->id);
+    pipeline_save_skip(image_dir, reorder, in->id);
+    image_destroy(in);
     return NULL;
   }
 };
 
 class TBBSave {
   image_dir_t *image_dir;
+  reorder_t *reorder;
+  autotune_t *tune;
+  TBBInFlight *in_flight;
 
 public:
-  TBBSave(image_dir_t *image_dir) : image_dir(image_dir) {}
+  TBBSave(image_dir_t *image_dir, reorder_t *reorder, autotune_t *tune,
+          TBBInFlight *in_flight)
+      : image_dir(image_dir), reorder(reorder), tune(tune),
+        in_flight(in_flight) {}
 
   void operator()(image_t *in) const {
-    image_dir_save(image_dir, in);
+    (*in_flight)--;
+    if (in == NULL) {
+      return;
+    }
+
+    pipeline_mark_t mark;
+    pipeline_stage_begin(tune, &mark);
+    pipeline_save(image_dir, reorder, in);
+    pipeline_stage_end(tune, AUTOTUNE_SAVE, &mark);
     image_destroy(in);
     printf(".");
     fflush(stdout);
   }
 };
-int calculate_optimal_threads_num(long num_cores) {
-  int optimal_threads = (num_cores * 8) / 4;
-  return (optimal_threads < 2)    ? 2
-         : (optimal_threads > 27) ? 27
-                                  : optimal_threads;
-}
 
-int pipeline_tbb(image_dir_t *image_dir) {
-  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
-  const int NUM_THREADS = calculate_optimal_threads_num(num_cores);
+/* runs frames until the directory, or the calibration frames of `tune`, are
+ * exhausted */
+static void pipeline_tbb_run(image_dir_t *image_dir, autotune_t *tune,
+                             size_t tokens) {
+  /* the oldest frame holds one of the tokens and keeps being processed, a
+   * full window only makes the save stage wait for it */
+  reorder_t *reorder = pipeline_reorder_begin(image_dir, tokens * 2);
+  TBBInFlight in_flight(0);
+
+  /* frames are decoded concurrently, in any order */
   tbb::parallel_pipeline(
-      NUM_THREADS, tbb::make_filter<void, image_t *>(tbb::filter::serial,
-                                            TBBLoadNext(image_dir)) &
-              tbb::make_filter<image_t *, image_t *>(tbb::filter::parallel,
-                                                     TBBScaleUp()) &
-              tbb::make_filter<image_t *, image_t *>(tbb::filter::parallel,
-                                                     TBBAddPixel()) &
-              tbb::make_filter<image_t *, void>(tbb::filter::parallel,
-                                                TBBSave(image_dir)));
+      tokens,
+      tbb::make_filter<void, image_t *>(
+          tbb::filter::parallel,
+          TBBLoadNext(image_dir, reorder, tune, &in_flight)) &
+          tbb::make_filter<image_t *, image_t *>(
+              tbb::filter::parallel,
+              TBBFilter(image_dir, reorder, tune, &in_flight)) &
+          tbb::make_filter<image_t *, void>(
+              tbb::filter::parallel,
+              TBBSave(image_dir, reorder, tune, &in_flight)));
+  pipeline_reorder_end(reorder);
   printf("\n");
+}
+
+int pipeline_tbb(image_dir_t *image_dir) {
+  size_t tokens = pipeline_worker_count();
+  image_pool_t *pool = pipeline_pool_begin();
+  if (image_dir_open(image_dir) < 0) {
+    pipeline_pool_end(pool);
+    return -1;
+  }
+
+  /* a token per thread of every stage */
+  autotune_t *tune = pipeline_autotune_begin();
+  if (tune != NULL) {
+    pipeline_tbb_run(image_dir, tune, tokens);
+
+    autotune_config_t config = {.loaders = 0, .workers = tokens};
+    pipeline_autotune_end(tune, &config);
+    tokens = config.loaders + config.workers;
+    printf("autotune: %zu tokens (pin with --workers %zu)\n", tokens, tokens);
+  }
+
+  pipeline_tbb_run(image_dir, NULL, tokens);
+  image_dir_close(image_dir);
+  pipeline_pool_end(pool);
   return 0;
 }
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "image-stream.h"
+#include "pipeline.h"
+
+#define MIB (1024.0 * 1024.0)
+
+/* below this, a frame is filtered by a single thread: bands would be a few
+ * rows of a cache-resident image */
+#define PIPELINE_SPLIT_MIN_PIXELS (1024 * 1024)
+
+pipeline_options_t pipeline_options = {
+    .stats = false,
+    .pool_high_water = 256 * 1024 * 1024,
+    .loaders = 0,
+    .workers = 0,
+    .autotune = 0,
+    .ordered = false,
+    .split = PIPELINE_SPLIT_AUTO,
+    .tile_rows = 0,
+    .max_memory = 0,
+    .batch = 1,
+    .batch_latency_ns = 1000 * 1000,
+    .flow_budget = 256 * 1024 * 1024,
+};
+
+static const metrics_series_t pipeline_stage_series[AUTOTUNE_STAGE_COUNT] = {
+    [AUTOTUNE_LOAD] = METRICS_LOAD,
+    [AUTOTUNE_FILTER] = METRICS_FILTER,
+    [AUTOTUNE_SAVE] = METRICS_SAVE,
+};
+
+static const char *pipeline_stage_names[AUTOTUNE_STAGE_COUNT] = {
+    [AUTOTUNE_LOAD] = "load",
+    [AUTOTUNE_FILTER] = "filter",
+    [AUTOTUNE_SAVE] = "save",
+};
+
+static struct rusage pool_begin_usage;
+
+image_pool_t *pipeline_pool_begin(void) {
+  image_pool_t *pool = image_pool_create(pipeline_options.pool_high_water);
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  getrusage(RUSAGE_SELF, &pool_begin_usage);
+  image_pool_set_default(pool);
+  return pool;
+}
+
+void pipeline_pool_end(image_pool_t *pool) {
+  if (pool == NULL) {
+    return;
+  }
+
+  image_pool_set_default(NULL);
+
+  if (pipeline_options.stats) {
+    struct rusage usage;
+    image_pool_stats_t stats;
+
+    getrusage(RUSAGE_SELF, &usage);
+    image_pool_get_stats(pool, &stats);
+
+    printf("image pool: %zu allocs, %zu thread hits, %zu shared hits, "
+           "%zu mallocs, %zu frees (%.1f MiB high-water, %.1f MiB peak)\n",
+           stats.allocs, stats.thread_hits, stats.shared_hits,
+           stats.system_allocs, stats.system_frees,
+           pipeline_options.pool_high_water / MIB,
+           stats.peak_cached_bytes / MIB);
+    printf("page faults: %ld minor, %ld major\n",
+           usage.ru_minflt - pool_begin_usage.ru_minflt,
+           usage.ru_majflt - pool_begin_usage.ru_majflt);
+  }
+
+  image_pool_destroy(pool);
+}
+
+size_t pipeline_loader_count(void) {
+  if (pipeline_options.loaders > 0) {
+    return pipeline_options.loaders;
+  }
+
+  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return (num_cores > 1) ? num_cores : 1;
+}
+
+size_t pipeline_split_threads(const image_t *image, size_t threads,
+                              size_t backlog) {
+  switch (pipeline_options.split) {
+  case PIPELINE_SPLIT_NEVER:
+    return 1;
+  case PIPELINE_SPLIT_ALWAYS:
+    return threads;
+  case PIPELINE_SPLIT_AUTO:
+    break;
+  }
+
+  /* frame-level parallelism needs no synchronisation, tiles only pay off
+   * when the queue runs dry, at the start and the end of a batch */
+  if (threads < 2 || image->width * image->height < PIPELINE_SPLIT_MIN_PIXELS ||
+      backlog >= threads) {
+    return 1;
+  }
+
+  return threads;
+}
+
+size_t pipeline_worker_count(void) {
+  if (pipeline_options.workers > 0) {
+    return pipeline_options.workers;
+  }
+
+  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  long optimal_threads = (num_cores * 8) / 4;
+  return (optimal_threads < 2)    ? 2
+         : (optimal_threads > 27) ? 27
+                                  : optimal_threads;
+}
+
+void pipeline_stage_begin(autotune_t *tune, pipeline_mark_t *mark) {
+  autotune_begin(tune, &mark->tune);
+  mark->start = metrics_now();
+  mark->traced = trace_now();
+}
+
+void pipeline_stage_end(autotune_t *tune, autotune_stage_t stage,
+                        const pipeline_mark_t *mark) {
+  autotune_end(tune, stage, &mark->tune);
+  metrics_record_since(pipeline_stage_series[stage], mark->start);
+  trace_span(pipeline_stage_names[stage], mark->traced, -1);
+}
+
+autotune_t *pipeline_autotune_begin(void) {
+  if (pipeline_options.autotune == 0) {
+    return NULL;
+  }
+
+  return autotune_create(pipeline_options.autotune);
+}
+
+void pipeline_autotune_end(autotune_t *tune, autotune_config_t *config) {
+  if (tune == NULL) {
+    return;
+  }
+
+  autotune_stats_t stats;
+  autotune_get_stats(tune, &stats);
+
+  const autotune_stage_stats_t *load = &stats.stages[AUTOTUNE_LOAD];
+  const autotune_stage_stats_t *filter = &stats.stages[AUTOTUNE_FILTER];
+  const autotune_stage_stats_t *save = &stats.stages[AUTOTUNE_SAVE];
+  printf("autotune: %zu frames, load %.2f ms (%.2f cpu), filter %.2f ms "
+         "(%.2f cpu), save %.2f ms (%.2f cpu), %.1f frames in flight\n",
+         load->frames, load->wall_ms, load->cpu_ms, filter->wall_ms,
+         filter->cpu_ms, save->wall_ms, save->cpu_ms, stats.in_flight);
+
+  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (autotune_solve(tune, num_cores, config) < 0) {
+    printf("autotune: not enough frames, keeping the defaults\n");
+  }
+
+  autotune_destroy(tune);
+}
+
+static void pipeline_commit(size_t id, void *item, void *arg) {
+  image_dir_t *image_dir = arg;
+
+  /* the stream wrote the frame in its turn already */
+  if (image_dir->output_stream == NULL) {
+    image_dir_commit(image_dir, id);
+  }
+}
+
+reorder_t *pipeline_reorder_begin(image_dir_t *image_dir, size_t window) {
+  /* a stream holds the frames ahead of their turn in memory, the window
+   * bounds how many even without --ordered */
+  if (!pipeline_options.ordered && image_dir->output_stream == NULL) {
+    return NULL;
+  }
+
+  return reorder_create(window, image_dir->load_current, pipeline_commit,
+                        image_dir);
+}
+
+void pipeline_reorder_end(reorder_t *reorder) {
+  if (reorder == NULL) {
+    return;
+  }
+
+  if (pipeline_options.stats) {
+    reorder_stats_t stats;
+    reorder_get_stats(reorder, &stats);
+    printf("reorder: %zu committed, %zu skipped, %zu/%zu frames peak in "
+           "window (%zu bytes held + %zu bytes of slots)\n",
+           stats.committed, stats.skipped, stats.peak_items, stats.window,
+           stats.peak_bytes, stats.window_bytes);
+  }
+
+  reorder_destroy(reorder);
+}
+
+int pipeline_save(image_dir_t *image_dir, reorder_t *reorder, image_t *image) {
+  if (reorder == NULL) {
+    if (image_dir_save(image_dir, image) < 0) {
+      pipeline_save_skip(image_dir, NULL, image->id);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (image_dir->output_stream != NULL) {
+    reorder_wait(reorder, image->id);
+  }
+
+  if (image_dir_save_tmp(image_dir, image) < 0) {
+    pipeline_save_skip(image_dir, reorder, image->id);
+    return -1;
+  }
+
+  /* the frame is on disk or held by the stream by now, its size is what
+   * the window holds back */
+  return reorder_push(reorder, image->id, NULL,
+                      image->width * image->height * sizeof(pixel_t));
+}
+
+void pipeline_save_skip(image_dir_t *image_dir, reorder_t *reorder,
+                        size_t id) {
+  if (image_dir->output_stream != NULL) {
+    image_stream_skip(image_dir->output_stream, id);
+  }
+  if (reorder != NULL) {
+    reorder_skip(reorder, id);
+  }
+}
@@ -1,45 +1,69 @@
 /* DO NOT EDIT THIS FILE */
 
 #include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include "futex.h"
 #include "log.h"
 #include "queue.h"
+#include "trace.h"
+
+/* number of failed attempts before a thread goes to sleep on the futex */
+#define QUEUE_SPIN_COUNT 256
+
+static size_t round_up_pow2(size_t size) {
+  size_t capacity = 1;
+  while (capacity < size) {
+    capacity <<= 1;
+  }
+  return capacity;
+}
 
 queue_t *queue_create(size_t size) {
-  queue_t *queue = calloc(sizeof(*queue), 1);
+  if (size == 0) {
+    LOG_ERROR("queue size must be greater than zero");
+    goto fail_exit;
+  }
+
+  queue_t *queue = aligned_alloc(QUEUE_CACHE_LINE, sizeof(*queue));
   if (queue == NULL) {
-    LOG_ERROR_ERRNO("calloc");
+    LOG_ERROR_ERRNO("aligned_alloc");
     goto fail_exit;
   }
 
-  queue->size = size;
-  queue->used = 0;
+  queue->spin_count = spin_worthwhile() ? QUEUE_SPIN_COUNT : 0;
+  /* with a single cell a full queue looks empty to the next push */
+  queue->size = round_up_pow2(size < 2 ? 2 : size);
+  queue->mask = queue->size - 1;
 
-  errno = pthread_mutex_init(&queue->mutex, NULL);
-  if (errno != 0) {
-    LOG_ERROR_ERRNO("pthread_mutex_init");
+  queue->cells = aligned_alloc(QUEUE_CACHE_LINE,
+                               queue->size * sizeof(*queue->cells));
+  if (queue->cells == NULL) {
+    LOG_ERROR_ERRNO("aligned_alloc");
     goto fail_free_queue;
   }
 
-  errno = pthread_cond_init(&queue->modified_item_pushed, NULL);
-  if (errno != 0) {
-    LOG_ERROR_ERRNO("pthread_cond_init");
-    goto fail_destroy_mutex;
+  for (size_t i = 0; i < queue->size; i++) {
+    atomic_init(&queue->cells[i].sequence, i);
+    queue->cells[i].value = NULL;
   }
 
-  errno = pthread_cond_init(&queue->modified_item_poped, NULL);
-  if (errno != 0) {
-    LOG_ERROR_ERRNO("pthread_cond_init");
-    goto fail_destroy_cond;
-  }
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  atomic_init(&queue->pushed, 0);
+  atomic_init(&queue->pop_sleeping, 0);
+  atomic_init(&queue->poped, 0);
+  atomic_init(&queue->push_sleeping, 0);
+  atomic_init(&queue->push_wait_ns, 0);
+  atomic_init(&queue->push_waits, 0);
+  atomic_init(&queue->pop_wait_ns, 0);
+  atomic_init(&queue->pop_waits, 0);
 
   return queue;
 
-fail_destroy_cond:
-  pthread_cond_destroy(&queue->modified_item_pushed);
-fail_destroy_mutex:
-  pthread_mutex_destroy(&queue->mutex);
 fail_free_queue:
   free(queue);
 fail_exit:
@@ -47,117 +71,382 @@ fail_exit:
 }
 
 void queue_destroy(queue_t *queue) {
-  pthread_mutex_destroy(&queue->mutex);
-  pthread_cond_destroy(&queue->modified_item_pushed);
-  pthread_cond_destroy(&queue->modified_item_poped);
+  free(queue->cells);
+  free(queue);
+}
 
-  while (queue->head != NULL) {
-    queue_node_t *head = queue->head;
-    queue->head = head->prev;
-    free(head);
+static bool queue_try_push_raw(queue_t *queue, void *ptr) {
+  queue_cell_t *cell;
+  size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+  while (1) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* cell still holds the value pushed one lap ago, queue is full */
+      return false;
+    } else {
+      pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    }
   }
 
-  free(queue);
+  cell->value = ptr;
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+  return true;
 }
 
-int queue_push(queue_t *queue, void *ptr) {
-  queue_node_t *node = malloc(sizeof(*node));
-  if (node == NULL) {
-    LOG_ERROR_ERRNO("malloc");
-    goto fail_exit;
+static bool queue_try_pop_raw(queue_t *queue, void **ptr) {
+  queue_cell_t *cell;
+  size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+  while (1) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* cell wasn't written yet, queue is empty */
+      return false;
+    } else {
+      pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    }
   }
 
-  errno = pthread_mutex_lock(&queue->mutex);
-  if (errno != 0) {
-    LOG_ERROR_ERRNO("pthread_mutex_lock");
-    goto fail_free_node;
+  *ptr = cell->value;
+  atomic_store_explicit(&cell->sequence, pos + queue->mask + 1,
+                        memory_order_release);
+  return true;
+}
+
+/* the cells from `pos` on whose sequence is `pos + offset`, up to `max` */
+static size_t queue_count_ready(queue_t *queue, size_t pos, size_t offset,
+                                size_t max) {
+  size_t n = 0;
+  while (n < max && n < queue->size) {
+    queue_cell_t *cell = &queue->cells[(pos + n) & queue->mask];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    if (seq != pos + n + offset) {
+      break;
+    }
+    n++;
   }
+  return n;
+}
 
-  while (queue->used == queue->size) {
-    errno = pthread_cond_wait(&queue->modified_item_poped, &queue->mutex);
-    if (errno != 0) {
-      LOG_ERROR_ERRNO("pthread_cond_wait");
-      goto fail_unlock_mutex;
+/* claims the run of free cells at the head with one CAS: no other producer
+ * can write past `pos` before the head moves, so they stay free */
+static size_t queue_try_push_batch_raw(queue_t *queue, void *const *ptrs,
+                                       size_t count) {
+  size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  size_t n;
+
+  while (1) {
+    n = queue_count_ready(queue, pos, 0, count);
+    if (n == 0) {
+      queue_cell_t *cell = &queue->cells[pos & queue->mask];
+      size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+      if ((intptr_t)seq - (intptr_t)pos < 0) {
+        return 0;
+      }
+      pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    } else if (atomic_compare_exchange_weak_explicit(
+                   &queue->head, &pos, pos + n, memory_order_relaxed,
+                   memory_order_relaxed)) {
+      break;
     }
   }
 
-  node->value = ptr;
-  node->prev = NULL;
+  for (size_t i = 0; i < n; i++) {
+    queue_cell_t *cell = &queue->cells[(pos + i) & queue->mask];
+    cell->value = ptrs[i];
+    atomic_store_explicit(&cell->sequence, pos + i + 1, memory_order_release);
+  }
+  return n;
+}
 
-  if (queue->tail != NULL) {
-    queue->tail->prev = node;
+static size_t queue_try_pop_batch_raw(queue_t *queue, void **ptrs,
+                                      size_t max) {
+  size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  size_t n;
+
+  while (1) {
+    n = queue_count_ready(queue, pos, 1, max);
+    if (n == 0) {
+      queue_cell_t *cell = &queue->cells[pos & queue->mask];
+      size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+      if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) {
+        return 0;
+      }
+      pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    } else if (atomic_compare_exchange_weak_explicit(
+                   &queue->tail, &pos, pos + n, memory_order_relaxed,
+                   memory_order_relaxed)) {
+      break;
+    }
   }
 
-  queue->tail = node;
+  for (size_t i = 0; i < n; i++) {
+    queue_cell_t *cell = &queue->cells[(pos + i) & queue->mask];
+    ptrs[i] = cell->value;
+    atomic_store_explicit(&cell->sequence, pos + i + queue->mask + 1,
+                          memory_order_release);
+  }
+  return n;
+}
+
+/* A sleeper counts itself in `sleeping` before sampling the futex word and
+ * retrying, while the other side bumps the word before reading the count,
+ * all of it seq_cst. Either the retry sees the new item/slot or the waker
+ * sees the sleeper, so no wakeup can be lost. Each new item/slot wakes one
+ * sleeper only, and the waker takes the ones it woke off the count, so a
+ * burst of operations doesn't pay a syscall each while they get going. */
+
+static unsigned int queue_prepare_sleep(atomic_uint *word,
+                                        atomic_uint *sleeping) {
+  atomic_fetch_add(sleeping, 1);
+  return atomic_load(word);
+}
+
+/* the sleeper wasn't woken by queue_notify */
+static void queue_cancel_sleep(atomic_uint *sleeping) {
+  atomic_fetch_sub_explicit(sleeping, 1, memory_order_relaxed);
+}
 
-  if (queue->used++ == 0) {
-    queue->head = node;
+static uint64_t queue_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* the clock is only read on the way to a syscall, never on the fast path */
+static int queue_sleep(atomic_uint *word, atomic_uint *sleeping,
+                       unsigned int seen, _Atomic uint64_t *wait_ns,
+                       atomic_size_t *waits, const char *name) {
+  uint64_t traced = trace_now();
+  uint64_t start = queue_now_ns();
+  int ret = futex_wait(word, seen);
+  /* 0 when queue_notify woke us, it took us off the count */
+  if (ret < 0) {
+    queue_cancel_sleep(sleeping);
+  }
+  atomic_fetch_add_explicit(wait_ns, queue_now_ns() - start,
+                            memory_order_relaxed);
+  trace_span(name, traced, -1);
+  atomic_fetch_add_explicit(waits, 1, memory_order_relaxed);
+
+  if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+    LOG_ERROR_ERRNO("futex_wait");
+    return -1;
   }
+  return 0;
+}
 
-  errno = pthread_cond_broadcast(&queue->modified_item_pushed);
-  if (errno != 0) {
-    LOG_ERROR_ERRNO("pthread_cond_signal");
-    goto fail_exit;
+/* `count` items/slots were made available */
+static void queue_notify(atomic_uint *word, atomic_uint *sleeping,
+                         size_t count) {
+  atomic_fetch_add(word, 1);
+  if (atomic_load(sleeping) > 0) {
+    int woken = futex_wake(word, count < INT_MAX ? (int)count : INT_MAX);
+    if (woken > 0) {
+      atomic_fetch_sub_explicit(sleeping, woken, memory_order_relaxed);
+    }
   }
+}
 
-  errno = pthread_mutex_unlock(&queue->mutex);
-  if (errno != 0) {
-    LOG_ERROR_ERRNO("pthread_mutex_lock");
-    goto fail_exit;
+int queue_push(queue_t *queue, void *ptr) {
+  for (int spin = 0; !queue_try_push_raw(queue, ptr); spin++) {
+    if (spin < queue->spin_count) {
+      cpu_relax();
+      continue;
+    }
+
+    unsigned int seen =
+        queue_prepare_sleep(&queue->poped, &queue->push_sleeping);
+    if (queue_try_push_raw(queue, ptr)) {
+      queue_cancel_sleep(&queue->push_sleeping);
+      break;
+    }
+
+    if (queue_sleep(&queue->poped, &queue->push_sleeping, seen,
+                    &queue->push_wait_ns, &queue->push_waits,
+                    "queue push wait") < 0) {
+      goto fail_exit;
+    }
   }
 
+  queue_notify(&queue->pushed, &queue->pop_sleeping, 1);
   return 0;
 
-fail_unlock_mutex:
-  pthread_mutex_unlock(&queue->mutex);
-fail_free_node:
-  free(node);
 fail_exit:
   return -1;
 }
 
 void *queue_pop(queue_t *queue) {
-  errno = pthread_mutex_lock(&queue->mutex);
-  if (errno != 0) {
-    LOG_ERROR_ERRNO("pthread_mutex_lock");
-    goto fail_exit;
+  void *value;
+
+  for (int spin = 0; !queue_try_pop_raw(queue, &value); spin++) {
+    if (spin < queue->spin_count) {
+      cpu_relax();
+      continue;
+    }
+
+    unsigned int seen =
+        queue_prepare_sleep(&queue->pushed, &queue->pop_sleeping);
+    if (queue_try_pop_raw(queue, &value)) {
+      queue_cancel_sleep(&queue->pop_sleeping);
+      break;
+    }
+
+    if (queue_sleep(&queue->pushed, &queue->pop_sleeping, seen,
+                    &queue->pop_wait_ns, &queue->pop_waits,
+                    "queue pop wait") < 0) {
+      goto fail_exit;
+    }
   }
 
-  while (queue->used == 0) {
-    errno = pthread_cond_wait(&queue->modified_item_pushed, &queue->mutex);
-    if (errno != 0) {
-      LOG_ERROR_ERRNO("pthread_cond_wait");
-      goto fail_unlock_mutex;
+  queue_notify(&queue->poped, &queue->push_sleeping, 1);
+  return value;
+
+fail_exit:
+  return NULL;
+}
+
+bool queue_try_push(queue_t *queue, void *ptr) {
+  if (!queue_try_push_raw(queue, ptr)) {
+    return false;
+  }
+
+  queue_notify(&queue->pushed, &queue->pop_sleeping, 1);
+  return true;
+}
+
+bool queue_try_pop(queue_t *queue, void **ptr) {
+  if (!queue_try_pop_raw(queue, ptr)) {
+    return false;
+  }
+
+  queue_notify(&queue->poped, &queue->push_sleeping, 1);
+  return true;
+}
+
+size_t queue_push_batch(queue_t *queue, void *const *ptrs, size_t count) {
+  size_t pushed = 0;
+
+  while (pushed < count) {
+    size_t n = 0;
+    for (int spin = 0; n == 0; spin++) {
+      n = queue_try_push_batch_raw(queue, ptrs + pushed, count - pushed);
+      if (n > 0) {
+        break;
+      }
+
+      if (spin < queue->spin_count) {
+        cpu_relax();
+        continue;
+      }
+
+      unsigned int seen =
+          queue_prepare_sleep(&queue->poped, &queue->push_sleeping);
+      n = queue_try_push_batch_raw(queue, ptrs + pushed, count - pushed);
+      if (n > 0) {
+        queue_cancel_sleep(&queue->push_sleeping);
+        break;
+      }
+
+      if (queue_sleep(&queue->poped, &queue->push_sleeping, seen,
+                      &queue->push_wait_ns, &queue->push_waits,
+                      "queue push wait") < 0) {
+        return pushed;
+      }
     }
+
+    pushed += n;
+    queue_notify(&queue->pushed, &queue->pop_sleeping, n);
   }
 
-  queue_node_t *head = queue->head;
-  queue->head = head->prev;
+  return pushed;
+}
+
+size_t queue_pop_batch(queue_t *queue, void **ptrs, size_t max) {
+  size_t n = 0;
 
-  void *value = head->value;
-  free(head);
+  for (int spin = 0; max > 0; spin++) {
+    n = queue_try_pop_batch_raw(queue, ptrs, max);
+    if (n > 0) {
+      break;
+    }
+
+    if (spin < queue->spin_count) {
+      cpu_relax();
+      continue;
+    }
 
-  if (--queue->used == 0) {
-    queue->tail = NULL;
-    queue->head = NULL;
+    unsigned int seen =
+        queue_prepare_sleep(&queue->pushed, &queue->pop_sleeping);
+    n = queue_try_pop_batch_raw(queue, ptrs, max);
+    if (n > 0) {
+      queue_cancel_sleep(&queue->pop_sleeping);
+      break;
+    }
+
+    if (queue_sleep(&queue->pushed, &queue->pop_sleeping, seen,
+                    &queue->pop_wait_ns, &queue->pop_waits,
+                    "queue pop wait") < 0) {
+      return 0;
+    }
   }
 
-  errno = pthread_cond_broadcast(&queue->modified_item_poped);
-  if (errno != 0) {
-    LOG_ERROR_ERRNO("pthread_cond_signal");
-    goto fail_exit;
+  if (n > 0) {
+    queue_notify(&queue->poped, &queue->push_sleeping, n);
   }
+  return n;
+}
 
-  errno = pthread_mutex_unlock(&queue->mutex);
-  if (errno != 0) {
-    LOG_ERROR_ERRNO("pthread_mutex_lock");
-    goto fail_exit;
+size_t queue_try_push_batch(queue_t *queue, void *const *ptrs, size_t count) {
+  size_t n = queue_try_push_batch_raw(queue, ptrs, count);
+  if (n > 0) {
+    queue_notify(&queue->pushed, &queue->pop_sleeping, n);
   }
+  return n;
+}
 
-  return value;
+size_t queue_try_pop_batch(queue_t *queue, void **ptrs, size_t max) {
+  size_t n = queue_try_pop_batch_raw(queue, ptrs, max);
+  if (n > 0) {
+    queue_notify(&queue->poped, &queue->push_sleeping, n);
+  }
+  return n;
+}
 
-fail_unlock_mutex:
-  pthread_mutex_unlock(&queue->mutex);
-fail_exit:
-  return NULL;
+size_t queue_depth(queue_t *queue) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+  /* both move concurrently, a pop may land between the two loads */
+  return (head > tail) ? head - tail : 0;
+}
+
+void queue_get_stats(queue_t *queue, queue_stats_t *stats) {
+  stats->push_wait_ns =
+      atomic_load_explicit(&queue->push_wait_ns, memory_order_relaxed);
+  stats->push_waits =
+      atomic_load_explicit(&queue->push_waits, memory_order_relaxed);
+  stats->pop_wait_ns =
+      atomic_load_explicit(&queue->pop_wait_ns, memory_order_relaxed);
+  stats->pop_waits =
+      atomic_load_explicit(&queue->pop_waits, memory_order_relaxed);
 }
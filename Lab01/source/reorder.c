@@ -0,0 +1,205 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "reorder.h"
+
+typedef struct reorder_slot {
+  bool ready;
+  bool skipped;
+  void *item;
+  size_t bytes;
+} reorder_slot_t;
+
+struct reorder {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond; /* signaled whenever `next` moves */
+
+  size_t window;
+  size_t next;
+  bool committing; /* a pusher is running the commits, outside the lock */
+  reorder_slot_t *slots;
+
+  reorder_commit_fn_t commit;
+  void *arg;
+
+  size_t held_items;
+  size_t held_bytes;
+  reorder_stats_t stats;
+};
+
+reorder_t *reorder_create(size_t window, size_t first_id,
+                          reorder_commit_fn_t commit, void *arg) {
+  if (window == 0) {
+    LOG_ERROR("reorder window must be greater than zero");
+    goto fail_exit;
+  }
+
+  reorder_t *reorder = calloc(1, sizeof(*reorder));
+  if (reorder == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_exit;
+  }
+
+  reorder->window = window;
+  reorder->next = first_id;
+  reorder->commit = commit;
+  reorder->arg = arg;
+
+  reorder->slots = calloc(window, sizeof(*reorder->slots));
+  if (reorder->slots == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_free_reorder;
+  }
+
+  errno = pthread_mutex_init(&reorder->mutex, NULL);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_mutex_init");
+    goto fail_free_slots;
+  }
+
+  errno = pthread_cond_init(&reorder->cond, NULL);
+  if (errno != 0) {
+    LOG_ERROR_ERRNO("pthread_cond_init");
+    goto fail_destroy_mutex;
+  }
+
+  return reorder;
+
+fail_destroy_mutex:
+  pthread_mutex_destroy(&reorder->mutex);
+fail_free_slots:
+  free(reorder->slots);
+fail_free_reorder:
+  free(reorder);
+fail_exit:
+  return NULL;
+}
+
+/* called with the mutex held, returns with it held */
+static void reorder_drain(reorder_t *reorder) {
+  if (reorder->committing) {
+    return;
+  }
+
+  reorder->committing = true;
+  while (true) {
+    reorder_slot_t *slot = &reorder->slots[reorder->next % reorder->window];
+    if (!slot->ready) {
+      break;
+    }
+
+    reorder_slot_t taken = *slot;
+    size_t id = reorder->next++;
+    *slot = (reorder_slot_t){0};
+
+    if (!taken.skipped) {
+      reorder->held_items--;
+      reorder->held_bytes -= taken.bytes;
+    }
+    pthread_cond_broadcast(&reorder->cond);
+
+    if (!taken.skipped) {
+      pthread_mutex_unlock(&reorder->mutex);
+      reorder->commit(id, taken.item, reorder->arg);
+      pthread_mutex_lock(&reorder->mutex);
+      reorder->stats.committed++;
+    }
+  }
+  reorder->committing = false;
+}
+
+static int reorder_insert(reorder_t *reorder, size_t id, void *item,
+                          size_t bytes, bool skipped) {
+  pthread_mutex_lock(&reorder->mutex);
+
+  if (id < reorder->next) {
+    LOG_ERROR("id %zu was already committed", id);
+    goto fail_unlock;
+  }
+
+  while (id >= reorder->next + reorder->window) {
+    pthread_cond_wait(&reorder->cond, &reorder->mutex);
+  }
+
+  reorder_slot_t *slot = &reorder->slots[id % reorder->window];
+  if (slot->ready) {
+    LOG_ERROR("id %zu was pushed twice", id);
+    goto fail_unlock;
+  }
+
+  *slot = (reorder_slot_t){
+      .ready = true, .skipped = skipped, .item = item, .bytes = bytes};
+
+  if (skipped) {
+    reorder->stats.skipped++;
+  } else {
+    reorder->held_items++;
+    reorder->held_bytes += bytes;
+    if (reorder->held_items > reorder->stats.peak_items) {
+      reorder->stats.peak_items = reorder->held_items;
+    }
+    if (reorder->held_bytes > reorder->stats.peak_bytes) {
+      reorder->stats.peak_bytes = reorder->held_bytes;
+    }
+  }
+
+  reorder_drain(reorder);
+  pthread_mutex_unlock(&reorder->mutex);
+  return 0;
+
+fail_unlock:
+  pthread_mutex_unlock(&reorder->mutex);
+  return -1;
+}
+
+int reorder_push(reorder_t *reorder, size_t id, void *item, size_t bytes) {
+  return reorder_insert(reorder, id, item, bytes, false);
+}
+
+int reorder_skip(reorder_t *reorder, size_t id) {
+  return reorder_insert(reorder, id, NULL, 0, true);
+}
+
+bool reorder_fits(reorder_t *reorder, size_t id) {
+  pthread_mutex_lock(&reorder->mutex);
+  bool fits = id < reorder->next + reorder->window;
+  pthread_mutex_unlock(&reorder->mutex);
+  return fits;
+}
+
+void reorder_wait(reorder_t *reorder, size_t id) {
+  pthread_mutex_lock(&reorder->mutex);
+  while (id >= reorder->next + reorder->window) {
+    pthread_cond_wait(&reorder->cond, &reorder->mutex);
+  }
+  pthread_mutex_unlock(&reorder->mutex);
+}
+
+void reorder_destroy(reorder_t *reorder) {
+  pthread_mutex_lock(&reorder->mutex);
+  while (reorder->held_items > 0) {
+    reorder_slot_t *slot = &reorder->slots[reorder->next % reorder->window];
+    if (!slot->ready) {
+      slot->ready = true;
+      slot->skipped = true;
+      reorder->stats.skipped++;
+    }
+    reorder_drain(reorder);
+  }
+  pthread_mutex_unlock(&reorder->mutex);
+
+  pthread_cond_destroy(&reorder->cond);
+  pthread_mutex_destroy(&reorder->mutex);
+  free(reorder->slots);
+  free(reorder);
+}
+
+void reorder_get_stats(reorder_t *reorder, reorder_stats_t *stats) {
+  pthread_mutex_lock(&reorder->mutex);
+  *stats = reorder->stats;
+  stats->window = reorder->window;
+  stats->window_bytes = reorder->window * sizeof(*reorder->slots);
+  pthread_mutex_unlock(&reorder->mutex);
+}
@@ -0,0 +1,568 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "futex.h"
+#include "log.h"
+#include "scheduler.h"
+#include "trace.h"
+
+/* number of rounds over the other workers before going to sleep */
+#define SCHEDULER_SPIN_COUNT 64
+
+#define SCHEDULER_DEQUE_MASK (SCHEDULER_DEQUE_SIZE - 1)
+
+static _Thread_local scheduler_worker_t *current_worker = NULL;
+
+/* Chase-Lev deque with a fixed buffer, memory orders follow "Correct and
+ * Efficient Work-Stealing for Weak Memory Models" (Lê et al., PPoPP'13) */
+
+static void deque_init(scheduler_deque_t *deque) {
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  for (int i = 0; i < SCHEDULER_DEQUE_SIZE; i++) {
+    atomic_init(&deque->tasks[i], NULL);
+  }
+}
+
+static bool deque_push(scheduler_deque_t *deque, task_t *task) {
+  long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+  if (b - t >= SCHEDULER_DEQUE_SIZE) {
+    return false;
+  }
+
+  atomic_store_explicit(&deque->tasks[b & SCHEDULER_DEQUE_MASK], task,
+                        memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+  return true;
+}
+
+/* owner side, newest task first */
+static task_t *deque_take(scheduler_deque_t *deque) {
+  long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (t > b) {
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  task_t *task = atomic_load_explicit(&deque->tasks[b & SCHEDULER_DEQUE_MASK],
+                                      memory_order_relaxed);
+  if (t == b) {
+    /* last task, race against thieves for it */
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+      task = NULL;
+    }
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+  }
+
+  return task;
+}
+
+/* thief side, oldest task first */
+static task_t *deque_steal(scheduler_deque_t *deque) {
+  long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+  if (t >= b) {
+    return NULL;
+  }
+
+  task_t *task = atomic_load_explicit(&deque->tasks[t & SCHEDULER_DEQUE_MASK],
+                                      memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed)) {
+    return NULL;
+  }
+
+  return task;
+}
+
+static void scheduler_notify(scheduler_t *scheduler) {
+  atomic_fetch_add(&scheduler->epoch, 1);
+  if (atomic_load(&scheduler->sleepers) > 0) {
+    futex_wake(&scheduler->epoch, 1);
+  }
+}
+
+static void scheduler_notify_all(scheduler_t *scheduler) {
+  atomic_fetch_add(&scheduler->epoch, 1);
+  futex_wake_all(&scheduler->epoch);
+}
+
+static bool scheduler_done(scheduler_t *scheduler) {
+  return atomic_load(&scheduler->shutdown) &&
+         atomic_load(&scheduler->pending) == 0;
+}
+
+static void scheduler_run(scheduler_worker_t *worker, task_t *task) {
+  scheduler_t *scheduler = worker->scheduler;
+
+  /* the task may free itself, don't touch it afterward */
+  task->fn(task);
+  worker->executed++;
+
+  if (atomic_fetch_sub(&scheduler->pending, 1) == 1 &&
+      atomic_load(&scheduler->shutdown)) {
+    scheduler_notify_all(scheduler);
+  }
+}
+
+/* the workers of `node` first, then its injection queue */
+static task_t *scheduler_steal_node(scheduler_worker_t *worker, int node) {
+  scheduler_t *scheduler = worker->scheduler;
+  int start = rand_r(&worker->seed) % scheduler->num_workers;
+
+  for (int i = 0; i < scheduler->num_workers; i++) {
+    scheduler_worker_t *victim =
+        &scheduler->workers[(start + i) % scheduler->num_workers];
+    if (victim == worker || victim->node != node) {
+      continue;
+    }
+
+    task_t *task = deque_steal(&victim->deque);
+    if (task != NULL) {
+      worker->steals++;
+      return task;
+    }
+  }
+
+  /* a batch only from the own node, and no more than the deque has room
+   * for, only its owner pushes to it */
+  long used =
+      atomic_load_explicit(&worker->deque.bottom, memory_order_relaxed) -
+      atomic_load_explicit(&worker->deque.top, memory_order_acquire);
+  size_t room = SCHEDULER_DEQUE_SIZE - used;
+  size_t max = (node == worker->node) ? scheduler->batch : 1;
+  if (max > room) {
+    max = room;
+  }
+  if (max == 0) {
+    return NULL;
+  }
+
+  task_t *tasks[SCHEDULER_DEQUE_SIZE];
+  size_t count =
+      queue_try_pop_batch(scheduler->injection[node], (void **)tasks, max);
+  if (count == 0) {
+    return NULL;
+  }
+
+  /* oldest last, so that the owner takes them in order */
+  for (size_t i = count - 1; i > 0; i--) {
+    deque_push(&worker->deque, tasks[i]);
+  }
+  if (count > 1) {
+    scheduler_notify(scheduler);
+  }
+  return tasks[0];
+}
+
+static task_t *scheduler_steal(scheduler_worker_t *worker) {
+  scheduler_t *scheduler = worker->scheduler;
+
+  task_t *task = scheduler_steal_node(worker, worker->node);
+  for (int i = 1; task == NULL && i < scheduler->num_nodes; i++) {
+    task = scheduler_steal_node(worker,
+                                (worker->node + i) % scheduler->num_nodes);
+    if (task != NULL) {
+      worker->remote_steals++;
+    }
+  }
+
+  return task;
+}
+
+static task_t *scheduler_find_task(scheduler_worker_t *worker) {
+  task_t *task = deque_take(&worker->deque);
+  if (task != NULL) {
+    return task;
+  }
+
+  int spin_count = spin_worthwhile() ? SCHEDULER_SPIN_COUNT : 1;
+  for (int spin = 0; spin < spin_count; spin++) {
+    task = scheduler_steal(worker);
+    if (task != NULL) {
+      return task;
+    }
+    cpu_relax();
+  }
+
+  return NULL;
+}
+
+/* Same protocol as the queue: a worker registers as a sleeper before sampling
+ * the epoch and looking for work one last time, while spawners bump the epoch
+ * before checking for sleepers. */
+
+static void *scheduler_worker_main(void *arg) {
+  scheduler_worker_t *worker = arg;
+  scheduler_t *scheduler = worker->scheduler;
+  current_worker = worker;
+  trace_set_thread_name("worker", worker->id);
+
+  /* a worker that can't be pinned still runs, only slower */
+  if (scheduler->affinity != NULL) {
+    affinity_pin(scheduler->affinity, worker->node);
+  }
+
+  while (1) {
+    task_t *task = scheduler_find_task(worker);
+
+    if (task == NULL) {
+      atomic_fetch_add(&scheduler->sleepers, 1);
+      unsigned int seen = atomic_load(&scheduler->epoch);
+
+      task = scheduler_steal(worker);
+      if (task == NULL) {
+        if (scheduler_done(scheduler)) {
+          atomic_fetch_sub(&scheduler->sleepers, 1);
+          break;
+        }
+
+        struct timespec start;
+        struct timespec end;
+
+        worker->idle++;
+        uint64_t traced = trace_now();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (futex_wait(&scheduler->epoch, seen) < 0 && errno != EAGAIN &&
+            errno != EINTR) {
+          LOG_ERROR_ERRNO("futex_wait");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        worker->idle_ns += (end.tv_sec - start.tv_sec) * 1000000000ull +
+                           end.tv_nsec - start.tv_nsec;
+        trace_span("idle", traced, -1);
+      }
+
+      atomic_fetch_sub(&scheduler->sleepers, 1);
+      if (task == NULL) {
+        continue;
+      }
+    }
+
+    scheduler_run(worker, task);
+  }
+
+  current_worker = NULL;
+  return NULL;
+}
+
+scheduler_t *scheduler_create(int num_workers, size_t queue_size,
+                              const affinity_t *affinity, size_t batch) {
+  if (num_workers < 1) {
+    LOG_ERROR("scheduler needs at least one worker");
+    goto fail_exit;
+  }
+
+  scheduler_t *scheduler = aligned_alloc(QUEUE_CACHE_LINE, sizeof(*scheduler));
+  if (scheduler == NULL) {
+    LOG_ERROR_ERRNO("aligned_alloc");
+    goto fail_exit;
+  }
+
+  scheduler->num_workers = num_workers;
+  scheduler->affinity = affinity;
+  scheduler->batch = (batch > 0) ? batch : 1;
+  scheduler->num_nodes =
+      (affinity != NULL) ? affinity_node_count(affinity) : 1;
+  atomic_init(&scheduler->pending, 0);
+  atomic_init(&scheduler->shutdown, false);
+  atomic_init(&scheduler->epoch, 0);
+  atomic_init(&scheduler->sleepers, 0);
+
+  scheduler->injection =
+      calloc(scheduler->num_nodes, sizeof(*scheduler->injection));
+  if (scheduler->injection == NULL) {
+    LOG_ERROR_ERRNO("calloc");
+    goto fail_free_scheduler;
+  }
+
+  /* the nodes share the capacity a single queue would have had */
+  size_t node_queue_size =
+      (queue_size + scheduler->num_nodes - 1) / scheduler->num_nodes;
+  for (int n = 0; n < scheduler->num_nodes; n++) {
+    scheduler->injection[n] = queue_create(node_queue_size);
+    if (scheduler->injection[n] == NULL) {
+      goto fail_destroy_queues;
+    }
+  }
+
+  scheduler->workers = aligned_alloc(QUEUE_CACHE_LINE,
+                                     num_workers * sizeof(*scheduler->workers));
+  if (scheduler->workers == NULL) {
+    LOG_ERROR_ERRNO("aligned_alloc");
+    goto fail_destroy_queues;
+  }
+
+  for (int i = 0; i < num_workers; i++) {
+    scheduler_worker_t *worker = &scheduler->workers[i];
+    deque_init(&worker->deque);
+    worker->scheduler = scheduler;
+    worker->id = i;
+    worker->node = i % scheduler->num_nodes;
+    worker->seed = i + 1;
+    worker->executed = 0;
+    worker->steals = 0;
+    worker->remote_steals = 0;
+    worker->idle = 0;
+    worker->idle_ns = 0;
+  }
+
+  for (int i = 0; i < num_workers; i++) {
+    scheduler_worker_t *worker = &scheduler->workers[i];
+    errno =
+        pthread_create(&worker->thread, NULL, scheduler_worker_main, worker);
+    if (errno != 0) {
+      LOG_ERROR_ERRNO("pthread_create");
+      scheduler->num_workers = i;
+      goto fail_join_workers;
+    }
+  }
+
+  return scheduler;
+
+fail_join_workers:
+  scheduler_join(scheduler);
+  free(scheduler->workers);
+fail_destroy_queues:
+  for (int n = 0; n < scheduler->num_nodes; n++) {
+    if (scheduler->injection[n] != NULL) {
+      queue_destroy(scheduler->injection[n]);
+    }
+  }
+  free(scheduler->injection);
+fail_free_scheduler:
+  free(scheduler);
+fail_exit:
+  return NULL;
+}
+
+void scheduler_join(scheduler_t *scheduler) {
+  atomic_store(&scheduler->shutdown, true);
+  scheduler_notify_all(scheduler);
+
+  for (int i = 0; i < scheduler->num_workers; i++) {
+    pthread_join(scheduler->workers[i].thread, NULL);
+  }
+}
+
+void scheduler_destroy(scheduler_t *scheduler) {
+  for (int n = 0; n < scheduler->num_nodes; n++) {
+    queue_destroy(scheduler->injection[n]);
+  }
+  free(scheduler->injection);
+  free(scheduler->workers);
+  free(scheduler);
+}
+
+int scheduler_spawn(scheduler_t *scheduler, task_t *task) {
+  atomic_fetch_add(&scheduler->pending, 1);
+
+  scheduler_worker_t *worker = current_worker;
+  if (worker != NULL && worker->scheduler == scheduler) {
+    if (!deque_push(&worker->deque, task)) {
+      /* deque is full, running the task right away keeps memory bounded */
+      scheduler_run(worker, task);
+      return 0;
+    }
+  } else {
+    int node = affinity_current_node();
+    if (node < 0 || node >= scheduler->num_nodes) {
+      node = 0;
+    }
+
+    if (queue_push(scheduler->injection[node], task) < 0) {
+      atomic_fetch_sub(&scheduler->pending, 1);
+      goto fail_exit;
+    }
+  }
+
+  scheduler_notify(scheduler);
+  return 0;
+
+fail_exit:
+  return -1;
+}
+
+size_t scheduler_spawn_batch(scheduler_t *scheduler, task_t **tasks,
+                             size_t count) {
+  if (count == 0) {
+    return 0;
+  }
+
+  int node = affinity_current_node();
+  if (node < 0 || node >= scheduler->num_nodes) {
+    node = 0;
+  }
+
+  atomic_fetch_add(&scheduler->pending, count);
+  size_t spawned = queue_push_batch(scheduler->injection[node],
+                                    (void *const *)tasks, count);
+  if (spawned < count) {
+    atomic_fetch_sub(&scheduler->pending, count - spawned);
+  }
+
+  /* the worker that takes the batch wakes the next one */
+  scheduler_notify(scheduler);
+  return spawned;
+}
+
+typedef struct scheduler_for scheduler_for_t;
+
+typedef struct scheduler_for_task {
+  task_t task;
+  scheduler_for_t *job;
+  size_t index;
+} scheduler_for_task_t;
+
+/* freed by whoever drops the last reference: the caller may return as soon
+ * as the count drops while the last band still wakes it */
+struct scheduler_for {
+  void (*fn)(void *arg, size_t index);
+  void *arg;
+  atomic_uint remaining; /* bands not done yet, the caller sleeps on it */
+  atomic_uint refs;      /* the caller and every band */
+  scheduler_for_task_t bands[];
+};
+
+static void scheduler_for_release(scheduler_for_t *job) {
+  if (atomic_fetch_sub(&job->refs, 1) == 1) {
+    free(job);
+  }
+}
+
+static void scheduler_for_run(task_t *task) {
+  scheduler_for_task_t *band = (scheduler_for_task_t *)task;
+  scheduler_for_t *job = band->job;
+
+  job->fn(job->arg, band->index);
+  if (atomic_fetch_sub(&job->remaining, 1) == 1) {
+    futex_wake(&job->remaining, 1);
+  }
+  scheduler_for_release(job);
+}
+
+static bool scheduler_for_owns(scheduler_for_t *job, task_t *task) {
+  return task->fn == scheduler_for_run &&
+         ((scheduler_for_task_t *)task)->job == job;
+}
+
+void scheduler_parallel_for(scheduler_t *scheduler, size_t count,
+                            void (*fn)(void *arg, size_t index), void *arg) {
+  scheduler_worker_t *worker = current_worker;
+  scheduler_for_t *job = NULL;
+
+  if (worker != NULL && worker->scheduler == scheduler && count > 1) {
+    job = malloc(sizeof(*job) + (count - 1) * sizeof(*job->bands));
+  }
+
+  if (job == NULL) {
+    for (size_t i = 0; i < count; i++) {
+      fn(arg, i);
+    }
+    return;
+  }
+
+  job->fn = fn;
+  job->arg = arg;
+  atomic_init(&job->remaining, count - 1);
+  atomic_init(&job->refs, count);
+
+  for (size_t i = 1; i < count; i++) {
+    job->bands[i - 1].task.fn = scheduler_for_run;
+    job->bands[i - 1].job = job;
+    job->bands[i - 1].index = i;
+    scheduler_spawn(scheduler, &job->bands[i - 1].task);
+  }
+
+  fn(arg, 0);
+
+  /* the bands sit at the bottom of the deque above anything older, take
+   * them back until they run out, then sleep until the stolen ones are
+   * done */
+  while (atomic_load(&job->remaining) > 0) {
+    task_t *task = deque_take(&worker->deque);
+    if (task != NULL && scheduler_for_owns(job, task)) {
+      scheduler_run(worker, task);
+      continue;
+    }
+
+    if (task != NULL) {
+      deque_push(&worker->deque, task);
+    }
+
+    unsigned int remaining;
+    while ((remaining = atomic_load(&job->remaining)) > 0) {
+      futex_wait(&job->remaining, remaining);
+    }
+  }
+
+  scheduler_for_release(job);
+}
+
+size_t scheduler_injection_depth(scheduler_t *scheduler) {
+  size_t depth = 0;
+  for (int n = 0; n < scheduler->num_nodes; n++) {
+    depth += queue_depth(scheduler->injection[n]);
+  }
+  return depth;
+}
+
+size_t scheduler_injection_capacity(scheduler_t *scheduler) {
+  size_t capacity = 0;
+  for (int n = 0; n < scheduler->num_nodes; n++) {
+    capacity += scheduler->injection[n]->size;
+  }
+  return capacity;
+}
+
+void scheduler_get_injection_stats(scheduler_t *scheduler,
+                                   queue_stats_t *stats) {
+  *stats = (queue_stats_t){0};
+  for (int n = 0; n < scheduler->num_nodes; n++) {
+    queue_stats_t queue;
+    queue_get_stats(scheduler->injection[n], &queue);
+    stats->push_wait_ns += queue.push_wait_ns;
+    stats->push_waits += queue.push_waits;
+    stats->pop_wait_ns += queue.pop_wait_ns;
+    stats->pop_waits += queue.pop_waits;
+  }
+}
+
+void scheduler_print_stats(scheduler_t *scheduler, FILE *file) {
+  size_t executed = 0;
+  size_t steals = 0;
+  size_t remote_steals = 0;
+  size_t idle = 0;
+
+  for (int i = 0; i < scheduler->num_workers; i++) {
+    scheduler_worker_t *worker = &scheduler->workers[i];
+    fprintf(file, "worker %2d: %6zu tasks, %6zu steals, %6zu idle",
+            worker->id, worker->executed, worker->steals, worker->idle);
+    if (scheduler->affinity != NULL) {
+      fprintf(file, ", node %d, %zu remote", worker->node,
+              worker->remote_steals);
+    }
+    fprintf(file, "\n");
+    executed += worker->executed;
+    steals += worker->steals;
+    remote_steals += worker->remote_steals;
+    idle += worker->idle;
+  }
+
+  fprintf(file, "total    : %6zu tasks, %6zu steals, %6zu idle", executed,
+          steals, idle);
+  if (scheduler->affinity != NULL) {
+    fprintf(file, ", %zu remote", remote_steals);
+  }
+  fprintf(file, "\n");
+}
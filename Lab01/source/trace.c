@@ -0,0 +1,194 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "trace.h"
+
+#define TRACE_NAME_SIZE 32
+
+typedef struct trace_event {
+  const char *name;
+  uint64_t start;
+  uint64_t end;
+  int64_t frame;
+} trace_event_t;
+
+typedef struct trace_thread {
+  struct trace_thread *next;
+  int tid;
+  char name[TRACE_NAME_SIZE];
+  uint64_t written; /* the ring holds the last TRACE_RING_EVENTS of them */
+  trace_event_t events[TRACE_RING_EVENTS];
+} trace_thread_t;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_thread_t *trace_threads;
+static int trace_thread_count;
+static uint64_t trace_start_ns;
+
+static atomic_bool trace_recording;
+/* bumped by every begin, a thread buffer from an older run is dropped */
+static atomic_uint trace_generation;
+
+static __thread trace_thread_t *trace_self;
+static __thread unsigned int trace_self_generation;
+static __thread char trace_self_name[TRACE_NAME_SIZE];
+
+static uint64_t trace_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void trace_begin(void) {
+  pthread_mutex_lock(&trace_mutex);
+  while (trace_threads != NULL) {
+    trace_thread_t *next = trace_threads->next;
+    free(trace_threads);
+    trace_threads = next;
+  }
+  trace_thread_count = 0;
+  atomic_fetch_add(&trace_generation, 1);
+  trace_start_ns = trace_clock();
+  pthread_mutex_unlock(&trace_mutex);
+
+  atomic_store(&trace_recording, true);
+}
+
+void trace_end(void) { atomic_store(&trace_recording, false); }
+
+uint64_t trace_now(void) {
+  if (!atomic_load_explicit(&trace_recording, memory_order_relaxed)) {
+    return 0;
+  }
+  return trace_clock();
+}
+
+static trace_thread_t *trace_thread(void) {
+  unsigned int generation =
+      atomic_load_explicit(&trace_generation, memory_order_relaxed);
+  if (trace_self != NULL && trace_self_generation == generation) {
+    return trace_self;
+  }
+
+  /* the ring is written before it is read, no need to clear it */
+  trace_thread_t *self = malloc(sizeof(*self));
+  if (self == NULL) {
+    LOG_ERROR_ERRNO("malloc");
+    return NULL;
+  }
+
+  self->written = 0;
+  memcpy(self->name, trace_self_name, sizeof(self->name));
+
+  pthread_mutex_lock(&trace_mutex);
+  self->tid = ++trace_thread_count;
+  self->next = trace_threads;
+  trace_threads = self;
+  pthread_mutex_unlock(&trace_mutex);
+
+  trace_self = self;
+  trace_self_generation = generation;
+  return self;
+}
+
+void trace_span(const char *name, uint64_t start, int64_t frame) {
+  /* start is 0 when recording was off at the beginning of the span */
+  if (start == 0) {
+    return;
+  }
+
+  trace_thread_t *self = trace_thread();
+  if (self == NULL) {
+    return;
+  }
+
+  trace_event_t *event = &self->events[self->written % TRACE_RING_EVENTS];
+  event->name = name;
+  event->start = start;
+  event->end = trace_clock();
+  event->frame = frame;
+  self->written++;
+}
+
+void trace_set_thread_name(const char *name, int index) {
+  if (index < 0) {
+    snprintf(trace_self_name, sizeof(trace_self_name), "%s", name);
+  } else {
+    snprintf(trace_self_name, sizeof(trace_self_name), "%s %d", name, index);
+  }
+  if (trace_self != NULL) {
+    memcpy(trace_self->name, trace_self_name, sizeof(trace_self->name));
+  }
+}
+
+static void trace_write_event(FILE *file, const trace_thread_t *thread,
+                              const trace_event_t *event, bool *first) {
+  /* spans that began before trace_begin are clipped to it */
+  uint64_t start =
+      (event->start > trace_start_ns) ? event->start - trace_start_ns : 0;
+  uint64_t end =
+      (event->end > trace_start_ns) ? event->end - trace_start_ns : 0;
+
+  fprintf(file,
+          "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+          "\"ts\": %.3f, \"dur\": %.3f",
+          *first ? "" : ",", event->name, thread->tid, start / 1e3,
+          (end - start) / 1e3);
+  if (event->frame >= 0) {
+    fprintf(file, ", \"args\": {\"frame\": %" PRId64 "}", event->frame);
+  }
+  fprintf(file, "}");
+  *first = false;
+}
+
+int trace_write(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    LOG_ERROR_ERRNO("fopen");
+    return -1;
+  }
+
+  bool first = true;
+  uint64_t dropped = 0;
+
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  pthread_mutex_lock(&trace_mutex);
+  for (trace_thread_t *t = trace_threads; t != NULL; t = t->next) {
+    /* the threads tbb creates are left unnamed */
+    fprintf(file,
+            "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+            first ? "" : ",", t->tid,
+            (t->name[0] != '\0') ? t->name : "tbb worker");
+    first = false;
+
+    uint64_t kept = t->written;
+    if (kept > TRACE_RING_EVENTS) {
+      dropped += kept - TRACE_RING_EVENTS;
+      kept = TRACE_RING_EVENTS;
+    }
+    for (uint64_t n = t->written - kept; n < t->written; n++) {
+      trace_write_event(file, t, &t->events[n % TRACE_RING_EVENTS], &first);
+    }
+  }
+  pthread_mutex_unlock(&trace_mutex);
+  fprintf(file, "\n]}\n");
+
+  if (dropped > 0) {
+    fprintf(stderr, "trace: the %" PRIu64 " oldest spans were overwritten\n",
+            dropped);
+  }
+
+  if (fclose(file) != 0) {
+    LOG_ERROR_ERRNO("fclose");
+    return -1;
+  }
+  return 0;
+}